@@ -0,0 +1,112 @@
+#ifndef BB_EXPAND_H
+#define BB_EXPAND_H
+
+/* Offline reader for bigdata's -bb_trace output: loads bigdata.static and
+ * bigdata.bbdict and expands unit records back into per-instruction
+ * ins_ref_t, one callback per instruction, without materialising the stream.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <vector>
+#include "trace_records.h"
+
+class BBExpander {
+public:
+    bool load(const char *static_path, const char *dict_path) {
+        FILE *f = fopen(static_path, "rb");
+        if (f == NULL)
+            return false;
+        ins_static_t st;
+        while (fread(&st, sizeof(st), 1, f) == 1) {
+            if (st.num_mem < 0 || st.num_mem > INS_DYN_MAX_MEM) {
+                fclose(f);
+                return false;
+            }
+            table.push_back(st);
+        }
+        fclose(f);
+
+        f = fopen(dict_path, "rb");
+        if (f == NULL)
+            return false;
+        bb_dict_entry_t entry;
+        while (fread(&entry, sizeof(entry), 1, f) == 1) {
+            unit_first.push_back(ids.size());
+            unit_len.push_back(entry.num_instrs);
+            unit_mem.push_back(entry.num_mem);
+            ids.resize(ids.size() + entry.num_instrs);
+            if (fread(&ids[ids.size() - entry.num_instrs], sizeof(unsigned int),
+                      entry.num_instrs, f) != entry.num_instrs) {
+                fclose(f);
+                return false;
+            }
+            /* Every id must name a side table entry, and the unit's address
+             * count must be the sum of its instructions', so expand never
+             * reads past a record it has bounds-checked.
+             */
+            unsigned int num_mem = 0;
+            for (size_t i = ids.size() - entry.num_instrs; i < ids.size(); i++) {
+                if (ids[i] >= table.size()) {
+                    fclose(f);
+                    return false;
+                }
+                num_mem += table[ids[i]].num_mem;
+            }
+            if (num_mem != entry.num_mem || num_mem > BB_DYN_MAX_MEM) {
+                fclose(f);
+                return false;
+            }
+        }
+        fclose(f);
+        return true;
+    }
+
+    size_t num_units() const { return unit_len.size(); }
+
+    /* Expands the record at rec, which must end by end, calling
+     * f(const ins_ref_t &) for each instruction. Returns the number of words
+     * consumed, 0 on a bad id, an address count that does not match the
+     * unit's, or a record cut off by end.
+     */
+    template <typename F>
+    size_t expand(const uintptr_t *rec, const uintptr_t *end, F f) const {
+        if (rec >= end)
+            return 0;
+        unsigned int unit = BB_DYN_ID(rec[0]);
+        unsigned int num_mem = (unsigned int)BB_DYN_NUM_MEM(rec[0]);
+        if (unit >= unit_len.size() || num_mem != unit_mem[unit] ||
+            (size_t)(end - rec) < 1 + (size_t)num_mem)
+            return 0;
+        const uintptr_t *mem = rec + 1;
+        const unsigned int *id = &ids[unit_first[unit]];
+        for (unsigned int i = 0; i < unit_len[unit]; i++, id++) {
+            ins_ref_t ref;
+            ins_ref_from_dyn(&table[*id], mem, &ref);
+            mem += table[*id].num_mem;
+            f(ref);
+        }
+        return 1 + num_mem;
+    }
+
+    /* Expands every record in [begin, end); returns false on a corrupt record. */
+    template <typename F>
+    bool expand_all(const uintptr_t *begin, const uintptr_t *end, F f) const {
+        while (begin < end) {
+            size_t words = expand(begin, end, f);
+            if (words == 0)
+                return false;
+            begin += words;
+        }
+        return true;
+    }
+
+private:
+    std::vector<ins_static_t> table;
+    std::vector<size_t> unit_first;
+    std::vector<unsigned int> unit_len;
+    std::vector<unsigned int> unit_mem;
+    std::vector<unsigned int> ids;
+};
+
+#endif // BB_EXPAND_H
@@ -0,0 +1,57 @@
+// Expands a bigdata -bb_trace thread trace into a flat ins_ref_t file.
+// Usage: bbexpand bigdata.static bigdata.bbdict bigdata.<tid>.trace out.ins
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include "bb_expand.h"
+#include "trace_format.h"
+
+int main(int argc, char *argv[]) {
+    if (argc != 5) {
+        std::cerr << "Usage: " << argv[0] << " <static> <bbdict> <trace> <out>" << std::endl;
+        return 1;
+    }
+
+    BBExpander expander;
+    if (!expander.load(argv[1], argv[2])) {
+        std::cerr << "Cannot load dictionary " << argv[1] << " / " << argv[2] << std::endl;
+        return 1;
+    }
+
+    std::ofstream out(argv[4], std::ios::binary);
+    std::vector<ins_ref_t> refs;
+    size_t num_records = 0, num_instrs = 0;
+    bool bad = false;
+    // Chunks never split a record, so each one expands on its own.
+    bool ok = tf_read_file(argv[3], [&](const tf_file_header_t &hdr, const void *data,
+                                        size_t size) {
+        const uintptr_t *rec = static_cast<const uintptr_t *>(data);
+        const uintptr_t *end = rec + size / sizeof(uintptr_t);
+        if (bad || hdr.schema != TF_SCHEMA_BB_DYN) {
+            bad = true;
+            return;
+        }
+        while (rec < end) {
+            size_t used =
+                expander.expand(rec, end, [&](const ins_ref_t &ref) { refs.push_back(ref); });
+            if (used == 0) {
+                std::cerr << "Bad or truncated record " << num_records << std::endl;
+                bad = true;
+                return;
+            }
+            rec += used;
+            num_records++;
+        }
+        out.write(reinterpret_cast<const char *>(refs.data()), refs.size() * sizeof(ins_ref_t));
+        num_instrs += refs.size();
+        refs.clear();
+    });
+    if (!ok || bad) {
+        std::cerr << "Cannot expand " << argv[3] << ": not a -bb_trace file or corrupt" << std::endl;
+        return 1;
+    }
+
+    std::cout << "Records: " << num_records << std::endl;
+    std::cout << "Instructions: " << num_instrs << std::endl;
+    return 0;
+}
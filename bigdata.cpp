@@ -1,3 +1,321 @@
+#include <stddef.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <string.h>
+#include <map>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "dr_api.h"
+#include "drmgr.h"
+#include "drutil.h"
+#include "drreg.h"
+#include "drx.h"
+#include "drwrap.h"
+#include "drbbdup.h"
+#include "trace_records.h"
+#include "trace_format.h"
+#include "roi.h"
+
+#define MAX_NUM_INS_REFS 8192
+#define INS_BUF_SIZE (sizeof(ins_ref_t) * MAX_NUM_INS_REFS)
+/* The largest record any mode writes at once */
+#define MAX_RECORD_SIZE                                                        \
+    (sizeof(ins_ref_t) > BB_DYN_MAX_SIZE ? sizeof(ins_ref_t) : BB_DYN_MAX_SIZE)
+
+struct _per_thread_t;
+
+/* One half of a thread's double buffer. While pending it belongs to the
+ * writer thread; the app thread fills the other half.
+ */
+typedef struct _trace_buf_t {
+    byte *base;
+    size_t used;
+    uint64 timestamp;           /* tf_timestamp() when the app thread handed it off */
+    bool pending;               /* queued or being written; guarded by queue_lock */
+    struct _per_thread_t *owner;
+    struct _trace_buf_t *next;  /* writer queue link */
+} trace_buf_t;
+
+/* thread private trace file and buffers */
+typedef struct _per_thread_t {
+    byte *seg_base;
+    trace_buf_t bufs[2];
+    int cur;                    /* index of the buffer being filled */
+    void *drained;              /* signalled by the writer when a buffer is free */
+    file_t log;
+    tf_writer_t writer;         /* encodes into log; used by the writer thread */
+    uint64 num_refs;            /* updated by the writer thread */
+    uint64 num_stalls;          /* times both buffers were full */
+    uint64 num_windows;         /* -sample_trace windows completed */
+} per_thread_t;
+
+static client_id_t client_id;
+static void *mutex;        /* for multithread support */
+static uint64 num_refs;    /* keep a global instruction reference count */
+static uint64 num_stalls;
+static uint64 num_windows;
+
+/* Background writer: app threads queue full buffers, one client thread drains them */
+static void *queue_lock;
+static void *queue_event;  /* work queued or exit requested */
+static void *writer_done;
+static trace_buf_t *queue_head, *queue_tail;
+static volatile bool writer_exit;
+static bool use_static_table;
+static bool use_bb_trace;
+static uint trace_flags;   /* -compress sets TF_FLAG_COMPRESS */
+static void *writer_scratch; /* TF_WRITER_SCRATCH_SIZE, only touched by the writer */
+
+/* -sample_trace N -sample_skip M: every thread alternates between tracing N
+ * instructions and running M with only an inline countdown. drbbdup keeps
+ * both versions of each block and picks one from the thread's mode slot at
+ * block entry, so a window switch is a TLS store rather than a flush.
+ */
+enum {
+    SAMPLE_MODE_COUNT, /* default case: countdown only */
+    SAMPLE_MODE_TRACE,
+};
+static uint64 sample_trace;
+static uint64 sample_skip;
+
+/* -static_table: per-PC side table filled at BB-build time, indexed by instruction id */
+static std::vector<ins_static_t> static_table;
+static std::unordered_map<app_pc, uint> static_ids;
+
+/* -bb_trace: dictionary units keyed by (start pc, side table ids) */
+typedef struct {
+    app_pc tag;
+    uint num_mem;
+    std::vector<uint> ids;
+} bb_unit_t;
+static std::vector<bb_unit_t> bb_units;
+static std::map<std::pair<app_pc, std::vector<uint>>, uint> bb_unit_ids;
+
+/* Instruction count per unit id, for the writer thread. Chunks are only ever
+ * appended, never moved, so count_records reads them without the mutex: an id
+ * only reaches a trace buffer after bb_unit_lookup has filled in its slot, and
+ * the buffer reaches the writer through queue_lock.
+ */
+#define BB_LEN_CHUNK_BITS 16
+#define BB_LEN_CHUNK_SIZE (1u << BB_LEN_CHUNK_BITS)
+#define BB_LEN_CHUNKS 4096
+static uint *bb_unit_len[BB_LEN_CHUNKS];
+#define BB_UNIT_LEN(id) bb_unit_len[(id) >> BB_LEN_CHUNK_BITS][(id) & (BB_LEN_CHUNK_SIZE - 1)]
+
+/* Per-BB plan computed in the analysis event and consumed by the insertion event */
+typedef struct {
+    uint unit_id;   /* unit starting at this instr, or UINT_MAX */
+    uint unit_mem;  /* address count of the unit this instr starts or ends */
+    bool unit_end;  /* advance the buffer pointer before this instr */
+    int mem_index;  /* record slot of this instr's first address */
+    int num_mem;
+} bb_instr_info_t;
+
+typedef struct {
+    size_t alloc_size;
+    int num_instrs;
+    int cur;
+    bb_instr_info_t info[1];
+} bb_user_data_t;
+
+/* Allocated TLS slot offsets */
+enum {
+    BIGDATA_TLS_OFFS_BUF_PTR,
+    BIGDATA_TLS_OFFS_BUF_END, /* high-water mark: flush once the pointer reaches it */
+    BIGDATA_TLS_OFFS_MODE,    /* SAMPLE_MODE_*, read by the drbbdup dispatch */
+    BIGDATA_TLS_OFFS_LEFT,    /* instructions left in the current sample window */
+    BIGDATA_TLS_COUNT,        /* total number of TLS slots allocated */
+};
+static reg_id_t tls_seg;
+static uint tls_offs;
+static int tls_idx;
+#define TLS_SLOT(tls_base, enum_val) \
+    (void **)((byte *)(tls_base) + tls_offs + (enum_val) * sizeof(void *))
+#define BUF_PTR(tls_base) *(byte **)TLS_SLOT(tls_base, BIGDATA_TLS_OFFS_BUF_PTR)
+#define BUF_END(tls_base) *(byte **)TLS_SLOT(tls_base, BIGDATA_TLS_OFFS_BUF_END)
+#define SAMPLE_MODE(tls_base) *(ptr_int_t *)TLS_SLOT(tls_base, BIGDATA_TLS_OFFS_MODE)
+#define SAMPLE_LEFT(tls_base) *(ptr_int_t *)TLS_SLOT(tls_base, BIGDATA_TLS_OFFS_LEFT)
+
+#define MINSERT instrlist_meta_preinsert
+
+static uint64
+count_records(byte *start, byte *end, uint64 *num_instrs)
+{
+    uint64 count = 0;
+    if (use_bb_trace) {
+        /* counts unit executions */
+        *num_instrs = 0;
+        while (start < end) {
+            uintptr_t word = *(uintptr_t *)start;
+            *num_instrs += BB_UNIT_LEN(BB_DYN_ID(word));
+            start += BB_DYN_SIZE(BB_DYN_NUM_MEM(word));
+            count++;
+        }
+        return count;
+    } else if (use_static_table) {
+        while (start < end) {
+            start += INS_DYN_SIZE(INS_DYN_NUM_MEM(*(uintptr_t *)start));
+            count++;
+        }
+    } else
+        count = (end - start) / sizeof(ins_ref_t);
+    *num_instrs = count;
+    return count;
+}
+
+static void
+write_trace(void *ctx, const void *buf, size_t size)
+{
+    dr_write_file(((per_thread_t *)ctx)->log, buf, size);
+}
+
+static void
+writer_thread(void *arg)
+{
+    /* keep draining while DR synchs for exit; app threads wait on us */
+    dr_client_thread_set_suspendable(false);
+    while (true) {
+        dr_event_wait(queue_event);
+        dr_event_reset(queue_event);
+        while (true) {
+            dr_mutex_lock(queue_lock);
+            trace_buf_t *buf = queue_head;
+            if (buf != NULL) {
+                queue_head = buf->next;
+                if (queue_head == NULL)
+                    queue_tail = NULL;
+            }
+            dr_mutex_unlock(queue_lock);
+            if (buf == NULL)
+                break;
+
+            uint64 num_instrs;
+            buf->owner->num_refs +=
+                count_records(buf->base, buf->base + buf->used, &num_instrs);
+            tf_write_records(&buf->owner->writer, buf->base, buf->used, num_instrs,
+                             buf->timestamp);
+
+            dr_mutex_lock(queue_lock);
+            buf->pending = false;
+            dr_mutex_unlock(queue_lock);
+            dr_event_signal(buf->owner->drained);
+        }
+        if (writer_exit)
+            break;
+    }
+    dr_event_signal(writer_done);
+}
+
+static void
+queue_buffer(trace_buf_t *buf)
+{
+    dr_mutex_lock(queue_lock);
+    buf->pending = true;
+    buf->next = NULL;
+    if (queue_tail == NULL)
+        queue_head = buf;
+    else
+        queue_tail->next = buf;
+    queue_tail = buf;
+    dr_mutex_unlock(queue_lock);
+    dr_event_signal(queue_event);
+}
+
+static bool
+buffer_pending(trace_buf_t *buf)
+{
+    dr_mutex_lock(queue_lock);
+    bool pending = buf->pending;
+    dr_mutex_unlock(queue_lock);
+    return pending;
+}
+
+static void
+wait_for_buffer(per_thread_t *data, trace_buf_t *buf)
+{
+    while (buffer_pending(buf)) {
+        dr_event_wait(data->drained);
+        dr_event_reset(data->drained);
+    }
+}
+
+/* Hands the full buffer to the writer and keeps going in the spare one; only
+ * blocks when the spare has not been written out yet.
+ */
+static void
+flush_trace(void *drcontext)
+{
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    trace_buf_t *full = &data->bufs[data->cur];
+    byte *buf_ptr = BUF_PTR(data->seg_base);
+
+    if (buf_ptr == full->base)
+        return;
+    full->used = buf_ptr - full->base;
+    full->timestamp = tf_timestamp();
+    queue_buffer(full);
+
+    data->cur = 1 - data->cur;
+    trace_buf_t *spare = &data->bufs[data->cur];
+    if (buffer_pending(spare)) {
+        data->num_stalls++;
+        wait_for_buffer(data, spare);
+    }
+    BUF_PTR(data->seg_base) = spare->base;
+    BUF_END(data->seg_base) = spare->base + INS_BUF_SIZE - MAX_RECORD_SIZE;
+}
+
+static void
+clean_call(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    flush_trace(drcontext);
+}
+
+static void
+insert_load_buf_ptr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t reg_ptr)
+{
+    dr_insert_read_raw_tls(drcontext, ilist, where, tls_seg,
+                           tls_offs + BIGDATA_TLS_OFFS_BUF_PTR * sizeof(void *), reg_ptr);
+}
+
+static void
+insert_update_buf_ptr(void *drcontext, instrlist_t *ilist, instr_t *where,
+                      reg_id_t reg_ptr, int adjust)
+{
+    MINSERT(
+        ilist, where,
+        XINST_CREATE_add(drcontext, opnd_create_reg(reg_ptr), OPND_CREATE_INT16(adjust)));
+    dr_insert_write_raw_tls(drcontext, ilist, where, tls_seg,
+                            tls_offs + BIGDATA_TLS_OFFS_BUF_PTR * sizeof(void *), reg_ptr);
+}
+
+/* reg_ptr holds the already advanced buffer pointer; only call out to flush
+ * when it has crossed the high-water mark.
+ */
+static void
+insert_check_buf_full(void *drcontext, instrlist_t *ilist, instr_t *where,
+                      reg_id_t reg_ptr, reg_id_t reg_tmp)
+{
+    instr_t *skip = INSTR_CREATE_label(drcontext);
+    if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    dr_insert_read_raw_tls(drcontext, ilist, where, tls_seg,
+                           tls_offs + BIGDATA_TLS_OFFS_BUF_END * sizeof(void *), reg_tmp);
+    MINSERT(ilist, where,
+            XINST_CREATE_cmp(drcontext, opnd_create_reg(reg_ptr), opnd_create_reg(reg_tmp)));
+    MINSERT(ilist, where,
+            XINST_CREATE_jump_cond(drcontext, IF_X86_ELSE(DR_PRED_B, DR_PRED_CC),
+                                   opnd_create_instr(skip)));
+    dr_insert_clean_call(drcontext, ilist, where, (void *)clean_call, false, 0);
+    MINSERT(ilist, where, skip);
+    if (drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
 static void
 insert_save_opcode(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
                    reg_id_t scratch, int opcode)
@@ -164,16 +482,36 @@ insert_save_ins_ref(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_
     insert_save_fall_addr(drcontext, ilist, where, base, scratch, ins_ref->fall_addr);
     insert_save_num_operands(drcontext, ilist, where, base, scratch, ins_ref->num_operands);
 
-    for (int i = 0; i < ins_ref->num_operands; i++) {
+    for (int i = 0; i < ins_ref->num_operands && i < 4; i++) {
         insert_save_operand(drcontext, ilist, where, base, scratch, &ins_ref->operands[i], i);
     }
 
     insert_save_bubble_type(drcontext, ilist, where, base, scratch, ins_ref->bubble_type);
 }
 
+static void
+get_operand(opnd_t opnd, bool is_source, operand_t *operand)
+{
+    operand->type = OPERAND_TYPE_REGISTER; // Default initialization
+    operand->is_source = is_source;
+    operand->is_dest = !is_source;
+    operand->value.mem_addr = NULL;
+
+    if (opnd_is_reg(opnd)) {
+        operand->type = OPERAND_TYPE_REGISTER;
+        operand->value.reg = opnd_get_reg(opnd);
+    } else if (opnd_is_memory_reference(opnd)) {
+        operand->type = OPERAND_TYPE_MEMORY;
+        if (opnd_is_abs_addr(opnd))
+            operand->value.mem_addr = opnd_get_addr(opnd);
+    } else if (opnd_is_immed_int(opnd)) {
+        operand->type = OPERAND_TYPE_IMMEDIATE;
+        operand->value.imm_val = opnd_get_immed_int(opnd);
+    }
+}
 
 static void
-instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where)
+instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where)
 {
     /* We need two scratch registers */
     reg_id_t reg_ptr, reg_tmp;
@@ -187,68 +525,38 @@ instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where)
     insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
 
     // Save the instruction's program counter (PC)
-    insert_save_pc(drcontext, ilist, where, reg_ptr, reg_tmp, instr_get_app_pc(where));
+    insert_save_pc(drcontext, ilist, where, reg_ptr, reg_tmp, instr_get_app_pc(instr));
 
     // Save the instruction's opcode
-    insert_save_opcode(drcontext, ilist, where, reg_ptr, reg_tmp, instr_get_opcode(where));
+    insert_save_opcode(drcontext, ilist, where, reg_ptr, reg_tmp, instr_get_opcode(instr));
 
     // Check if the instruction is a conditional branch and save it
-    bool is_cbr = instr_is_cbr(where);
+    bool is_cbr = instr_is_cbr(instr);
     insert_save_is_cbr(drcontext, ilist, where, reg_ptr, reg_tmp, is_cbr);
 
     // Save the target address if the instruction is a branch
-    app_pc target_addr = is_cbr ? instr_get_branch_target_pc(where) : NULL;
+    app_pc target_addr = is_cbr ? instr_get_branch_target_pc(instr) : NULL;
     insert_save_target_addr(drcontext, ilist, where, reg_ptr, reg_tmp, target_addr);
 
     // Save the fall-through address
-    app_pc fall_addr = instr_get_app_pc(where) + instr_length(drcontext, where);
+    app_pc fall_addr = instr_get_app_pc(instr) + instr_length(drcontext, instr);
     insert_save_fall_addr(drcontext, ilist, where, reg_ptr, reg_tmp, fall_addr);
 
     // Save the number of operands
-    int num_operands = instr_num_srcs(where) + instr_num_dsts(where);
+    int num_operands = instr_num_srcs(instr) + instr_num_dsts(instr);
     insert_save_num_operands(drcontext, ilist, where, reg_ptr, reg_tmp, num_operands);
 
     // Save operand details
     int operand_index = 0;
-    for (int i = 0; i < instr_num_srcs(where) && operand_index < 4; i++, operand_index++) {
+    for (int i = 0; i < instr_num_srcs(instr) && operand_index < 4; i++, operand_index++) {
         operand_t operand;
-        operand.type = OPERAND_TYPE_REGISTER; // Default initialization
-        operand.is_source = true;
-        operand.is_dest = false;
-
-        opnd_t src_opnd = instr_get_src(where, i);
-        if (opnd_is_reg(src_opnd)) {
-            operand.type = OPERAND_TYPE_REGISTER;
-            operand.value.reg = opnd_get_reg(src_opnd);
-        } else if (opnd_is_memory_reference(src_opnd)) {
-            operand.type = OPERAND_TYPE_MEMORY;
-            operand.value.mem_addr = opnd_get_addr(src_opnd);
-        } else if (opnd_is_immed(src_opnd)) {
-            operand.type = OPERAND_TYPE_IMMEDIATE;
-            operand.value.imm_val = opnd_get_immed_int(src_opnd);
-        }
-
+        get_operand(instr_get_src(instr, i), true, &operand);
         insert_save_operand(drcontext, ilist, where, reg_ptr, reg_tmp, &operand, operand_index);
     }
 
-    for (int i = 0; i < instr_num_dsts(where) && operand_index < 4; i++, operand_index++) {
+    for (int i = 0; i < instr_num_dsts(instr) && operand_index < 4; i++, operand_index++) {
         operand_t operand;
-        operand.type = OPERAND_TYPE_REGISTER; // Default initialization
-        operand.is_source = false;
-        operand.is_dest = true;
-
-        opnd_t dst_opnd = instr_get_dst(where, i);
-        if (opnd_is_reg(dst_opnd)) {
-            operand.type = OPERAND_TYPE_REGISTER;
-            operand.value.reg = opnd_get_reg(dst_opnd);
-        } else if (opnd_is_memory_reference(dst_opnd)) {
-            operand.type = OPERAND_TYPE_MEMORY;
-            operand.value.mem_addr = opnd_get_addr(dst_opnd);
-        } else if (opnd_is_immed(dst_opnd)) {
-            operand.type = OPERAND_TYPE_IMMEDIATE;
-            operand.value.imm_val = opnd_get_immed_int(dst_opnd);
-        }
-
+        get_operand(instr_get_dst(instr, i), false, &operand);
         insert_save_operand(drcontext, ilist, where, reg_ptr, reg_tmp, &operand, operand_index);
     }
 
@@ -257,6 +565,7 @@ instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where)
 
     // Update the buffer pointer to the next ins_ref_t slot
     insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, sizeof(ins_ref_t));
+    insert_check_buf_full(drcontext, ilist, where, reg_ptr, reg_tmp);
 
     /* Restore scratch registers */
     if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
@@ -265,276 +574,637 @@ instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where)
     }
 }
 
+/* Everything in ins_ref_t except the memory addresses is known here, at
+ * translation time.
+ */
+static void
+get_ins_static(void *drcontext, instr_t *where, ins_static_t *st)
+{
+    ins_ref_t *ref = &st->ref;
+    int operand_index = 0;
 
+    memset(st, 0, sizeof(*st));
+    ref->pc = instr_get_app_pc(where);
+    ref->opcode = instr_get_opcode(where);
+    ref->is_cbr = instr_is_cbr(where);
+    ref->target_addr = ref->is_cbr ? instr_get_branch_target_pc(where) : NULL;
+    ref->fall_addr = ref->pc + instr_length(drcontext, where);
+    ref->num_operands = instr_num_srcs(where) + instr_num_dsts(where);
+    for (int i = 0; i < instr_num_srcs(where) && operand_index < 4; i++, operand_index++)
+        get_operand(instr_get_src(where, i), true, &ref->operands[operand_index]);
+    for (int i = 0; i < instr_num_dsts(where) && operand_index < 4; i++, operand_index++)
+        get_operand(instr_get_dst(where, i), false, &ref->operands[operand_index]);
+    ref->bubble_type = BUBBLE_NONE;
 
+    for (int i = 0; i < instr_num_srcs(where); i++) {
+        if (opnd_is_memory_reference(instr_get_src(where, i)))
+            st->num_mem++;
+    }
+    for (int i = 0; i < instr_num_dsts(where); i++) {
+        if (opnd_is_memory_reference(instr_get_dst(where, i)))
+            st->num_mem++;
+    }
+    if (st->num_mem > INS_DYN_MAX_MEM)
+        st->num_mem = INS_DYN_MAX_MEM;
+}
 
+/* Returns the id of the side table entry for this PC, adding it on first sight.
+ * Re-translations of the same PC get the same id.
+ */
+static uint
+static_table_lookup(void *drcontext, instr_t *where, int *num_mem)
+{
+    uint id;
+    dr_mutex_lock(mutex);
+    auto it = static_ids.find(instr_get_app_pc(where));
+    if (it == static_ids.end()) {
+        ins_static_t st;
+        get_ins_static(drcontext, where, &st);
+        id = (uint)static_table.size();
+        static_table.push_back(st);
+        static_ids[st.ref.pc] = id;
+    } else
+        id = it->second;
+    *num_mem = static_table[id].num_mem;
+    dr_mutex_unlock(mutex);
+    return id;
+}
 
+static void
+static_table_dump(void)
+{
+    file_t f = dr_open_file("bigdata.static", DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    DR_ASSERT(f != INVALID_FILE);
+    dr_write_file(f, static_table.data(), static_table.size() * sizeof(ins_static_t));
+    dr_close_file(f);
+}
 
+static void
+insert_save_dyn_header(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
+                       reg_id_t scratch, uint id, int num_mem)
+{
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)INS_DYN_MAKE(id, num_mem),
+                                     opnd_create_reg(scratch), ilist, where, NULL, NULL);
+    MINSERT(ilist, where,
+            XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(base, 0),
+                               opnd_create_reg(scratch)));
+}
 
+/* drutil needs reg_ptr as a scratch register, so reload it afterwards */
+static void
+insert_save_dyn_addr(void *drcontext, instrlist_t *ilist, instr_t *where, opnd_t ref,
+                     reg_id_t reg_ptr, reg_id_t reg_addr, int index)
+{
+    bool ok = drutil_insert_get_mem_addr(drcontext, ilist, where, ref, reg_addr, reg_ptr);
+    DR_ASSERT(ok);
+    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+    MINSERT(ilist, where,
+            XINST_CREATE_store(drcontext,
+                               OPND_CREATE_MEMPTR(reg_ptr, (1 + index) * sizeof(app_pc)),
+                               opnd_create_reg(reg_addr)));
+}
 
+/* -static_table: one header word plus the effective addresses, instead of the
+ * ~30 stores of a full ins_ref_t.
+ */
+static void
+instrument_instr_dyn(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where)
+{
+    int num_mem, index = 0;
+    uint id = static_table_lookup(drcontext, instr, &num_mem);
 
+    reg_id_t reg_ptr, reg_tmp;
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        return;
+    }
 
+    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+    insert_save_dyn_header(drcontext, ilist, where, reg_ptr, reg_tmp, id, num_mem);
+    for (int i = 0; i < instr_num_srcs(instr) && index < num_mem; i++) {
+        opnd_t src = instr_get_src(instr, i);
+        if (opnd_is_memory_reference(src))
+            insert_save_dyn_addr(drcontext, ilist, where, src, reg_ptr, reg_tmp, index++);
+    }
+    for (int i = 0; i < instr_num_dsts(instr) && index < num_mem; i++) {
+        opnd_t dst = instr_get_dst(instr, i);
+        if (opnd_is_memory_reference(dst))
+            insert_save_dyn_addr(drcontext, ilist, where, dst, reg_ptr, reg_tmp, index++);
+    }
+    insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, INS_DYN_SIZE(num_mem));
+    insert_check_buf_full(drcontext, ilist, where, reg_ptr, reg_tmp);
 
+    if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
 
+static uint
+bb_unit_lookup(app_pc tag, std::vector<uint> &ids, uint num_mem)
+{
+    uint id;
+    dr_mutex_lock(mutex);
+    auto key = std::make_pair(tag, ids);
+    auto it = bb_unit_ids.find(key);
+    if (it == bb_unit_ids.end()) {
+        id = (uint)bb_units.size();
+        DR_ASSERT((id >> BB_LEN_CHUNK_BITS) < BB_LEN_CHUNKS);
+        if (bb_unit_len[id >> BB_LEN_CHUNK_BITS] == NULL) {
+            bb_unit_len[id >> BB_LEN_CHUNK_BITS] =
+                (uint *)dr_global_alloc(BB_LEN_CHUNK_SIZE * sizeof(uint));
+        }
+        BB_UNIT_LEN(id) = (uint)ids.size();
+        bb_units.push_back({ tag, num_mem, ids });
+        bb_unit_ids[key] = id;
+    } else
+        id = it->second;
+    dr_mutex_unlock(mutex);
+    return id;
+}
 
+static void
+bb_dict_dump(void)
+{
+    file_t f = dr_open_file("bigdata.bbdict", DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    DR_ASSERT(f != INVALID_FILE);
+    for (const bb_unit_t &unit : bb_units) {
+        bb_dict_entry_t entry = { (uintptr_t)unit.tag, (uint)unit.ids.size(), unit.num_mem };
+        dr_write_file(f, &entry, sizeof(entry));
+        dr_write_file(f, unit.ids.data(), unit.ids.size() * sizeof(uint));
+    }
+    dr_close_file(f);
+}
 
+/* Splits the block into units that end at a CTI (traces hold several) or
+ * when the address count would overflow one record, and registers each unit
+ * in the dictionary.
+ */
+static bb_user_data_t *
+bb_plan(void *drcontext, instrlist_t *bb)
+{
+    int num_instrs = 0, start = 0;
+    for (instr_t *instr = instrlist_first_app(bb); instr != NULL;
+         instr = instr_get_next_app(instr))
+        num_instrs++;
+
+    size_t size = sizeof(bb_user_data_t) + num_instrs * sizeof(bb_instr_info_t);
+    bb_user_data_t *ud = (bb_user_data_t *)dr_thread_alloc(drcontext, size);
+    ud->alloc_size = size;
+    ud->num_instrs = num_instrs;
+    ud->cur = 0;
+
+    std::vector<uint> ids;
+    app_pc unit_tag = NULL;
+    uint unit_mem = 0;
+    int i = 0;
+    for (instr_t *instr = instrlist_first_app(bb); instr != NULL;
+         instr = instr_get_next_app(instr), i++) {
+        int num_mem;
+        uint id = static_table_lookup(drcontext, instr, &num_mem);
+        if (!ids.empty() && unit_mem + num_mem > BB_DYN_MAX_MEM) {
+            /* close the current unit before this instr */
+            ud->info[i - 1].unit_end = true;
+            ud->info[start].unit_id = bb_unit_lookup(unit_tag, ids, unit_mem);
+            for (int j = start; j < i; j++)
+                ud->info[j].unit_mem = unit_mem;
+            ids.clear();
+            unit_mem = 0;
+        }
+        if (ids.empty()) {
+            start = i;
+            unit_tag = instr_get_app_pc(instr);
+        }
+        ud->info[i].unit_id = UINT_MAX;
+        ud->info[i].unit_end = false;
+        ud->info[i].mem_index = unit_mem;
+        ud->info[i].num_mem = num_mem;
+        ids.push_back(id);
+        unit_mem += num_mem;
+        if (instr_is_cti(instr) || i == num_instrs - 1) {
+            ud->info[i].unit_end = true;
+            ud->info[start].unit_id = bb_unit_lookup(unit_tag, ids, unit_mem);
+            for (int j = start; j <= i; j++)
+                ud->info[j].unit_mem = unit_mem;
+            ids.clear();
+            unit_mem = 0;
+        }
+    }
+    return ud;
+}
 
-#include <stddef.h>
-#include <stdbool.h>
-#include "dr_api.h"
-#include "drmgr.h"
-#include "drutil.h"
-#include "drreg.h"
-#include "drx.h"
-#include "drwrap.h"
+/* -bb_trace: the unit's first instr writes the header, every instr writes its
+ * addresses at fixed offsets from the unchanged buffer pointer, and only the
+ * unit's last instr (before it can leave the block) advances the pointer.
+ */
+static void
+instrument_instr_bb(void *drcontext, instrlist_t *ilist, instr_t *instr, instr_t *where,
+                    bb_instr_info_t *info)
+{
+    int index = 0;
+    if (info->unit_id == UINT_MAX && info->num_mem == 0 && !info->unit_end)
+        return;
 
-// Enums for bubble types and operand types
-typedef enum {
-    BUBBLE_NONE,         // 不是气泡
-    BUBBLE_BAD_PREDICTION, // 错误预测
-    BUBBLE_FRONTEND,     // 前端气泡
-    BUBBLE_BACKEND       // 后端气泡
-} bubble_type_t;
-
-typedef enum {
-    OPERAND_TYPE_REGISTER,
-    OPERAND_TYPE_MEMORY,
-    OPERAND_TYPE_IMMEDIATE
-} operand_type_t;
-
-// Operand structure
-typedef struct _operand_t {
-    operand_type_t type;     // 操作数类型：寄存器、内存、立即数
-    bool is_source;          // 是否是源操作数
-    bool is_dest;            // 是否是目标操作数
-    union {
-        int reg;             // 如果是寄存器，存储寄存器编号或名称
-        void *mem_addr;      // 如果是内存，存储内存地址
-        int imm_val;         // 如果是立即数，存储立即数值
-    } value;
-} operand_t;
-
-// Instruction reference structure
-typedef struct _ins_ref_t {
-    app_pc pc;                // 指令地址
-    int opcode;               // 操作码
-    bool is_cbr;              // 是否是条件跳转指令
-    app_pc target_addr;       // 跳转的目标地址
-    app_pc fall_addr;         // 默认执行下一条指令的地址
-    int num_operands;         // 操作数个数
-    operand_t operands[4];    // 操作数特性（假设最多4个操作数，可以根据需要调整）
-    bubble_type_t bubble_type; // 气泡类型，全部是BUBBLE_NONE
-} ins_ref_t;
-
-// Function to insert save opcode
-static void insert_save_opcode(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                               reg_id_t scratch, int opcode) {
-    scratch = reg_resize_to_opsz(scratch, OPSZ_2);
-    MINSERT(ilist, where,
-            XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                  OPND_CREATE_INT16(opcode)));
-    MINSERT(ilist, where,
-            XINST_CREATE_store_2bytes(
-                drcontext, OPND_CREATE_MEM16(base, offsetof(ins_ref_t, opcode)),
-                opnd_create_reg(scratch)));
+    reg_id_t reg_ptr, reg_tmp;
+    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false); /* cannot recover */
+        return;
+    }
+
+    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+    if (info->unit_id != UINT_MAX) {
+        instrlist_insert_mov_immed_ptrsz(drcontext,
+                                         (ptr_int_t)BB_DYN_MAKE(info->unit_id, info->unit_mem),
+                                         opnd_create_reg(reg_tmp), ilist, where, NULL, NULL);
+        MINSERT(ilist, where,
+                XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_ptr, 0),
+                                   opnd_create_reg(reg_tmp)));
+    }
+    for (int i = 0; i < instr_num_srcs(instr) && index < info->num_mem; i++) {
+        opnd_t src = instr_get_src(instr, i);
+        if (opnd_is_memory_reference(src)) {
+            insert_save_dyn_addr(drcontext, ilist, where, src, reg_ptr, reg_tmp,
+                                 info->mem_index + index++);
+        }
+    }
+    for (int i = 0; i < instr_num_dsts(instr) && index < info->num_mem; i++) {
+        opnd_t dst = instr_get_dst(instr, i);
+        if (opnd_is_memory_reference(dst)) {
+            insert_save_dyn_addr(drcontext, ilist, where, dst, reg_ptr, reg_tmp,
+                                 info->mem_index + index++);
+        }
+    }
+    if (info->unit_end) {
+        insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, BB_DYN_SIZE(info->unit_mem));
+        insert_check_buf_full(drcontext, ilist, where, reg_ptr, reg_tmp);
+    }
+
+    if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+        DR_ASSERT(false);
 }
 
-// Function to insert save PC
-static void insert_save_pc(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                           reg_id_t scratch, app_pc pc) {
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)pc, opnd_create_reg(scratch),
-                                     ilist, where, NULL, NULL);
-    MINSERT(ilist, where,
-            XINST_CREATE_store(drcontext,
-                               OPND_CREATE_MEMPTR(base, offsetof(ins_ref_t, pc)),
-                               opnd_create_reg(scratch)));
+/* Records instr in whichever trace format is selected; ud is the block's
+ * -bb_trace plan.
+ */
+static void
+instrument_trace(void *drcontext, instrlist_t *bb, instr_t *instr, instr_t *where,
+                 bb_user_data_t *ud)
+{
+    if (!instr_is_app(instr) || (use_bb_trace && ud->cur >= ud->num_instrs))
+        return;
+    instrlist_set_auto_predicate(bb, DR_PRED_NONE);
+    if (use_bb_trace)
+        instrument_instr_bb(drcontext, bb, instr, where, &ud->info[ud->cur++]);
+    else if (use_static_table)
+        instrument_instr_dyn(drcontext, bb, instr, where);
+    else
+        instrument_instr(drcontext, bb, instr, where);
+    instrlist_set_auto_predicate(bb, instr_get_predicate(instr));
 }
 
-// Function to insert save conditional branch flag
-static void insert_save_cbr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                            reg_id_t scratch, bool is_cbr) {
-    MINSERT(ilist, where,
-            XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                  OPND_CREATE_INT8(is_cbr ? 1 : 0)));
-    MINSERT(ilist, where,
-            XINST_CREATE_store_1byte(
-                drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, is_cbr)),
-                opnd_create_reg(scratch)));
+/* user_data is NULL for a block outside the -roi_* region, else the
+ * -bb_trace plan or ROI_TRACED
+ */
+static dr_emit_flags_t
+event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
+                  bool translating, void **user_data)
+{
+    if (!roi_block_traced(tag))
+        *user_data = NULL;
+    else
+        *user_data = use_bb_trace ? (void *)bb_plan(drcontext, bb) : ROI_TRACED;
+    return DR_EMIT_DEFAULT;
 }
 
-// Function to insert save target address
-static void insert_save_target_addr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                                    reg_id_t scratch, app_pc target_addr) {
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)target_addr, opnd_create_reg(scratch),
-                                     ilist, where, NULL, NULL);
-    MINSERT(ilist, where,
-            XINST_CREATE_store(drcontext,
-                               OPND_CREATE_MEMPTR(base, offsetof(ins_ref_t, target_addr)),
-                               opnd_create_reg(scratch)));
+static void
+event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                      instr_t *where, void *user_data)
+{
+    bb_user_data_t *ud = use_bb_trace ? (bb_user_data_t *)user_data : NULL;
+    if (user_data != NULL)
+        instrument_trace(drcontext, bb, instr, where, ud);
+    if (ud != NULL && roi_is_last_instr(drcontext, instr))
+        dr_thread_free(drcontext, ud, ud->alloc_size);
 }
 
-// Function to insert save fall-through address
-static void insert_save_fall_addr(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                                  reg_id_t scratch, app_pc fall_addr) {
-    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)fall_addr, opnd_create_reg(scratch),
-                                     ilist, where, NULL, NULL);
-    MINSERT(ilist, where,
-            XINST_CREATE_store(drcontext,
-                               OPND_CREATE_MEMPTR(base, offsetof(ins_ref_t, fall_addr)),
-                               opnd_create_reg(scratch)));
+/* A sample window ran out: close a tracing window by handing its records to
+ * the writer, or open the next one. Overshoot is carried into the next
+ * window so the N/M ratio holds over the run.
+ */
+static void
+sample_window_end(void)
+{
+    void *drcontext = dr_get_current_drcontext();
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    if (SAMPLE_MODE(data->seg_base) == SAMPLE_MODE_TRACE) {
+        flush_trace(drcontext);
+        data->num_windows++;
+        SAMPLE_MODE(data->seg_base) = SAMPLE_MODE_COUNT;
+        SAMPLE_LEFT(data->seg_base) += sample_skip;
+    } else {
+        SAMPLE_MODE(data->seg_base) = SAMPLE_MODE_TRACE;
+        SAMPLE_LEFT(data->seg_base) += sample_trace;
+    }
 }
 
-// Function to insert save operands
-static void insert_save_operands(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                                 reg_id_t scratch, int num_operands, operand_t *operands) {
-    // Save the number of operands
+/* Both copies of a block start with this: subtract the block's length from
+ * the window and call out only when it drops below zero.
+ */
+static void
+insert_sample_countdown(void *drcontext, instrlist_t *ilist, instr_t *where, int num_instrs)
+{
+    instr_t *skip = INSTR_CREATE_label(drcontext);
+    reg_id_t reg;
+    if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    dr_insert_read_raw_tls(drcontext, ilist, where, tls_seg,
+                           tls_offs + BIGDATA_TLS_OFFS_LEFT * sizeof(void *), reg);
     MINSERT(ilist, where,
-            XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                  OPND_CREATE_INT8(num_operands)));
+            XINST_CREATE_sub_s(drcontext, opnd_create_reg(reg),
+                               OPND_CREATE_INT16(num_instrs)));
+    dr_insert_write_raw_tls(drcontext, ilist, where, tls_seg,
+                            tls_offs + BIGDATA_TLS_OFFS_LEFT * sizeof(void *), reg);
     MINSERT(ilist, where,
-            XINST_CREATE_store_1byte(
-                drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, num_operands)),
-                opnd_create_reg(scratch)));
+            XINST_CREATE_jump_cond(drcontext, IF_X86_ELSE(DR_PRED_NS, DR_PRED_PL),
+                                   opnd_create_instr(skip)));
+    dr_insert_clean_call(drcontext, ilist, where, (void *)sample_window_end, false, 0);
+    MINSERT(ilist, where, skip);
+    if (drreg_unreserve_register(drcontext, ilist, where, reg) != DRREG_SUCCESS ||
+        drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
 
-    // Save each operand
-    for (int i = 0; i < num_operands; i++) {
-        // Save operand type
-        MINSERT(ilist, where,
-                XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                      OPND_CREATE_INT8(operands[i].type)));
-        MINSERT(ilist, where,
-                XINST_CREATE_store_1byte(
-                    drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, type)),
-                    opnd_create_reg(scratch)));
+static uintptr_t
+sample_set_up_bb_dups(void *drbbdup_ctx, void *drcontext, void *tag, instrlist_t *bb,
+                      bool *enable_dups, bool *enable_dynamic_handling, void *user_data)
+{
+    if (drbbdup_register_case_encoding(drbbdup_ctx, SAMPLE_MODE_TRACE) != DRBBDUP_SUCCESS)
+        DR_ASSERT(false);
+    *enable_dups = true;
+    *enable_dynamic_handling = false;
+    return SAMPLE_MODE_COUNT;
+}
 
-        // Save is_source
-        MINSERT(ilist, where,
-                XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                      OPND_CREATE_INT8(operands[i].is_source ? 1 : 0)));
-        MINSERT(ilist, where,
-                XINST_CREATE_store_1byte(
-                    drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, is_source)),
-                    opnd_create_reg(scratch)));
+/* Shared by both cases: the block's app instruction count, shifted left, and
+ * in bit 0 whether it lies inside the -roi_* region. A block outside gets
+ * only the -roi_skip countdown.
+ */
+#define SAMPLE_NUM_INSTRS(orig) ((int)((ptr_uint_t)(orig) >> 1))
+#define SAMPLE_IN_ROI(orig) (((ptr_uint_t)(orig) & 1) != 0)
 
-        // Save is_dest
-        MINSERT(ilist, where,
-                XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                      OPND_CREATE_INT8(operands[i].is_dest ? 1 : 0)));
-        MINSERT(ilist, where,
-                XINST_CREATE_store_1byte(
-                    drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, is_dest)),
-                    opnd_create_reg(scratch)));
+static void
+sample_analyze_orig(void *drcontext, void *tag, instrlist_t *bb, void *user_data,
+                    void **orig_analysis_data)
+{
+    *orig_analysis_data =
+        (void *)((ptr_uint_t)roi_block_length(bb) << 1 | (roi_block_traced(tag) ? 1 : 0));
+}
 
-        // Save operand value
-        switch (operands[i].type) {
-        case OPERAND_TYPE_REGISTER:
-            MINSERT(ilist, where,
-                    XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                          OPND_CREATE_INT32(operands[i].value.reg)));
-            MINSERT(ilist, where,
-                    XINST_CREATE_store_4bytes(
-                        drcontext, OPND_CREATE_MEM32(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, value.reg)),
-                        opnd_create_reg(scratch)));
-            break;
-        case OPERAND_TYPE_MEMORY:
-            instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)operands[i].value.mem_addr, opnd_create_reg(scratch),
-                                             ilist, where, NULL, NULL);
-            MINSERT(ilist, where,
-                    XINST_CREATE_store(drcontext,
-                                       OPND_CREATE_MEMPTR(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, value.mem_addr)),
-                                       opnd_create_reg(scratch)));
-            break;
-        case OPERAND_TYPE_IMMEDIATE:
-            MINSERT(ilist, where,
-                    XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                          OPND_CREATE_INT32(operands[i].value.imm_val)));
-            MINSERT(ilist, where,
-                    XINST_CREATE_store_4bytes(
-                        drcontext, OPND_CREATE_MEM32(base, offsetof(ins_ref_t, operands) + i * sizeof(operand_t) + offsetof(operand_t, value.imm_val)),
-                        opnd_create_reg(scratch)));
-            break;
-        }
-    }
+static void
+sample_destroy_orig_analysis(void *drcontext, void *user_data, void *orig_analysis_data)
+{
+    /* nothing allocated: the count is stored in the pointer itself */
 }
 
-// Function to insert save bubble type
-static void insert_save_bubble_type(void *drcontext, instrlist_t *ilist, instr_t *where, reg_id_t base,
-                                    reg_id_t scratch, bubble_type_t bubble_type) {
-    MINSERT(ilist, where,
-            XINST_CREATE_load_int(drcontext, opnd_create_reg(scratch),
-                                  OPND_CREATE_INT8(bubble_type)));
-    MINSERT(ilist, where,
-            XINST_CREATE_store_1byte(
-                drcontext, OPND_CREATE_MEM8(base, offsetof(ins_ref_t, bubble_type)),
-                opnd_create_reg(scratch)));
+static void
+sample_analyze_case(void *drcontext, void *tag, instrlist_t *bb, uintptr_t encoding,
+                    void *user_data, void *orig_analysis_data, void **case_analysis_data)
+{
+    *case_analysis_data =
+        encoding == SAMPLE_MODE_TRACE && use_bb_trace && SAMPLE_IN_ROI(orig_analysis_data)
+        ? bb_plan(drcontext, bb)
+        : NULL;
 }
 
-// Main instrumentation function
-static void instrument_instr(void *drcontext, instrlist_t *ilist, instr_t *where) {
-    /* We need two scratch registers */
-    reg_id_t reg_ptr, reg_tmp;
-    if (drreg_reserve_register(drcontext, ilist, where, NULL, &reg_ptr) !=
-            DRREG_SUCCESS ||
-        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_tmp) !=
-            DRREG_SUCCESS) {
-        DR_ASSERT(false); /* cannot recover */
+static void
+sample_destroy_case_analysis(void *drcontext, uintptr_t encoding, void *user_data,
+                             void *orig_analysis_data, void *case_analysis_data)
+{
+    bb_user_data_t *ud = (bb_user_data_t *)case_analysis_data;
+    if (ud != NULL)
+        dr_thread_free(drcontext, ud, ud->alloc_size);
+}
+
+static void
+sample_instrument_instr(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                        instr_t *where, uintptr_t encoding, void *user_data,
+                        void *orig_analysis_data, void *case_analysis_data)
+{
+    bool is_first;
+    if (drbbdup_is_first_instr(drcontext, instr, &is_first) != DRBBDUP_SUCCESS)
+        DR_ASSERT(false);
+    if (is_first)
+        roi_insert_skip_countdown(drcontext, bb, where, SAMPLE_NUM_INSTRS(orig_analysis_data));
+    if (!SAMPLE_IN_ROI(orig_analysis_data))
         return;
+    if (is_first)
+        insert_sample_countdown(drcontext, bb, where, SAMPLE_NUM_INSTRS(orig_analysis_data));
+    if (encoding == SAMPLE_MODE_TRACE)
+        instrument_trace(drcontext, bb, instr, where, (bb_user_data_t *)case_analysis_data);
+}
+
+static void
+event_thread_init(void *drcontext)
+{
+    char name[MAXIMUM_PATH];
+    per_thread_t *data = (per_thread_t *)dr_thread_alloc(drcontext, sizeof(per_thread_t));
+    DR_ASSERT(data != NULL);
+    drmgr_set_tls_field(drcontext, tls_idx, data);
+
+    data->seg_base = (byte *)dr_get_dr_segment_base(tls_seg);
+    DR_ASSERT(data->seg_base != NULL);
+    for (int i = 0; i < 2; i++) {
+        data->bufs[i].base = (byte *)dr_raw_mem_alloc(
+            INS_BUF_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+        DR_ASSERT(data->bufs[i].base != NULL);
+        data->bufs[i].used = 0;
+        data->bufs[i].pending = false;
+        data->bufs[i].owner = data;
+        data->bufs[i].next = NULL;
     }
+    data->cur = 0;
+    data->drained = dr_event_create();
+    BUF_PTR(data->seg_base) = data->bufs[0].base;
+    BUF_END(data->seg_base) = data->bufs[0].base + INS_BUF_SIZE - MAX_RECORD_SIZE;
+    data->num_refs = 0;
+    data->num_stalls = 0;
+    data->num_windows = 0;
+    /* threads start in a tracing window */
+    SAMPLE_MODE(data->seg_base) = SAMPLE_MODE_TRACE;
+    SAMPLE_LEFT(data->seg_base) = (ptr_int_t)sample_trace;
+
+    dr_snprintf(name, BUFFER_SIZE_ELEMENTS(name), "bigdata.%d.trace",
+                dr_get_thread_id(drcontext));
+    NULL_TERMINATE_BUFFER(name);
+    data->log = dr_open_file(name,
+#ifndef WINDOWS
+                             DR_FILE_CLOSE_ON_FORK |
+#endif
+                                 DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    DR_ASSERT(data->log != INVALID_FILE);
+    /* the writer thread owns data->writer from the first queued buffer on */
+    tf_writer_init(&data->writer, write_trace, data,
+                   use_bb_trace           ? TF_SCHEMA_BB_DYN
+                       : use_static_table ? TF_SCHEMA_INS_DYN
+                                          : TF_SCHEMA_INS_REF,
+                   0, dr_get_thread_id(drcontext), trace_flags, writer_scratch);
+}
 
-    insert_load_buf_ptr(drcontext, ilist, where, reg_ptr);
+static void
+event_thread_exit(void *drcontext)
+{
+    per_thread_t *data;
+    flush_trace(drcontext);
+    data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    /* the writer must be done with both halves before the file goes away */
+    wait_for_buffer(data, &data->bufs[0]);
+    wait_for_buffer(data, &data->bufs[1]);
+    dr_mutex_lock(mutex);
+    num_refs += data->num_refs;
+    num_stalls += data->num_stalls;
+    num_windows += data->num_windows;
+    dr_mutex_unlock(mutex);
+    /* patch the final instruction count into the file header */
+    if (dr_file_seek(data->log, 0, DR_SEEK_SET))
+        dr_write_file(data->log, &data->writer.header, sizeof(data->writer.header));
+    dr_close_file(data->log);
+    dr_event_destroy(data->drained);
+    dr_raw_mem_free(data->bufs[0].base, INS_BUF_SIZE);
+    dr_raw_mem_free(data->bufs[1].base, INS_BUF_SIZE);
+    dr_thread_free(drcontext, data, sizeof(per_thread_t));
+}
 
-    // Get instruction details
-    app_pc pc = instr_get_app_pc(where);
-    int opcode = instr_get_opcode(where);
-    bool is_cbr = instr_is_cbr(where);
-    app_pc target_addr = is_cbr ? instr_get_branch_target_pc(where) : NULL;
-    app_pc fall_addr = pc + instr_length(drcontext, where);
+static void
+event_exit(void)
+{
+    writer_exit = true;
+    dr_event_signal(queue_event);
+    dr_event_wait(writer_done);
+
+    dr_log(NULL, DR_LOG_ALL, 1, "Client 'bigdata' num refs seen: " SZFMT "\n", num_refs);
+    dr_log(NULL, DR_LOG_ALL, 1, "Client 'bigdata' writer stalls: " SZFMT "\n", num_stalls);
+    if (sample_trace > 0) {
+        dr_log(NULL, DR_LOG_ALL, 1, "Client 'bigdata' sample windows: " SZFMT "\n",
+               num_windows);
+    }
+    if (num_stalls > 0) {
+        dr_fprintf(STDERR, "bigdata: app threads blocked %llu times on a full double buffer\n",
+                   num_stalls);
+    }
+    if (use_static_table || use_bb_trace)
+        static_table_dump();
+    if (use_bb_trace)
+        bb_dict_dump();
+    for (int i = 0; i < BB_LEN_CHUNKS && bb_unit_len[i] != NULL; i++)
+        dr_global_free(bb_unit_len[i], BB_LEN_CHUNK_SIZE * sizeof(uint));
+    if (!dr_raw_tls_cfree(tls_offs, BIGDATA_TLS_COUNT))
+        DR_ASSERT(false);
 
-    // Retrieve operand details
-    int num_operands = instr_num_srcs(where) + instr_num_dsts(where);
-    operand_t operands[4]; // Ensure that this matches the max size defined in ins_ref_t
-    for (int i = 0; i < instr_num_srcs(where); i++) {
-        operands[i].type = instr_operand_is_memory(where, i) ? OPERAND_TYPE_MEMORY :
-                           instr_operand_is_immed(where, i) ? OPERAND_TYPE_IMMEDIATE :
-                           OPERAND_TYPE_REGISTER;
-        operands[i].is_source = true;
-        operands[i].is_dest = false;
-        if (operands[i].type == OPERAND_TYPE_REGISTER) {
-            operands[i].value.reg = opnd_get_reg(instr_get_src(where, i));
-        } else if (operands[i].type == OPERAND_TYPE_MEMORY) {
-            operands[i].value.mem_addr = opnd_get_disp(instr_get_src(where, i));
-        } else if (operands[i].type == OPERAND_TYPE_IMMEDIATE) {
-            operands[i].value.imm_val = opnd_get_immed_int(instr_get_src(where, i));
+    if (sample_trace > 0) {
+        if (drbbdup_exit() != DRBBDUP_SUCCESS)
+            DR_ASSERT(false);
+    } else if (!roi_unregister_bb_events())
+        DR_ASSERT(false);
+    if (!drmgr_unregister_tls_field(tls_idx) ||
+        !drmgr_unregister_thread_init_event(event_thread_init) ||
+        !drmgr_unregister_thread_exit_event(event_thread_exit) ||
+        drreg_exit() != DRREG_SUCCESS)
+        DR_ASSERT(false);
+
+    dr_event_destroy(queue_event);
+    dr_event_destroy(writer_done);
+    dr_global_free(writer_scratch, TF_WRITER_SCRATCH_SIZE);
+    dr_mutex_destroy(queue_lock);
+    dr_mutex_destroy(mutex);
+    roi_exit();
+    drutil_exit();
+    drmgr_exit();
+}
+
+DR_EXPORT void
+dr_client_main(client_id_t id, int argc, const char *argv[])
+{
+    drreg_options_t ops = { sizeof(ops), 3, false };
+    dr_set_client_name("DynamoRIO Client 'bigdata'", "http://dynamorio.org/issues");
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-static_table") == 0)
+            use_static_table = true;
+        else if (strcmp(argv[i], "-bb_trace") == 0)
+            use_bb_trace = true;
+        else if (strcmp(argv[i], "-compress") == 0)
+            trace_flags |= TF_FLAG_COMPRESS;
+        else if (strcmp(argv[i], "-sample_trace") == 0 && i + 1 < argc)
+            dr_sscanf(argv[++i], UINT64_FORMAT_STRING, &sample_trace);
+        else if (strcmp(argv[i], "-sample_skip") == 0 && i + 1 < argc)
+            dr_sscanf(argv[++i], UINT64_FORMAT_STRING, &sample_skip);
+        else if (!roi_parse_option(argc, argv, &i)) {
+            dr_fprintf(STDERR,
+                       "Error: unknown option %s: only -static_table, -bb_trace, "
+                       "-compress, -sample_trace <N>, -sample_skip <M> and the -roi_* "
+                       "options are supported\n",
+                       argv[i]);
+            dr_abort();
         }
     }
-    for (int i = 0; i < instr_num_dsts(where); i++) {
-        operands[instr_num_srcs(where) + i].type = instr_operand_is_memory(where, instr_num_srcs(where) + i) ? OPERAND_TYPE_MEMORY :
-                                                   instr_operand_is_immed(where, instr_num_srcs(where) + i) ? OPERAND_TYPE_IMMEDIATE :
-                                                   OPERAND_TYPE_REGISTER;
-        operands[instr_num_srcs(where) + i].is_source = false;
-        operands[instr_num_srcs(where) + i].is_dest = true;
-        if (operands[instr_num_srcs(where) + i].type == OPERAND_TYPE_REGISTER) {
-            operands[instr_num_srcs(where) + i].value.reg = opnd_get_reg(instr_get_dst(where, i));
-        } else if (operands[instr_num_srcs(where) + i].type == OPERAND_TYPE_MEMORY) {
-            operands[instr_num_srcs(where) + i].value.mem_addr = opnd_get_disp(instr_get_dst(where, i));
-        } else if (operands[instr_num_srcs(where) + i].type == OPERAND_TYPE_IMMEDIATE) {
-            operands[instr_num_srcs(where) + i].value.imm_val = opnd_get_immed_int(instr_get_dst(where, i));
-        }
+    if ((sample_trace == 0) != (sample_skip == 0)) {
+        dr_fprintf(STDERR, "Error: -sample_trace and -sample_skip go together\n");
+        dr_abort();
+    }
+    /* both would need the one drbbdup instance */
+    if (sample_trace > 0 && roi_func[0] != '\0') {
+        dr_fprintf(STDERR, "Error: -roi_func cannot be combined with -sample_trace\n");
+        dr_abort();
     }
 
-    // Save instruction details
-    insert_save_pc(drcontext, ilist, where, reg_ptr, reg_tmp, pc);
-    insert_save_opcode(drcontext, ilist, where, reg_ptr, reg_tmp, opcode);
-    insert_save_cbr(drcontext, ilist, where, reg_ptr, reg_tmp, is_cbr);
-    insert_save_target_addr(drcontext, ilist, where, reg_ptr, reg_tmp, target_addr);
-    insert_save_fall_addr(drcontext, ilist, where, reg_ptr, reg_tmp, fall_addr);
-    insert_save_operands(drcontext, ilist, where, reg_ptr, reg_tmp, num_operands, operands);
-    insert_save_bubble_type(drcontext, ilist, where, reg_ptr, reg_tmp, BUBBLE_NONE); // or whatever logic you have for bubble_type
+    if (!drmgr_init() || drreg_init(&ops) != DRREG_SUCCESS || !drutil_init())
+        DR_ASSERT(false);
+    roi_init();
 
-    insert_update_buf_ptr(drcontext, ilist, where, reg_ptr, sizeof(ins_ref_t));
+    dr_register_exit_event(event_exit);
+    if (!drmgr_register_thread_init_event(event_thread_init) ||
+        !drmgr_register_thread_exit_event(event_thread_exit))
+        DR_ASSERT(false);
 
-    /* Restore scratch registers */
-    if (drreg_unreserve_register(drcontext, ilist, where, reg_ptr) != DRREG_SUCCESS ||
-        drreg_unreserve_register(drcontext, ilist, where, reg_tmp) != DRREG_SUCCESS)
+    client_id = id;
+    mutex = dr_mutex_create();
+    queue_lock = dr_mutex_create();
+    queue_event = dr_event_create();
+    writer_done = dr_event_create();
+    writer_scratch = dr_global_alloc(TF_WRITER_SCRATCH_SIZE);
+    if (!dr_create_client_thread(writer_thread, NULL))
         DR_ASSERT(false);
+
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+
+    if (!dr_raw_tls_calloc(&tls_seg, &tls_offs, BIGDATA_TLS_COUNT, 0))
+        DR_ASSERT(false);
+
+    /* drbbdup takes over the block events when sampling */
+    if (sample_trace > 0) {
+        drbbdup_options_t opts = {
+            sizeof(opts),
+        };
+        opts.set_up_bb_dups = sample_set_up_bb_dups;
+        opts.analyze_orig = sample_analyze_orig;
+        opts.destroy_orig_analysis = sample_destroy_orig_analysis;
+        opts.analyze_case = sample_analyze_case;
+        opts.destroy_case_analysis = sample_destroy_case_analysis;
+        opts.instrument_instr = sample_instrument_instr;
+        opts.runtime_case_opnd = dr_raw_tls_opnd(
+            GLOBAL_DCONTEXT, tls_seg, tls_offs + BIGDATA_TLS_OFFS_MODE * sizeof(void *));
+        opts.max_case_encoding = SAMPLE_MODE_TRACE;
+        opts.non_default_case_limit = 1;
+        if (drbbdup_init(&opts) != DRBBDUP_SUCCESS)
+            DR_ASSERT(false);
+    } else if (!roi_register_bb_events(event_bb_analysis, event_app_instruction))
+        DR_ASSERT(false);
+
+    dr_log(NULL, DR_LOG_ALL, 1, "Client 'bigdata' initializing\n");
 }
@@ -1,36 +1,110 @@
+#include <stddef.h> /* for offsetof */
 #include "dr_api.h"
 #include "drmgr.h"
+#include "drreg.h"
 #include "drutil.h"
+#include "trace_records.h"
+#include "trace_format.h"
+#include "roi.h"
 #include <string.h>
 
+// 每个线程缓冲的分支记录数，缓冲区满了才统一做一次预测
+#define MAX_NUM_BRANCH_REFS 4096
+#define BRANCH_BUF_SIZE (sizeof(branch_ref_t) * MAX_NUM_BRANCH_REFS)
+// 每个线程的预测表项数（2的幂），按分支PC的哈希索引
+#define PREDICT_TABLE_SIZE 4096
+
+/* 分支的实际方向在分支指令之前内联写入线程缓冲区：x86上用与jcc同条件的
+ * setcc取出标志位，不需要每条分支一次清理调用。条件不在标志位里的分支
+ * （jecxz、loop）由清理调用从机器状态算出方向，其他架构退回到
+ * dr_insert_cbr_instrumentation。
+ */
+typedef struct {
+    byte *seg_base;
+    branch_ref_t *buf_base;
+    // 使用简单的上次结果预测算法，每个分支（哈希表项）记住自己上次的结果
+    bool last_result[PREDICT_TABLE_SIZE];
+    uint64 predict_success;
+    uint64 predict_failure;
+    // -trace：每批分支同时写入branches.<tid>.trc，供bptest/bpreplay离线重放
+    file_t trace_file;
+    tf_writer_t writer;
+    void *scratch;
+} per_thread_t;
+
 static file_t log_file;
-static void *mutex;
+static void *mutex; /* 只在线程退出汇总计数时使用 */
 static uint64 predict_success = 0;
 static uint64 predict_failure = 0;
+static bool trace_branches; /* -trace */
+static uint trace_flags;    /* -compress sets TF_FLAG_COMPRESS */
+
+/* 分配的raw TLS槽 */
+enum {
+    BP_TLS_OFFS_BUF_PTR,
+    BP_TLS_OFFS_BUF_END, /* 指针到达这里就处理整批记录 */
+    BP_TLS_COUNT,
+};
+static reg_id_t tls_seg;
+static uint tls_offs;
+static int tls_idx;
+#define TLS_SLOT(tls_base, enum_val) \
+    (void **)((byte *)(tls_base) + tls_offs + (enum_val) * sizeof(void *))
+#define BUF_PTR(tls_base) *(branch_ref_t **)TLS_SLOT(tls_base, BP_TLS_OFFS_BUF_PTR)
+#define BUF_END(tls_base) *(branch_ref_t **)TLS_SLOT(tls_base, BP_TLS_OFFS_BUF_END)
 
-// 使用简单的上次结果预测算法
-static bool last_result = true;
+#define MINSERT instrlist_meta_preinsert
 
 static void event_exit(void);
+static void event_thread_init(void *drcontext);
+static void event_thread_exit(void *drcontext);
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data);
-static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data);
-static void record_branch_prediction(void *drcontext, instr_t *instr, bool taken);
+static void event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, instr_t *where, void *user_data);
+static void predict_batch(void *drcontext);
 
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
+    drreg_options_t ops = { sizeof(ops), 3, false };
     dr_set_client_name("DynamoRIO Branch Prediction", "http://dynamorio.org/issues");
 
-    if (!drmgr_init() || !drutil_init()) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-trace") == 0)
+            trace_branches = true;
+        else if (strcmp(argv[i], "-compress") == 0)
+            trace_flags |= TF_FLAG_COMPRESS;
+        else if (!roi_parse_option(argc, argv, &i)) {
+            dr_fprintf(STDERR, "Error: unknown option %s: only -trace, -compress and the -roi_* options are supported\n", argv[i]);
+            dr_abort();
+        }
+    }
+#ifndef X86
+    // 重复块的最后一条指令前只能在where插桩，非x86的分支记录还做不到
+    if (roi_func[0] != '\0') {
+        dr_fprintf(STDERR, "Error: -roi_func is only supported on x86\n");
+        dr_abort();
+    }
+#endif
+
+    if (!drmgr_init() || !drutil_init() || drreg_init(&ops) != DRREG_SUCCESS) {
         DR_ASSERT(false);
         return;
     }
+    roi_init();
 
     log_file = dr_open_file("branch_prediction.log", DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
     DR_ASSERT(log_file != INVALID_FILE);
     mutex = dr_mutex_create();
 
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+    if (!dr_raw_tls_calloc(&tls_seg, &tls_offs, BP_TLS_COUNT, 0))
+        DR_ASSERT(false);
+
     dr_register_exit_event(event_exit);
-    drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, NULL);
+    if (!drmgr_register_thread_init_event(event_thread_init) ||
+        !drmgr_register_thread_exit_event(event_thread_exit) ||
+        !roi_register_bb_events(event_bb_analysis, event_app_instruction))
+        DR_ASSERT(false);
 
     dr_log(NULL, DR_LOG_ALL, 1, "Client 'branch_prediction' initializing\n");
 }
@@ -42,39 +116,226 @@ static void event_exit(void)
     dr_fprintf(log_file, "Prediction Failure: %llu\n", predict_failure);
     dr_mutex_unlock(mutex);
 
+    if (!roi_unregister_bb_events() ||
+        !dr_raw_tls_cfree(tls_offs, BP_TLS_COUNT) ||
+        !drmgr_unregister_tls_field(tls_idx) ||
+        !drmgr_unregister_thread_init_event(event_thread_init) ||
+        !drmgr_unregister_thread_exit_event(event_thread_exit))
+        DR_ASSERT(false);
+
     dr_mutex_destroy(mutex);
     dr_close_file(log_file);
+    roi_exit();
+    drreg_exit();
     drutil_exit();
     drmgr_exit();
 }
 
-static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
+static void write_trace(void *ctx, const void *buf, size_t size)
 {
-    return DR_EMIT_DEFAULT;
+    dr_write_file(((per_thread_t *)ctx)->trace_file, buf, size);
 }
 
-static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data)
+static void event_thread_init(void *drcontext)
 {
-    if (instr_is_app(instr) && instr_is_cbr(instr)) {
-        dr_insert_clean_call(drcontext, bb, instr, (void *)record_branch_prediction, false, 2,
-                             OPND_CREATE_INTPTR(instr), OPND_CREATE_INTPTR(instr_is_cti_short(instr)));
+    per_thread_t *data = (per_thread_t *)dr_thread_alloc(drcontext, sizeof(per_thread_t));
+    DR_ASSERT(data != NULL);
+    drmgr_set_tls_field(drcontext, tls_idx, data);
+
+    data->seg_base = (byte *)dr_get_dr_segment_base(tls_seg);
+    data->buf_base = (branch_ref_t *)dr_raw_mem_alloc(BRANCH_BUF_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    DR_ASSERT(data->seg_base != NULL && data->buf_base != NULL);
+    BUF_PTR(data->seg_base) = data->buf_base;
+    BUF_END(data->seg_base) = data->buf_base + MAX_NUM_BRANCH_REFS;
+
+    for (int i = 0; i < PREDICT_TABLE_SIZE; i++)
+        data->last_result[i] = true;
+    data->predict_success = 0;
+    data->predict_failure = 0;
+
+    if (trace_branches) {
+        char name[64];
+        dr_snprintf(name, BUFFER_SIZE_ELEMENTS(name), "branches.%d.trc", dr_get_thread_id(drcontext));
+        NULL_TERMINATE_BUFFER(name);
+        data->trace_file = dr_open_file(name, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+        DR_ASSERT(data->trace_file != INVALID_FILE);
+        data->scratch = dr_thread_alloc(drcontext, TF_WRITER_SCRATCH_SIZE);
+        tf_writer_init(&data->writer, write_trace, data, TF_SCHEMA_BRANCH_REF, 0,
+                       dr_get_thread_id(drcontext), trace_flags, data->scratch);
     }
-    return DR_EMIT_DEFAULT;
 }
 
-static void record_branch_prediction(void *drcontext, instr_t *instr, bool taken)
+static void event_thread_exit(void *drcontext)
 {
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    predict_batch(drcontext);
+
     dr_mutex_lock(mutex);
+    predict_success += data->predict_success;
+    predict_failure += data->predict_failure;
+    dr_mutex_unlock(mutex);
 
-    // 预测上次分支结果
-    bool prediction = last_result;
-    last_result = taken;
+    if (trace_branches) {
+        dr_close_file(data->trace_file);
+        dr_thread_free(drcontext, data->scratch, TF_WRITER_SCRATCH_SIZE);
+    }
+
+    dr_raw_mem_free(data->buf_base, BRANCH_BUF_SIZE);
+    dr_thread_free(drcontext, data, sizeof(per_thread_t));
+}
 
-    if (prediction == taken) {
-        predict_success++;
-    } else {
-        predict_failure++;
+// 分支PC到预测表项；高位折叠进来，相距4K整数倍的分支不会总是冲突
+static inline uint predict_index(uint64_t pc)
+{
+    return (uint)((pc ^ (pc >> 12)) & (PREDICT_TABLE_SIZE - 1));
+}
+
+// 对缓冲区里的整批分支做预测，然后清空缓冲区；表和计数都是本线程的，不加锁
+static void predict_batch(void *drcontext)
+{
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    branch_ref_t *buf_ptr = BUF_PTR(data->seg_base);
+
+    for (branch_ref_t *ref = data->buf_base; ref < buf_ptr; ref++) {
+        // 预测该分支上次的结果
+        bool *last_result = &data->last_result[predict_index(ref->pc)];
+        bool taken = ref->taken != 0;
+        bool prediction = *last_result;
+        *last_result = taken;
+
+        if (prediction == taken) {
+            data->predict_success++;
+        } else {
+            data->predict_failure++;
+        }
     }
 
-    dr_mutex_unlock(mutex);
+    if (trace_branches && buf_ptr > data->buf_base) {
+        tf_write_records(&data->writer, data->buf_base, (byte *)buf_ptr - (byte *)data->buf_base, 0,
+                         tf_timestamp());
+    }
+    BUF_PTR(data->seg_base) = data->buf_base;
+}
+
+static void clean_call(void)
+{
+    predict_batch(dr_get_current_drcontext());
+}
+
+// 条件不在标志位里的分支：由DR算出方向后追加到同一个缓冲区
+static void at_cbr(app_pc inst_addr, app_pc targ_addr, app_pc fall_addr, int taken, void *bb_addr)
+{
+    void *drcontext = dr_get_current_drcontext();
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    branch_ref_t *ref = BUF_PTR(data->seg_base);
+    ref->pc = (ptr_uint_t)inst_addr;
+    ref->target = (ptr_uint_t)targ_addr;
+    ref->taken = taken != 0;
+    ref->kind = BRANCH_KIND_COND;
+    BUF_PTR(data->seg_base) = ref + 1;
+    if (ref + 1 >= BUF_END(data->seg_base))
+        predict_batch(drcontext);
+}
+
+#ifdef X86
+// jcc对应的setcc，两组操作码的条件顺序相同；jecxz、loop返回OP_INVALID
+static int setcc_opcode(int jcc)
+{
+    if (jcc >= OP_jo_short && jcc <= OP_jnle_short)
+        return OP_seto + (jcc - OP_jo_short);
+    if (jcc >= OP_jo && jcc <= OP_jnle)
+        return OP_seto + (jcc - OP_jo);
+    return OP_INVALID;
+}
+
+// jecxz和loop：分支执行前从机器状态算出方向。dr_insert_cbr_instrumentation
+// 只能插在分支本身之前，重复块共用的最后一条指令前插桩会对两份拷贝都生效
+static void at_xcx_branch(app_pc inst_addr, app_pc targ_addr, int opcode, int reg)
+{
+    dr_mcontext_t mc = { sizeof(mc), DR_MC_INTEGER | DR_MC_CONTROL };
+    uint size = opnd_size_in_bytes(reg_get_size((reg_id_t)reg));
+    reg_t mask = size >= sizeof(reg_t) ? ~(reg_t)0 : ((reg_t)1 << (size * 8)) - 1;
+    reg_t count;
+    bool zf;
+    dr_get_mcontext(dr_get_current_drcontext(), &mc);
+    count = reg_get_value((reg_id_t)reg, &mc) & mask;
+    zf = (mc.xflags & EFLAGS_ZF) != 0;
+    if (opcode == OP_jecxz) {
+        at_cbr(inst_addr, targ_addr, NULL, count == 0, NULL);
+        return;
+    }
+    // loop系列先把计数减一再判断
+    count = (count - 1) & mask;
+    at_cbr(inst_addr, targ_addr, NULL,
+           count != 0 && (opcode == OP_loop || (opcode == OP_loope) == zf), NULL);
+}
+#endif
+
+/* 在where前内联写入instr这条分支的branch_ref_t，缓冲区满了才调用predict_batch */
+static void insert_branch_ref(void *drcontext, instrlist_t *bb, instr_t *instr, instr_t *where)
+{
+#ifdef X86
+    int setcc = setcc_opcode(instr_get_opcode(instr));
+    reg_id_t reg_ptr, reg_tmp;
+    instr_t *skip;
+    if (setcc == OP_INVALID) {
+        // 计数寄存器是第二个源操作数
+        dr_insert_clean_call(drcontext, bb, where, (void *)at_xcx_branch, false, 4,
+                             OPND_CREATE_INTPTR(instr_get_app_pc(instr)),
+                             OPND_CREATE_INTPTR(instr_get_branch_target_pc(instr)),
+                             OPND_CREATE_INT32(instr_get_opcode(instr)),
+                             OPND_CREATE_INT32(opnd_get_reg(instr_get_src(instr, 1))));
+        return;
+    }
+    if (drreg_reserve_register(drcontext, bb, where, NULL, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, bb, where, NULL, &reg_tmp) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    // 写记录只用mov和lea，setcc读到的仍是应用的标志位
+    dr_insert_read_raw_tls(drcontext, bb, where, tls_seg, tls_offs + BP_TLS_OFFS_BUF_PTR * sizeof(void *), reg_ptr);
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)instr_get_app_pc(instr), opnd_create_reg(reg_tmp), bb, where, NULL, NULL);
+    MINSERT(bb, where, XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_ptr, offsetof(branch_ref_t, pc)), opnd_create_reg(reg_tmp)));
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)instr_get_branch_target_pc(instr), opnd_create_reg(reg_tmp), bb, where, NULL, NULL);
+    MINSERT(bb, where, XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_ptr, offsetof(branch_ref_t, target)), opnd_create_reg(reg_tmp)));
+    MINSERT(bb, where, INSTR_CREATE_setcc(drcontext, setcc, OPND_CREATE_MEM8(reg_ptr, offsetof(branch_ref_t, taken))));
+    MINSERT(bb, where, INSTR_CREATE_mov_st(drcontext, OPND_CREATE_MEM8(reg_ptr, offsetof(branch_ref_t, kind)), OPND_CREATE_INT8(BRANCH_KIND_COND)));
+    MINSERT(bb, where, INSTR_CREATE_lea(drcontext, opnd_create_reg(reg_ptr), OPND_CREATE_MEM_lea(reg_ptr, DR_REG_NULL, 0, sizeof(branch_ref_t))));
+    dr_insert_write_raw_tls(drcontext, bb, where, tls_seg, tls_offs + BP_TLS_OFFS_BUF_PTR * sizeof(void *), reg_ptr);
+
+    // 缓冲区满了才做一次清理调用；drreg在分支前恢复标志位
+    if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    skip = INSTR_CREATE_label(drcontext);
+    dr_insert_read_raw_tls(drcontext, bb, where, tls_seg, tls_offs + BP_TLS_OFFS_BUF_END * sizeof(void *), reg_tmp);
+    MINSERT(bb, where, XINST_CREATE_cmp(drcontext, opnd_create_reg(reg_ptr), opnd_create_reg(reg_tmp)));
+    MINSERT(bb, where, XINST_CREATE_jump_cond(drcontext, DR_PRED_B, opnd_create_instr(skip)));
+    dr_insert_clean_call(drcontext, bb, where, (void *)clean_call, false, 0);
+    MINSERT(bb, where, skip);
+    if (drreg_unreserve_aflags(drcontext, bb, where) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, where, reg_tmp) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, where, reg_ptr) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+#else
+    dr_insert_cbr_instrumentation_ex(drcontext, bb, instr, (void *)at_cbr, OPND_CREATE_INTPTR(0));
+#endif
+}
+
+// 感兴趣区域的判断每个基本块只做一次，插桩事件只看user_data
+static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
+{
+    *user_data = roi_block_traced(tag) ? ROI_TRACED : NULL;
+    return DR_EMIT_DEFAULT;
+}
+
+static void event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, instr_t *where, void *user_data)
+{
+    // 感兴趣区域之外的基本块不插桩
+    if (user_data == NULL)
+        return;
+
+    if (instr_is_app(instr) && instr_is_cbr(instr))
+        insert_branch_ref(drcontext, bb, instr, where);
 }
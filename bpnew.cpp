@@ -1,9 +1,16 @@
 #include "dr_api.h"
+#include "drmgr.h"
+#include "buf_writer.h"
 
 // 声明record_branch函数
 void record_branch(app_pc current_pc, app_pc next_pc, int instr_len, bool taken);
 
-static void event_app_instruction(void *drcontext, instrlist_t *ilist, instr_t *where, void *user_data) {
+static void event_exit(void);
+
+static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *ilist, instr_t *where, bool for_trace, bool translating, void *user_data) {
+    // 只处理应用程序指令
+    if (!instr_is_app(where))
+        return DR_EMIT_DEFAULT;
     // 获取当前指令的PC值
     app_pc current_pc = instr_get_app_pc(where);
     // 获取指令长度
@@ -21,19 +28,33 @@ static void event_app_instruction(void *drcontext, instrlist_t *ilist, instr_t *
                              OPND_CREATE_INT(instr_len),
                              OPND_CREATE_INT(instr_is_cbr(where)));
     }
+    return DR_EMIT_DEFAULT;
 }
 
 // record_branch函数的实现
 void record_branch(app_pc current_pc, app_pc next_pc, int instr_len, bool taken) {
+    // 每个线程写自己带缓冲的branch.<tid>.log，不再每条分支一次系统调用
+    void *drcontext = dr_get_current_drcontext();
     // 检查跳转是否被采取
     bool branch_taken = taken;
     if (branch_taken) {
-        dr_fprintf(STDERR, "Branch taken at PC: %p to %p with length %d\n", current_pc, next_pc, instr_len);
+        bw_log_printf(drcontext, "Branch taken at PC: %p to %p with length %d\n", current_pc, next_pc, instr_len);
     } else {
-        dr_fprintf(STDERR, "Branch not taken at PC: %p with length %d\n", current_pc, instr_len);
+        bw_log_printf(drcontext, "Branch not taken at PC: %p with length %d\n", current_pc, instr_len);
     }
 }
 
+static void event_exit(void) {
+    bw_log_exit();
+    drmgr_exit();
+}
+
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[]) {
-    dr_register_bb_event(event_app_instruction);
+    if (!drmgr_init()) {
+        DR_ASSERT(false);
+        return;
+    }
+    bw_log_init("branch.%d.log");
+    dr_register_exit_event(event_exit);
+    drmgr_register_bb_instrumentation_event(NULL, event_app_instruction, NULL);
 }
@@ -0,0 +1,59 @@
+// Offline evaluation of the bptest predictors over a recorded branch trace
+// (branch_ref_t records, raw or in trace_format.h chunks).
+//
+// Every predictor configuration runs on its own thread. The trace is decoded
+// once; all workers read the same immutable chunks (see fanout.h), so the
+// run takes about as long as the slowest predictor instead of the sum of
+// all of them. The stats are the lines bptest's print_stats prints.
+//
+// Usage: bpeval <branch trace> [queue depth]
+// Build: g++ -O2 -std=c++17 -pthread -I.. -o bpeval bpeval.cpp
+#include <stdlib.h>
+#include <iostream>
+#include "fanout.h"
+#include "predictors.h"
+#include "perceptron.h"
+
+// One worker per predictor; p must outlive fanout.run()
+template <typename P>
+static void add_predictor(FanOut<BranchRecord> &fanout, P &p) {
+    fanout.add_stage(p.get_name(), [&p](const BranchRecord *records, size_t count) {
+        predict_and_update(p, BranchSpan(records, count));
+    });
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <branch trace> [queue depth]" << std::endl;
+        return 1;
+    }
+    TraceReader<BranchRecord> reader(argv[1]);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    // bptest's suite, plus bimodal table sizes and the perceptron
+    DefaultSuite suite;
+    TwoBitPredictor bimodal_1k(1 << 10, 0b11, "TwoBitPredictor-1K");
+    TwoBitPredictor bimodal_64k(1 << 16, 0b11, "TwoBitPredictor-64K");
+    PerceptronPredictor perceptron;
+
+    FanOut<BranchRecord> fanout(argc > 2 ? atoi(argv[2]) : 8);
+    suite.for_each([&](auto &p) { add_predictor(fanout, p); });
+    add_predictor(fanout, bimodal_1k);
+    add_predictor(fanout, bimodal_64k);
+    add_predictor(fanout, perceptron);
+    fanout.run(reader);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    suite.for_each([](const PredictorStats &p) { std::cout << p.stats(); });
+    std::cout << bimodal_1k.stats() << bimodal_64k.stats() << perceptron.stats();
+    std::cout << suite.get<3>().table_stats(); // LocalHistoryPredictor
+    fanout.report(std::cerr);
+    std::cerr << "Perceptron kernel: " << perceptron.kernel_name() << std::endl;
+    return 0;
+}
@@ -0,0 +1,92 @@
+// Replays a recorded branch trace (bp.cpp -trace, or any branch_ref_t
+// stream, raw or chunked) through the bptest predictors, outside of
+// DynamoRIO: record once, then evaluate predictor variants offline.
+//
+// Predictors run one after another over each batch on this thread (bpeval
+// runs them in parallel). Besides the print_stats lines each predictor
+// reports its own branches per second, and TAGE's most mispredicted
+// branches are listed by pc (see topk.h).
+//
+// Usage: bpreplay [-mmap | -fifo] <branch trace>
+// Build: g++ -O2 -std=c++17 -pthread -I.. -o bpreplay bpreplay.cpp
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "trace_reader.hpp"
+#include "predictors.h"
+#include "perceptron.h"
+#include "topk.h"
+
+typedef PredictorSuite<StaticPredictor, TwoBitPredictor, BackwardJumpPredictor,
+                       LocalHistoryPredictor, Attributed<TAGEPredictor>, PerceptronPredictor>
+    ReplaySuite;
+
+int main(int argc, char *argv[]) {
+    TraceSource source = TraceSource::Auto;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-'; i++) {
+        if (strcmp(argv[i], "-mmap") == 0)
+            source = TraceSource::Mmap;
+        else if (strcmp(argv[i], "-fifo") == 0)
+            source = TraceSource::Fifo;
+        else
+            break;
+    }
+    if (i + 1 != argc) {
+        std::cerr << "Usage: " << argv[0] << " [-mmap | -fifo] <branch trace>" << std::endl;
+        return 1;
+    }
+    TraceReader<BranchRecord> reader(argv[i], source);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    using Clock = std::chrono::steady_clock;
+    ReplaySuite suite;
+    std::vector<Clock::duration> busy(ReplaySuite::size);
+    uint64_t branches = 0;
+    Clock::time_point start = Clock::now();
+    for (Span<BranchRecord> span = reader.next(); !span.empty(); span = reader.next()) {
+        size_t p = 0;
+        suite.for_each([&](auto &predictor) {
+            Clock::time_point before = Clock::now();
+            predict_and_update(predictor, BranchSpan(span));
+            busy[p++] += Clock::now() - before;
+        });
+        branches += span.size;
+    }
+    double wall = std::chrono::duration<double>(Clock::now() - start).count();
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    size_t p = 0;
+    suite.for_each([&](const PredictorStats &predictor) {
+        double seconds = std::chrono::duration<double>(busy[p++]).count();
+        std::cout << predictor.stats() << predictor.get_name() << " Branches/s: "
+                  << (seconds > 0 ? branches / seconds : 0.0) << std::endl;
+    });
+    std::cout << "Branches: " << branches << " in " << wall << " s ("
+              << (wall > 0 ? branches / wall : 0.0) << " branches/s over all predictors)"
+              << std::endl;
+
+    const MispredictSketch &sketch = suite.get<4>().sketch;
+    std::cout << suite.get<4>().get_name() << " most mispredicted branches:" << std::endl;
+    for (const MispredictSketch::Entry &e : sketch.top(20)) {
+        char line[192];
+        snprintf(line, sizeof(line),
+                 "  0x%llx: %llu mispredicts (+-%llu); since tracked %llu executions, "
+                 "%.2f%% mispredicted, %.2f%% taken",
+                 (unsigned long long)e.pc, (unsigned long long)e.mispredicts,
+                 (unsigned long long)e.error, (unsigned long long)e.executions,
+                 e.executions ? 100.0 * e.window_mispredicts / e.executions : 0.0,
+                 e.executions ? 100.0 * e.taken / e.executions : 0.0);
+        std::cout << line << std::endl;
+    }
+    return 0;
+}
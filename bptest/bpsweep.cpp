@@ -0,0 +1,157 @@
+// One-pass design-space sweep: streams a branch trace once and feeds every
+// record to many predictor configurations, then prints accuracy against
+// storage for each.
+//
+// The trace is cut into blocks of a few thousand records. Each block is
+// split once into structure-of-arrays form (hashed pc, outcome); every
+// configuration then runs over the whole block before the next one starts,
+// so the block stays in cache and each configuration's tables are touched
+// in one burst instead of once per record. The bimodal sizes share one
+// counter array and run on the pre-hashed columns directly; the other
+// families are ordinary predictors.h objects run block by block.
+//
+// Usage: bpsweep <branch trace> [block records]
+// Build: g++ -O2 -std=c++17 -pthread -I.. -o bpsweep bpsweep.cpp
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "trace_reader.hpp"
+#include "predictors.h"
+#include "perceptron.h"
+
+// Every bimodal table size from 2^min_log to 2^max_log entries, side by side
+class BimodalSweep {
+public:
+    BimodalSweep(unsigned min_log, unsigned max_log) {
+        size_t total = 0;
+        for (unsigned log = min_log; log <= max_log; log++) {
+            offset.push_back(total);
+            mask.push_back((size_t(1) << log) - 1);
+            total += size_t(1) << log;
+        }
+        counters.assign(total, 0b11);
+        correct.assign(offset.size(), 0);
+    }
+
+    // index[i] = hashed pc, taken[i] = outcome, for one block
+    void run(const uint64_t *index, const uint8_t *taken, size_t count) {
+        for (size_t c = 0; c < offset.size(); c++) {
+            uint8_t *table = &counters[offset[c]];
+            size_t m = mask[c];
+            uint64_t hits = 0;
+            for (size_t i = 0; i < count; i++) {
+                uint8_t &state = table[index[i] & m];
+                bool t = taken[i];
+                hits += (bool)(state & 0b10) == t;
+                // 两位饱和计数器
+                state = t ? (state == 0b11 ? state : state + 1) : (state == 0b00 ? state : state - 1);
+            }
+            correct[c] += hits;
+        }
+    }
+
+    size_t size() const { return offset.size(); }
+    uint64_t hits(size_t c) const { return correct[c]; }
+    size_t entries(size_t c) const { return mask[c] + 1; }
+
+private:
+    std::vector<uint8_t> counters;  // all tables, back to back
+    std::vector<size_t> offset;     // [config] start of its table
+    std::vector<size_t> mask;       // [config] entries - 1
+    std::vector<uint64_t> correct;  // [config]
+};
+
+struct Row {
+    std::string name;
+    size_t storage_bits;
+    uint64_t correct;
+};
+
+template <typename P>
+static void add_rows(std::vector<Row> &rows, const std::vector<P> &configs) {
+    for (const P &p : configs)
+        rows.push_back({ p.get_name(), p.storage_bits(), p.correct() });
+}
+
+template <typename P>
+static void run_block(std::vector<P> &configs, BranchSpan block) {
+    for (P &p : configs)
+        predict_and_update(p, block);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <branch trace> [block records]\n", argv[0]);
+        return 1;
+    }
+    size_t block_records = argc > 2 ? strtoul(argv[2], nullptr, 0) : 4096;
+    if (block_records == 0)
+        block_records = 4096;
+    TraceReader<BranchRecord> reader(argv[1]);
+    if (!reader.ok()) {
+        fprintf(stderr, "%s\n", reader.error().c_str());
+        return 1;
+    }
+
+    BimodalSweep bimodal(10, 20);
+    std::vector<LocalHistoryPredictor> local;
+    for (unsigned log : { 10, 12, 16 }) {
+        for (unsigned bits : { 4, 8 })
+            local.emplace_back(log, bits, "LocalHistory-" + std::to_string(1 << log) + "x" + std::to_string(bits));
+    }
+    std::vector<TAGEPredictor> tage;
+    const std::vector<std::vector<unsigned>> history_sets = {
+        { 4, 8, 16, 32 }, { 5, 15, 44, 130 }, { 5, 12, 27, 64, 130, 300 }
+    };
+    for (unsigned log : { 9, 11 }) {
+        for (const auto &lengths : history_sets) {
+            std::string name = "TAGE-" + std::to_string(lengths.size()) + "x" + std::to_string(1 << log) + "-h";
+            name += std::to_string(lengths.back());
+            tage.emplace_back(lengths, log, name);
+        }
+    }
+    std::vector<PerceptronPredictor> perceptron;
+    for (unsigned history : { 32, 64, 128, 256 })
+        perceptron.emplace_back(history, 10, "Perceptron-h" + std::to_string(history));
+
+    std::vector<uint64_t> index(block_records);
+    std::vector<uint8_t> taken(block_records);
+    uint64_t branches = 0;
+    for (Span<BranchRecord> span = reader.next(); !span.empty(); span = reader.next()) {
+        for (size_t start = 0; start < span.size; start += block_records) {
+            size_t count = std::min(block_records, span.size - start);
+            BranchSpan block(span.data + start, count);
+            for (size_t i = 0; i < count; i++) {
+                index[i] = block.data[i].pc >> 2;
+                taken[i] = block.data[i].taken != 0;
+            }
+            bimodal.run(index.data(), taken.data(), count);
+            run_block(local, block);
+            run_block(tage, block);
+            run_block(perceptron, block);
+            branches += count;
+        }
+    }
+    if (!reader.ok()) {
+        fprintf(stderr, "%s\n", reader.error().c_str());
+        return 1;
+    }
+
+    std::vector<Row> rows;
+    for (size_t c = 0; c < bimodal.size(); c++)
+        rows.push_back({ "TwoBit-" + std::to_string(bimodal.entries(c)), bimodal.entries(c) * 2, bimodal.hits(c) });
+    add_rows(rows, local);
+    add_rows(rows, tage);
+    add_rows(rows, perceptron);
+
+    printf("%llu branches, %zu configurations\n", (unsigned long long)branches, rows.size());
+    printf("%-28s %12s %10s %14s\n", "Configuration", "Storage KB", "Accuracy", "Mispred/1K");
+    for (const Row &row : rows) {
+        double accuracy = branches ? 100.0 * row.correct / branches : 0.0;
+        printf("%-28s %12.2f %9.2f%% %14.2f\n", row.name.c_str(), row.storage_bits / 8192.0, accuracy,
+               branches ? 1000.0 * (branches - row.correct) / branches : 0.0);
+    }
+    return 0;
+}
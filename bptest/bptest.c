@@ -1,72 +1,133 @@
-#include "branch_predictor.h"
-#include <vector>
-#include <string>
+#include "bptest.h"
+#include "drmgr.h"
+#include "drsyms.h"
+#include "predictors.h"
+#include "topk.h"
 
-class BranchPredictor {
-public:
-    BranchPredictor(const std::string &name) : name(name), correct_predictions(0), total_predictions(0) {}
-    
-    virtual bool predict(instr_t *instr) = 0;
-    virtual void update(instr_t *instr, bool taken) = 0;
+// 每个线程攒够这么多条分支才交给预测器组
+#define BRANCHES_PER_BATCH 4096
+// 退出时报告TAGE误预测最多的分支数
+#define TOP_K_BRANCHES 20
 
-    void record_prediction(bool taken, bool prediction) {
-        if (prediction == taken) {
-            correct_predictions++;
-        }
-        total_predictions++;
-    }
+// 分支记录先进线程自己的缓冲区，整批交给预测器时才加锁
+typedef struct {
+    size_t count;
+    BranchRecord batch[BRANCHES_PER_BATCH];
+} per_thread_t;
 
-    void print_stats() const {
-        dr_fprintf(STDERR, "%s Correct Predictions: %d\n", name.c_str(), correct_predictions);
-        dr_fprintf(STDERR, "%s Total Predictions: %d\n", name.c_str(), total_predictions);
-        dr_fprintf(STDERR, "%s Accuracy: %.2f%%\n", name.c_str(), (100.0 * correct_predictions / total_predictions));
-    }
+// DefaultSuite，但TAGE的每次误预测都按分支pc记进MispredictSketch
+typedef PredictorSuite<StaticPredictor, TwoBitPredictor, BackwardJumpPredictor,
+                       LocalHistoryPredictor, Attributed<TAGEPredictor>>
+    ClientSuite;
 
-private:
-    std::string name;
-    int correct_predictions;
-    int total_predictions;
-};
+static ClientSuite *predictors;
+static void *predictors_lock;
+static int tls_idx;
 
-class StaticPredictor : public BranchPredictor {
-public:
-    StaticPredictor() : BranchPredictor("StaticPredictor") {}
+static void flush_batch(per_thread_t *data) {
+    dr_mutex_lock(predictors_lock);
+    predictors->predict_and_update(BranchSpan(data->batch, data->count));
+    dr_mutex_unlock(predictors_lock);
+    data->count = 0;
+}
 
-    bool predict(instr_t *instr) override {
-        return true; // 永远预测分支被采取
-    }
+// dr_insert_cbr_instrumentation_ex的回调：DR给出分支的真实方向
+static void at_cbr(app_pc inst_addr, app_pc targ_addr, app_pc fall_addr, int taken, void *bb_addr) {
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(dr_get_current_drcontext(), tls_idx);
+    BranchRecord &br = data->batch[data->count++];
+    br.pc = (ptr_uint_t)inst_addr;
+    br.target = (ptr_uint_t)targ_addr;
+    br.taken = taken != 0;
+    br.kind = BRANCH_KIND_COND;
+    if (data->count == BRANCHES_PER_BATCH)
+        flush_batch(data);
+}
 
-    void update(instr_t *instr, bool taken) override {
-        // 静态预测器不需要更新
-    }
-};
+static void event_thread_init(void *drcontext) {
+    per_thread_t *data = (per_thread_t *)dr_thread_alloc(drcontext, sizeof(per_thread_t));
+    data->count = 0;
+    drmgr_set_tls_field(drcontext, tls_idx, data);
+}
 
-// 其他预测器的实现...
+static void event_thread_exit(void *drcontext) {
+    per_thread_t *data = (per_thread_t *)drmgr_get_tls_field(drcontext, tls_idx);
+    flush_batch(data);
+    dr_thread_free(drcontext, data, sizeof(per_thread_t));
+}
 
-static std::vector<BranchPredictor*> predictors;
+// module!function+0xoffset，没有符号时退回module+0xoffset或裸地址
+static void describe_pc(app_pc pc, char *buf, size_t size) {
+    module_data_t *mod = dr_lookup_module(pc);
+    if (mod == NULL) {
+        dr_snprintf(buf, size, PFX, pc);
+        buf[size - 1] = '\0';
+        return;
+    }
+    size_t modoffs = pc - mod->start;
+    char name[256];
+    drsym_info_t sym;
+    sym.struct_size = sizeof(sym);
+    sym.name = name;
+    sym.name_size = sizeof(name);
+    sym.file = NULL;
+    sym.file_size = 0;
+    drsym_error_t res = drsym_lookup_address(mod->full_path, modoffs, &sym, DRSYM_DEMANGLE);
+    const char *modname = dr_module_preferred_name(mod);
+    if (modname == NULL)
+        modname = "<unknown>";
+    if (res == DRSYM_SUCCESS || res == DRSYM_ERROR_LINE_NOT_AVAILABLE)
+        dr_snprintf(buf, size, "%s!%s+0x%zx", modname, sym.name, modoffs - sym.start_offs);
+    else
+        dr_snprintf(buf, size, "%s+0x%zx", modname, modoffs);
+    buf[size - 1] = '\0';
+    dr_free_module_data(mod);
+}
+
+static void print_top_branches(const Attributed<TAGEPredictor> &predictor) {
+    std::vector<MispredictSketch::Entry> top = predictor.sketch.top(TOP_K_BRANCHES);
+    dr_fprintf(STDERR, "%s top %d mispredicted branches (of %zu tracked):\n",
+               predictor.get_name().c_str(), TOP_K_BRANCHES, predictor.sketch.capacity());
+    for (size_t i = 0; i < top.size(); i++) {
+        const MispredictSketch::Entry &e = top[i];
+        char where[512];
+        describe_pc((app_pc)e.pc, where, sizeof(where));
+        // error是误预测数的上界误差；执行次数、误预测率和taken比例都从分支进入sketch时开始计
+        dr_fprintf(STDERR,
+                   "  %2zu. %s (" PFX "): %llu mispredicts (+-%llu); since tracked %llu "
+                   "executions, %.2f%% mispredicted, %.2f%% taken\n",
+                   i + 1, where, (app_pc)e.pc, (unsigned long long)e.mispredicts,
+                   (unsigned long long)e.error, (unsigned long long)e.executions,
+                   e.executions ? 100.0 * e.window_mispredicts / e.executions : 0.0,
+                   e.executions ? 100.0 * e.taken / e.executions : 0.0);
+    }
+}
 
 void branch_predictor_init() {
-    predictors.push_back(new StaticPredictor());
-    // 初始化其他预测器...
+    predictors = new ClientSuite();
+    predictors_lock = dr_mutex_create();
+    tls_idx = drmgr_register_tls_field();
+    DR_ASSERT(tls_idx != -1);
+    if (!drmgr_register_thread_init_event(event_thread_init) ||
+        !drmgr_register_thread_exit_event(event_thread_exit))
+        DR_ASSERT(false);
+    if (drsym_init(0) != DRSYM_SUCCESS)
+        DR_ASSERT(false);
 }
 
 void branch_predictor_exit() {
-    for (auto predictor : predictors) {
-        predictor->print_stats();
-        delete predictor;
-    }
-    predictors.clear();
+    predictors->for_each([](const PredictorStats &predictor) {
+        dr_fprintf(STDERR, "%s", predictor.stats().c_str());
+    });
+    print_top_branches(predictors->get<4>());
+    delete predictors;
+    predictors = NULL;
+    drmgr_unregister_thread_init_event(event_thread_init);
+    drmgr_unregister_thread_exit_event(event_thread_exit);
+    drmgr_unregister_tls_field(tls_idx);
+    dr_mutex_destroy(predictors_lock);
+    drsym_exit();
 }
 
 void branch_predictor_instrument_branch(void *drcontext, instrlist_t *bb, instr_t *instr) {
-    dr_insert_clean_call(drcontext, bb, instr, (void *)branch_predictor_update, false, 2,
-                         OPND_CREATE_INTPTR(instr), OPND_CREATE_INTPTR(instr_is_taken(instr)));
-}
-
-void branch_predictor_update(void *drcontext, instr_t *instr, bool taken) {
-    for (auto predictor : predictors) {
-        bool prediction = predictor->predict(instr);
-        predictor->record_prediction(taken, prediction);
-        predictor->update(instr, taken);
-    }
+    dr_insert_cbr_instrumentation_ex(drcontext, bb, instr, (void *)at_cbr, OPND_CREATE_INTPTR(0));
 }
@@ -3,9 +3,9 @@
 
 #include "dr_api.h"
 
+// 在drmgr_init之后调用，在drmgr_exit之前退出
 void branch_predictor_init();
 void branch_predictor_exit();
 void branch_predictor_instrument_branch(void *drcontext, instrlist_t *bb, instr_t *instr);
-void branch_predictor_update(void *drcontext, instr_t *instr, bool taken);
 
 #endif // BRANCH_PREDICTOR_H
@@ -0,0 +1,285 @@
+#ifndef BPTEST_PERCEPTRON_H
+#define BPTEST_PERCEPTRON_H
+
+// Hashed perceptron branch predictor for the predictors.h family.
+//
+// There are num_tables tables of int8 weights. Table t is indexed by the pc
+// hashed with the most recent L(t) bits of global history, the lengths
+// growing geometrically from 0 (a pc-only table) to history_length. The
+// prediction is the sign of the sum of the num_tables selected weights; on a
+// mispredict, or when the sum is within the training threshold, each of them
+// moves one step towards the outcome. The threshold adapts at run time
+// (Seznec's O-GEHL rule), so it needs no tuning per history length.
+//
+// Each table's history segment is kept folded down to an index, updated
+// incrementally per branch like TAGE's, so the cost per branch depends on
+// the number of tables, not on the history length. The index hashing, the
+// weight gather and sum, and the fold updates run 8 (AVX2) or 4 (SSE2)
+// tables per instruction; the kernel is picked once, at runtime, with a
+// scalar fallback for other CPUs and ISAs. Training touches one weight per
+// table and stays scalar.
+//
+// The global history is kept as 0/1 bytes in a buffer twice its length, each
+// bit written twice, so the bit leaving any table's window is always at
+// history[head + L(t)].
+
+#include <math.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include "predictors.h"
+#if defined(__x86_64__) || defined(__i386__)
+#    include <immintrin.h>
+#    define PERCEPTRON_X86 1
+#endif
+
+// Table counts are rounded up to a multiple of this
+#define PERCEPTRON_VECTOR_TABLES 8
+
+namespace perceptron_kernels {
+
+// index[i] = offset[i] + ((pc ^ fold[i]) & mask); returns sum of w[index[i]].
+// n is a multiple of 8; w is readable 3 bytes past its last weight.
+typedef int (*LookupFn)(const int8_t *w, const uint32_t *fold, const uint32_t *offset,
+                        uint32_t pc, uint32_t mask, uint32_t *index, size_t n);
+// Shifts newest into every fold and takes out the bit at history[length[i]],
+// which sits at fold bit position outbit[i]; folds are width bits wide.
+// history is readable 3 bytes past the longest length.
+typedef void (*FoldFn)(uint32_t *fold, const uint8_t *history, const uint32_t *length,
+                       const uint32_t *outbit, unsigned newest, unsigned width, size_t n);
+
+inline int lookup_scalar(const int8_t *w, const uint32_t *fold, const uint32_t *offset,
+                         uint32_t pc, uint32_t mask, uint32_t *index, size_t n) {
+    int sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        index[i] = offset[i] + ((pc ^ fold[i]) & mask);
+        sum += w[index[i]];
+    }
+    return sum;
+}
+
+inline void fold_scalar(uint32_t *fold, const uint8_t *history, const uint32_t *length,
+                        const uint32_t *outbit, unsigned newest, unsigned width, size_t n) {
+    uint32_t mask = (1u << width) - 1;
+    for (size_t i = 0; i < n; i++) {
+        uint32_t f = (fold[i] << 1) | newest;
+        f ^= outbit[i] & (0u - (uint32_t)history[length[i]]);
+        f ^= f >> width;
+        fold[i] = f & mask;
+    }
+}
+
+#ifdef PERCEPTRON_X86
+// Weights and history bits are gathered as 32-bit words at byte offsets and
+// cut down to their low byte.
+__attribute__((target("avx2"))) inline int lookup_avx2(const int8_t *w, const uint32_t *fold,
+                                                       const uint32_t *offset, uint32_t pc,
+                                                       uint32_t mask, uint32_t *index, size_t n) {
+    const __m256i pcv = _mm256_set1_epi32((int)pc);
+    const __m256i maskv = _mm256_set1_epi32((int)mask);
+    __m256i acc = _mm256_setzero_si256();
+    for (size_t i = 0; i < n; i += 8) {
+        __m256i idx = _mm256_and_si256(
+            _mm256_xor_si256(pcv, _mm256_loadu_si256((const __m256i *)(fold + i))), maskv);
+        idx = _mm256_add_epi32(idx, _mm256_loadu_si256((const __m256i *)(offset + i)));
+        _mm256_storeu_si256((__m256i *)(index + i), idx);
+        __m256i wv = _mm256_i32gather_epi32((const int *)w, idx, 1);
+        acc = _mm256_add_epi32(acc, _mm256_srai_epi32(_mm256_slli_epi32(wv, 24), 24));
+    }
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(sum);
+}
+
+__attribute__((target("avx2"))) inline void fold_avx2(uint32_t *fold, const uint8_t *history,
+                                                      const uint32_t *length,
+                                                      const uint32_t *outbit, unsigned newest,
+                                                      unsigned width, size_t n) {
+    const __m256i newv = _mm256_set1_epi32((int)newest);
+    const __m256i maskv = _mm256_set1_epi32((int)((1u << width) - 1));
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m128i shift = _mm_cvtsi32_si128((int)width);
+    for (size_t i = 0; i < n; i += 8) {
+        __m256i oldest = _mm256_and_si256(
+            _mm256_i32gather_epi32((const int *)history,
+                                   _mm256_loadu_si256((const __m256i *)(length + i)), 1),
+            one);
+        __m256i f = _mm256_or_si256(
+            _mm256_slli_epi32(_mm256_loadu_si256((const __m256i *)(fold + i)), 1), newv);
+        f = _mm256_xor_si256(f, _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(outbit + i)),
+                                                 _mm256_sub_epi32(_mm256_setzero_si256(), oldest)));
+        f = _mm256_xor_si256(f, _mm256_srl_epi32(f, shift));
+        _mm256_storeu_si256((__m256i *)(fold + i), _mm256_and_si256(f, maskv));
+    }
+}
+
+// SSE2 has no gather: the indices and folds are vector, the byte loads scalar
+__attribute__((target("sse2"))) inline int lookup_sse2(const int8_t *w, const uint32_t *fold,
+                                                       const uint32_t *offset, uint32_t pc,
+                                                       uint32_t mask, uint32_t *index, size_t n) {
+    const __m128i pcv = _mm_set1_epi32((int)pc);
+    const __m128i maskv = _mm_set1_epi32((int)mask);
+    int sum = 0;
+    for (size_t i = 0; i < n; i += 4) {
+        __m128i idx =
+            _mm_and_si128(_mm_xor_si128(pcv, _mm_loadu_si128((const __m128i *)(fold + i))), maskv);
+        idx = _mm_add_epi32(idx, _mm_loadu_si128((const __m128i *)(offset + i)));
+        _mm_storeu_si128((__m128i *)(index + i), idx);
+        sum += w[index[i]] + w[index[i + 1]] + w[index[i + 2]] + w[index[i + 3]];
+    }
+    return sum;
+}
+
+__attribute__((target("sse2"))) inline void fold_sse2(uint32_t *fold, const uint8_t *history,
+                                                      const uint32_t *length,
+                                                      const uint32_t *outbit, unsigned newest,
+                                                      unsigned width, size_t n) {
+    const __m128i newv = _mm_set1_epi32((int)newest);
+    const __m128i maskv = _mm_set1_epi32((int)((1u << width) - 1));
+    const __m128i shift = _mm_cvtsi32_si128((int)width);
+    for (size_t i = 0; i < n; i += 4) {
+        __m128i oldest = _mm_set_epi32(-(int)history[length[i + 3]], -(int)history[length[i + 2]],
+                                       -(int)history[length[i + 1]], -(int)history[length[i]]);
+        __m128i f = _mm_or_si128(_mm_slli_epi32(_mm_loadu_si128((const __m128i *)(fold + i)), 1), newv);
+        f = _mm_xor_si128(f, _mm_and_si128(_mm_loadu_si128((const __m128i *)(outbit + i)), oldest));
+        f = _mm_xor_si128(f, _mm_srl_epi32(f, shift));
+        _mm_storeu_si128((__m128i *)(fold + i), _mm_and_si128(f, maskv));
+    }
+}
+#endif
+
+struct Kernels {
+    const char *name;
+    LookupFn lookup;
+    FoldFn fold;
+};
+
+// Best kernel set for this CPU; PERCEPTRON_KERNEL=scalar|sse2|avx2 caps it
+inline Kernels select() {
+    const char *cap = getenv("PERCEPTRON_KERNEL");
+    std::string want = cap == nullptr ? "" : cap;
+#ifdef PERCEPTRON_X86
+    __builtin_cpu_init();
+    if (want != "scalar" && want != "sse2" && __builtin_cpu_supports("avx2"))
+        return { "avx2", lookup_avx2, fold_avx2 };
+    if (want != "scalar" && __builtin_cpu_supports("sse2"))
+        return { "sse2", lookup_sse2, fold_sse2 };
+#endif
+    return { "scalar", lookup_scalar, fold_scalar };
+}
+
+} // namespace perceptron_kernels
+
+class PerceptronPredictor : public PredictorStats {
+public:
+    // history_length: longest history segment in bits (up to MAX_HISTORY)
+    // log_rows: 2^log_rows weights per table
+    // num_tables: rounded up to a multiple of 8, at most MAX_TABLES
+    explicit PerceptronPredictor(unsigned history_length = 128, unsigned log_rows = 10,
+                                 const std::string &name = "PerceptronPredictor",
+                                 unsigned num_tables = 8)
+        : PredictorStats(name),
+          history_length(history_length < MAX_HISTORY ? history_length : MAX_HISTORY),
+          log_rows(log_rows),
+          num_tables(table_count(num_tables)),
+          theta((int)this->num_tables),
+          kernels(perceptron_kernels::select()),
+          // 3 bytes of slack for the 32-bit gathers
+          weights(((size_t)this->num_tables << log_rows) + 3, 0),
+          history(2 * HISTORY_BUFFER + 3, 0),
+          fold(this->num_tables, 0), offset(this->num_tables), length(this->num_tables),
+          outbit(this->num_tables), index(this->num_tables) {
+        // L(0) = 0, then geometric up to history_length, strictly increasing
+        unsigned prev = 0;
+        for (unsigned t = 0; t < this->num_tables; t++) {
+            unsigned l = 0;
+            if (t > 0) {
+                double ratio = this->num_tables > 2 ? (double)(t - 1) / (this->num_tables - 2) : 1.0;
+                l = (unsigned)lround(2.0 * pow(this->history_length / 2.0, ratio));
+                l = l > prev ? l : prev + 1;
+                l = l < this->history_length ? l : this->history_length;
+            }
+            prev = l;
+            offset[t] = t << log_rows;
+            length[t] = l;
+            outbit[t] = 1u << (l % log_rows);
+        }
+    }
+
+    bool predict(const BranchRecord &br) {
+        last_pc = br.pc;
+        uint32_t pc = (uint32_t)((br.pc >> 2) ^ (br.pc >> (2 + log_rows)));
+        last_sum = kernels.lookup(weights.data(), fold.data(), offset.data(), pc,
+                                  (1u << log_rows) - 1, index.data(), num_tables);
+        return last_sum >= 0;
+    }
+
+    void update(const BranchRecord &br, bool taken) {
+        if (last_pc != br.pc)
+            predict(br);
+        bool mispredicted = (last_sum >= 0) != taken;
+        if (mispredicted || abs(last_sum) <= theta) {
+            for (unsigned t = 0; t < num_tables; t++) {
+                int8_t &w = weights[index[t]];
+                if (taken ? w < 127 : w > -127)
+                    w += taken ? 1 : -1;
+            }
+            // raise the threshold when mispredicts dominate, lower it when
+            // low-confidence correct predictions do
+            if (mispredicted && ++threshold_count >= THRESHOLD_COUNT_MAX) {
+                theta++;
+                threshold_count = 0;
+            } else if (!mispredicted && --threshold_count <= -THRESHOLD_COUNT_MAX) {
+                if (theta > 0)
+                    theta--;
+                threshold_count = 0;
+            }
+        }
+        // the newest bit is written twice, so history[head + L] is always in range
+        head = head == 0 ? HISTORY_BUFFER - 1 : head - 1;
+        history[head] = history[head + HISTORY_BUFFER] = taken;
+        kernels.fold(fold.data(), &history[head], length.data(), outbit.data(), taken, log_rows,
+                     num_tables);
+        last_pc = ~(uint64_t)0;
+    }
+
+    size_t storage_bits() const {
+        return ((size_t)num_tables << log_rows) * 8 + history_length + num_tables * log_rows;
+    }
+
+    const char *kernel_name() const { return kernels.name; }
+
+private:
+    static const unsigned MAX_HISTORY = 1023;
+    static const unsigned HISTORY_BUFFER = MAX_HISTORY + 1;
+    static const unsigned MAX_TABLES = 32;
+    static const int THRESHOLD_COUNT_MAX = 64;
+
+    static unsigned table_count(unsigned n) {
+        n = (n + PERCEPTRON_VECTOR_TABLES - 1) / PERCEPTRON_VECTOR_TABLES * PERCEPTRON_VECTOR_TABLES;
+        return n == 0 ? PERCEPTRON_VECTOR_TABLES : n < MAX_TABLES ? n : MAX_TABLES;
+    }
+
+    unsigned history_length;
+    unsigned log_rows;
+    unsigned num_tables;
+    int theta;
+    int threshold_count = 0;
+    perceptron_kernels::Kernels kernels;
+    std::vector<int8_t> weights;   // [table << log_rows | row]
+    std::vector<uint8_t> history;  // 0/1, history[head + i] is i branches back
+    unsigned head = 0;
+    std::vector<uint32_t> fold;    // [table] its history segment folded to log_rows bits
+    std::vector<uint32_t> offset;  // [table] table << log_rows
+    std::vector<uint32_t> length;  // [table] L(t)
+    std::vector<uint32_t> outbit;  // [table] 1 << (L(t) % log_rows)
+    std::vector<uint32_t> index;   // weights picked by the last predict
+
+    uint64_t last_pc = ~(uint64_t)0;
+    int last_sum = 0;
+};
+
+#endif // BPTEST_PERCEPTRON_H
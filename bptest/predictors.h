@@ -0,0 +1,485 @@
+#ifndef BPTEST_PREDICTORS_H
+#define BPTEST_PREDICTORS_H
+
+// Branch predictor models shared by the bptest client and the offline tools.
+//
+// A predictor is a plain class with
+//     bool predict(const BranchRecord &br);
+//     void update(const BranchRecord &br, bool taken);
+// and no virtual functions. PredictorSuite<Ps...> holds its predictors by
+// value and runs a whole batch through one predictor at a time, so each
+// inner loop is a direct call the compiler can inline.
+//
+//     DefaultSuite suite;
+//     suite.predict_and_update(BranchSpan(records, count));
+//     suite.for_each([](const PredictorStats &p) { fputs(p.stats().c_str(), stderr); });
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include "../trace_records.h"
+
+// pc, target, outcome and kind of one executed branch
+typedef branch_ref_t BranchRecord;
+
+// Read-only view of a batch of records; anything with data and size fields
+// (e.g. trace_reader.hpp's Span) converts to it.
+struct BranchSpan {
+    const BranchRecord *data = nullptr;
+    size_t size = 0;
+
+    BranchSpan() = default;
+    BranchSpan(const BranchRecord *data, size_t size) : data(data), size(size) {}
+    template <typename S>
+    BranchSpan(const S &span) : data(span.data), size(span.size) {}
+
+    const BranchRecord *begin() const { return data; }
+    const BranchRecord *end() const { return data + size; }
+};
+
+class PredictorStats {
+public:
+    explicit PredictorStats(const std::string &name) : name(name) {}
+
+    void record_prediction(bool taken, bool prediction) {
+        if (prediction == taken) {
+            correct_predictions++;
+        }
+        total_predictions++;
+    }
+
+    // The lines print_stats has always printed
+    std::string stats() const {
+        char buf[512];
+        snprintf(buf, sizeof(buf),
+                 "%s Correct Predictions: %llu\n%s Total Predictions: %llu\n%s Accuracy: %.2f%%\n",
+                 name.c_str(), (unsigned long long)correct_predictions, name.c_str(),
+                 (unsigned long long)total_predictions, name.c_str(),
+                 total_predictions ? 100.0 * correct_predictions / total_predictions : 0.0);
+        return buf;
+    }
+
+    const std::string &get_name() const { return name; }
+    uint64_t correct() const { return correct_predictions; }
+    uint64_t total() const { return total_predictions; }
+
+private:
+    std::string name;
+    uint64_t correct_predictions = 0;
+    uint64_t total_predictions = 0;
+};
+
+class StaticPredictor : public PredictorStats {
+public:
+    StaticPredictor() : PredictorStats("StaticPredictor") {}
+
+    bool predict(const BranchRecord &) {
+        return true; // 永远预测分支被采取
+    }
+
+    void update(const BranchRecord &, bool) {
+        // 静态预测器不需要更新
+    }
+};
+
+// 两位饱和计数器表，按PC索引；entries为1时就是原来的单个全局状态机
+class TwoBitPredictor : public PredictorStats {
+public:
+    // entries must be a power of two
+    explicit TwoBitPredictor(size_t entries = 1, unsigned char initial = 0b11, const std::string &name = "TwoBitPredictor")
+        : PredictorStats(name), mask(entries - 1), states(entries, initial) {}
+
+    bool predict(const BranchRecord &br) {
+        // 预测为 taken 当 state 的高位为1
+        return states[index(br.pc)] & 0b10;
+    }
+
+    void update(const BranchRecord &br, bool taken) {
+        // 更新两位状态机
+        unsigned char &state = states[index(br.pc)];
+        if (taken) {
+            if (state != 0b11) state++;
+        } else {
+            if (state != 0b00) state--;
+        }
+    }
+
+    size_t storage_bits() const { return states.size() * 2; }
+
+private:
+    size_t mask;
+    std::vector<unsigned char> states; // 两位状态机状态
+
+    size_t index(uint64_t pc) const { return (size_t)(pc >> 2) & mask; }
+};
+
+class BackwardJumpPredictor : public PredictorStats {
+public:
+    BackwardJumpPredictor() : PredictorStats("BackwardJumpPredictor") {}
+
+    bool predict(const BranchRecord &br) {
+        // 检查分支目标地址是否小于当前指令地址
+        return br.target < br.pc;
+    }
+
+    void update(const BranchRecord &, bool) {
+        // 后向跳转预测不需要更新
+    }
+};
+
+// 局部历史表是直接映射、按分支PC索引的定长数组，每项是标签加历史，4字节，
+// 一次查找只碰一个cache line。内存在构造时就确定，与静态分支数无关；
+// 不同分支落到同一项时计入别名统计。
+class LocalHistoryPredictor : public PredictorStats {
+public:
+    // log_entries: 局部历史表2^log_entries项；history_bits: 每项保留的历史位数（最多16）
+    explicit LocalHistoryPredictor(unsigned log_entries = 12, unsigned history_bits = 4,
+                                   const std::string &name = "LocalHistoryPredictor")
+        : PredictorStats(name), log_entries(log_entries),
+          history_bits(history_bits < 16 ? history_bits : 16),
+          local_histories(size_t(1) << log_entries),
+          local_pattern_table(size_t(1) << this->history_bits, 0) {}
+
+    bool predict(const BranchRecord &br) {
+        lookup(br.pc);
+        unsigned history = last_hit ? local_histories[last_index].history : 0;
+        return local_pattern_table[history] & 0b10; // 预测为 taken 当状态的高位为1
+    }
+
+    void update(const BranchRecord &br, bool taken) {
+        if (last_pc != br.pc)
+            lookup(br.pc);
+        Slot &slot = local_histories[last_index];
+        if (last_hit) {
+            hits++;
+        } else {
+            // 新分支占用这一项：空项是冷缺失，否则是挤掉了别的分支
+            if (slot.tag == 0)
+                cold_misses++;
+            else
+                conflicts++;
+            slot.tag = last_tag;
+            slot.history = 0;
+        }
+        // 更新两位状态机
+        unsigned char &state = local_pattern_table[slot.history];
+        if (taken) {
+            if (state != 0b11) state++;
+        } else {
+            if (state != 0b00) state--;
+        }
+        slot.history = ((slot.history << 1) | taken) & ((1u << history_bits) - 1); // 仅保留最近history_bits次历史
+        last_pc = ~(uint64_t)0;
+    }
+
+    // 局部历史表的占用和别名情况
+    std::string table_stats() const {
+        char buf[512];
+        uint64_t lookups = hits + cold_misses + conflicts;
+        snprintf(buf, sizeof(buf),
+                 "%s History Table: %zu entries, %u history bits, %zu bytes\n"
+                 "%s Table Hits: %llu, Cold Misses: %llu, Conflicts: %llu (%.2f%%)\n",
+                 get_name().c_str(), local_histories.size(), history_bits,
+                 local_histories.size() * sizeof(Slot) + local_pattern_table.size(),
+                 get_name().c_str(), (unsigned long long)hits, (unsigned long long)cold_misses,
+                 (unsigned long long)conflicts, lookups ? 100.0 * conflicts / lookups : 0.0);
+        return buf;
+    }
+
+    size_t storage_bits() const {
+        return local_histories.size() * (TAG_BITS + history_bits) + local_pattern_table.size() * 2;
+    }
+
+private:
+    static const unsigned TAG_BITS = 15;
+
+    struct Slot {
+        uint16_t tag = 0;     // 0表示空；有效标签最高位为1
+        uint16_t history = 0; // 局部分支历史
+    };
+
+    unsigned log_entries;
+    unsigned history_bits;
+    std::vector<Slot> local_histories;               // 局部分支历史
+    std::vector<unsigned char> local_pattern_table;  // 局部模式表，两位状态机
+    uint64_t hits = 0, cold_misses = 0, conflicts = 0;
+
+    // 最近一次查找，predict和update共用
+    uint64_t last_pc = ~(uint64_t)0;
+    size_t last_index = 0;
+    uint16_t last_tag = 0;
+    bool last_hit = false;
+
+    void lookup(uint64_t pc) {
+        uint64_t hashed = pc >> 2;
+        last_pc = pc;
+        last_index = (size_t)hashed & (local_histories.size() - 1);
+        last_tag = (uint16_t)(((hashed >> log_entries) & ((1u << TAG_BITS) - 1)) | (1u << TAG_BITS));
+        last_hit = local_histories[last_index].tag == last_tag;
+    }
+};
+
+// TAGE：一个无标签的bimodal基础表，加上若干个用越来越长的全局历史索引的带标签表。
+// 每个带标签表的索引和标签都由增量折叠的全局历史得到，每条分支的代价是
+// 基础表加每个表各一个表项，与历史长度无关。predict做一次查找，结果留给紧接着的
+// update使用。
+class TAGEPredictor : public PredictorStats {
+public:
+    // history_lengths: 每个带标签表的全局历史长度（递增，最长MAX_HISTORY位，
+    //                  最多MAX_TABLES个表）
+    // log_entries: 每个带标签表2^log_entries项；基础表是它的4倍
+    explicit TAGEPredictor(const std::vector<unsigned> &history_lengths = {5, 15, 44, 130},
+                           unsigned log_entries = 10, const std::string &name = "TAGEPredictor")
+        : PredictorStats(name),
+          num_tables(history_lengths.size() < MAX_TABLES ? history_lengths.size() : MAX_TABLES),
+          log_entries(log_entries), base(size_t(1) << (log_entries + 2), 0b10),
+          entries((size_t)num_tables << log_entries), tables(num_tables) {
+        for (unsigned i = 0; i < num_tables; i++) {
+            Table &t = tables[i];
+            t.history_length = history_lengths[i] < MAX_HISTORY ? history_lengths[i] : MAX_HISTORY;
+            t.tag_bits = TAG_BITS_MIN + i < TAG_BITS_MAX ? TAG_BITS_MIN + i : TAG_BITS_MAX;
+            t.pc_shift = log_entries - i % log_entries;
+            t.index_fold.init(t.history_length, log_entries);
+            t.tag_fold[0].init(t.history_length, t.tag_bits);
+            t.tag_fold[1].init(t.history_length, t.tag_bits - 1);
+        }
+    }
+
+    bool predict(const BranchRecord &br) {
+        lookup(br.pc);
+        return last.prediction;
+    }
+
+    void update(const BranchRecord &br, bool taken) {
+        if (last.pc != br.pc)
+            lookup(br.pc);
+        int provider = last.provider;
+        if (provider >= 0) {
+            Entry &e = entry(provider, last.index[provider]);
+            // 提供者和替补预测不同时，按对错调整useful位
+            if (last.provider_prediction != last.alt_prediction) {
+                if (last.provider_prediction == taken) {
+                    if (e.useful < USEFUL_MAX) e.useful++;
+                } else if (e.useful > 0) {
+                    e.useful--;
+                }
+            }
+            update_counter(e.counter, taken);
+        } else {
+            unsigned char &state = base[last.base_index];
+            if (taken) {
+                if (state != 0b11) state++;
+            } else {
+                if (state != 0b00) state--;
+            }
+        }
+
+        // 预测错了就在更长历史的表里分配一项：取第一个useful为0的；
+        // 都不可用则让它们老化，以后总能分配到
+        if (last.prediction != taken && provider + 1 < (int)num_tables) {
+            int alloc = -1;
+            for (unsigned i = provider + 1; i < num_tables; i++) {
+                if (entry(i, last.index[i]).useful == 0) {
+                    alloc = i;
+                    break;
+                }
+            }
+            if (alloc >= 0) {
+                Entry &e = entry(alloc, last.index[alloc]);
+                e.tag = last.tag[alloc];
+                e.counter = taken ? 0 : -1;
+                e.useful = 0;
+            } else {
+                for (unsigned i = provider + 1; i < num_tables; i++)
+                    entry(i, last.index[i]).useful--;
+            }
+        }
+
+        // 定期清掉useful位，避免表项永远占着
+        if (++branches % USEFUL_RESET_PERIOD == 0) {
+            for (Entry &e : entries)
+                e.useful >>= 1;
+        }
+
+        push_history(taken);
+        last.pc = ~(uint64_t)0;
+    }
+
+    size_t storage_bits() const {
+        size_t bits = base.size() * 2 + MAX_HISTORY;
+        for (const Table &t : tables)
+            bits += (size_t(1) << log_entries) * (3 + 2 + t.tag_bits);
+        return bits;
+    }
+
+private:
+    static const unsigned MAX_HISTORY = 1024;
+    static const unsigned HISTORY_BUFFER = 2 * MAX_HISTORY; // 2的幂，环形全局历史
+    static const unsigned TAG_BITS_MIN = 8;
+    static const unsigned TAG_BITS_MAX = 14;
+    static const unsigned MAX_TABLES = 16;
+    static const unsigned char USEFUL_MAX = 3;
+    static const uint64_t USEFUL_RESET_PERIOD = 1 << 18;
+
+    struct Entry {
+        int8_t counter = 0;   // 3位有符号饱和计数器，>=0预测taken
+        uint8_t useful = 0;   // 2位useful计数
+        uint16_t tag = 0;     // 0表示从未分配，算出的标签不会是0
+    };
+
+    // 把最近orig_length位历史折叠成compressed_length位，每来一位增量更新
+    struct FoldedHistory {
+        unsigned value = 0;
+        unsigned orig_length = 0;
+        unsigned compressed_length = 1;
+        unsigned outpoint = 0;
+
+        void init(unsigned orig, unsigned compressed) {
+            orig_length = orig;
+            compressed_length = compressed;
+            outpoint = orig % compressed;
+        }
+
+        // newest: 刚进来的一位；oldest: 刚移出orig_length窗口的一位
+        void update(unsigned newest, unsigned oldest) {
+            value = (value << 1) | newest;
+            value ^= oldest << outpoint;
+            value ^= value >> compressed_length;
+            value &= (1u << compressed_length) - 1;
+        }
+    };
+
+    struct Table {
+        unsigned history_length;
+        unsigned tag_bits;
+        unsigned pc_shift; // 每个表用不同的PC高位参与索引
+        FoldedHistory index_fold;
+        FoldedHistory tag_fold[2];
+    };
+
+    // 一次查找的结果，predict和update共用
+    struct Lookup {
+        uint64_t pc = ~(uint64_t)0;
+        size_t base_index = 0;
+        unsigned index[MAX_TABLES];
+        uint16_t tag[MAX_TABLES];
+        int provider = -1;
+        bool provider_prediction = false;
+        bool alt_prediction = false;
+        bool prediction = false;
+    };
+
+    unsigned num_tables;
+    unsigned log_entries;
+    std::vector<unsigned char> base;     // 基础bimodal，两位状态机
+    std::vector<Entry> entries;          // 所有带标签表，[table << log_entries | index]
+    std::vector<Table> tables;
+    uint8_t history[HISTORY_BUFFER] = {}; // history[head]是最新的一位
+    unsigned head = 0;
+    uint64_t branches = 0;
+    Lookup last;
+
+    Entry &entry(unsigned table, unsigned index) {
+        return entries[((size_t)table << log_entries) | index];
+    }
+
+    static void update_counter(int8_t &counter, bool taken) {
+        if (taken) {
+            if (counter < 3) counter++;
+        } else {
+            if (counter > -4) counter--;
+        }
+    }
+
+    void lookup(uint64_t pc) {
+        unsigned index_mask = (1u << log_entries) - 1;
+        uint64_t hashed = pc >> 2;
+        last.pc = pc;
+        last.base_index = (size_t)hashed & (base.size() - 1);
+        last.provider = -1;
+        int alt = -1;
+        for (unsigned i = 0; i < num_tables; i++) {
+            const Table &t = tables[i];
+            last.index[i] = (unsigned)(hashed ^ (hashed >> t.pc_shift) ^ t.index_fold.value) & index_mask;
+            unsigned tag = (unsigned)(hashed ^ t.tag_fold[0].value ^ (t.tag_fold[1].value << 1)) & ((1u << t.tag_bits) - 1);
+            last.tag[i] = (uint16_t)(tag != 0 ? tag : 1);
+        }
+        // 最长历史命中的是提供者，次长命中的是替补
+        for (int i = num_tables - 1; i >= 0; i--) {
+            if (entry(i, last.index[i]).tag == last.tag[i]) {
+                if (last.provider < 0)
+                    last.provider = i;
+                else {
+                    alt = i;
+                    break;
+                }
+            }
+        }
+        bool base_prediction = base[last.base_index] & 0b10;
+        last.alt_prediction = alt >= 0 ? entry(alt, last.index[alt]).counter >= 0 : base_prediction;
+        if (last.provider >= 0) {
+            last.provider_prediction = entry(last.provider, last.index[last.provider]).counter >= 0;
+            last.prediction = last.provider_prediction;
+        } else {
+            last.provider_prediction = base_prediction;
+            last.prediction = base_prediction;
+        }
+    }
+
+    void push_history(bool taken) {
+        head = (head - 1) & (HISTORY_BUFFER - 1);
+        history[head] = taken;
+        for (Table &t : tables) {
+            unsigned oldest = history[(head + t.history_length) & (HISTORY_BUFFER - 1)];
+            t.index_fold.update(taken, oldest);
+            t.tag_fold[0].update(taken, oldest);
+            t.tag_fold[1].update(taken, oldest);
+        }
+    }
+};
+
+// Runs every record of the batch through one predictor
+template <typename P>
+inline void predict_and_update(P &p, BranchSpan batch) {
+    for (const BranchRecord &br : batch) {
+        bool taken = br.taken != 0;
+        p.record_prediction(taken, p.predict(br));
+        p.update(br, taken);
+    }
+}
+
+// A fixed set of predictors, composed at compile time
+template <typename... Ps>
+class PredictorSuite {
+public:
+    static constexpr size_t size = sizeof...(Ps);
+
+    PredictorSuite() = default;
+    explicit PredictorSuite(Ps... ps) : predictors(std::move(ps)...) {}
+
+    void predict_and_update(BranchSpan batch) {
+        std::apply([&](Ps &...p) { (::predict_and_update(p, batch), ...); }, predictors);
+    }
+
+    template <typename F>
+    void for_each(F f) {
+        std::apply([&](Ps &...p) { (f(p), ...); }, predictors);
+    }
+
+    template <size_t I>
+    auto &get() { return std::get<I>(predictors); }
+
+private:
+    std::tuple<Ps...> predictors;
+};
+
+// The suite bptest has always run
+typedef PredictorSuite<StaticPredictor, TwoBitPredictor, BackwardJumpPredictor,
+                       LocalHistoryPredictor, TAGEPredictor>
+    DefaultSuite;
+
+#endif // BPTEST_PREDICTORS_H
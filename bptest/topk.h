@@ -0,0 +1,197 @@
+#ifndef BPTEST_TOPK_H
+#define BPTEST_TOPK_H
+
+// Per-branch misprediction attribution in fixed memory.
+//
+// MispredictSketch is a space-saving summary of mispredictions by branch pc:
+// it monitors at most `capacity` branches, and a mispredicted branch that is
+// not monitored takes over the entry with the fewest mispredictions,
+// inheriting that count as its error bound. Any branch with more than
+// total_mispredictions / capacity mispredictions is guaranteed to be present.
+// A monitored branch also counts its executions, taken outcomes and
+// mispredictions from the time it entered the summary; the rate and bias
+// columns of the report come from these, so they share one window.
+//
+// Entries sit in a min-heap on the misprediction count; a small
+// open-addressed index maps pc to entry, so each branch costs one probe.
+//
+// Attributed<P> wraps any predictors.h predictor and feeds its outcomes to a
+// sketch from inside the predict/update loop.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include "predictors.h"
+
+class MispredictSketch {
+public:
+    struct Entry {
+        uint64_t pc = 0;
+        uint64_t mispredicts = 0; // upper bound; at least mispredicts - error are real
+        uint64_t error = 0;
+        uint64_t executions = 0;  // since the branch entered the summary
+        uint64_t taken = 0;
+        uint64_t window_mispredicts = 0; // over the same executions
+    };
+
+    explicit MispredictSketch(size_t capacity = 1024)
+        : entries(capacity < 1 ? 1 : capacity), heap(entries.size()), heap_pos(entries.size()) {
+        size_t slots = 1;
+        while (slots < 2 * entries.size())
+            slots <<= 1;
+        index.assign(slots, EMPTY);
+    }
+
+    void record(uint64_t pc, bool taken, bool mispredicted) {
+        size_t slot = find(pc);
+        if (index[slot] != EMPTY) {
+            uint32_t id = index[slot];
+            Entry &e = entries[id];
+            e.executions++;
+            e.taken += taken;
+            if (mispredicted) {
+                e.mispredicts++;
+                e.window_mispredicts++;
+                sift_down(heap_pos[id]);
+            }
+            return;
+        }
+        if (!mispredicted)
+            return;
+
+        uint32_t id;
+        uint64_t floor = 0;
+        bool replaced = used == entries.size();
+        if (!replaced) {
+            id = (uint32_t)used;
+            heap[used] = id;
+            heap_pos[id] = used;
+            used++;
+        } else {
+            // 换掉误预测最少的分支，它的计数成为新分支的误差
+            id = heap[0];
+            floor = entries[id].mispredicts;
+            erase(entries[id].pc);
+            slot = find(pc);
+        }
+        index[slot] = id;
+        Entry &e = entries[id];
+        e.pc = pc;
+        e.mispredicts = floor + 1;
+        e.error = floor;
+        e.executions = 1;
+        e.taken = taken;
+        e.window_mispredicts = 1;
+        if (replaced)
+            sift_down(0);
+        else
+            sift_up(heap_pos[id]);
+    }
+
+    // The k entries with the most mispredictions, most first
+    std::vector<Entry> top(size_t k) const {
+        std::vector<Entry> result(entries.begin(), entries.begin() + used);
+        std::sort(result.begin(), result.end(),
+                  [](const Entry &a, const Entry &b) { return a.mispredicts > b.mispredicts; });
+        if (result.size() > k)
+            result.resize(k);
+        return result;
+    }
+
+    size_t capacity() const { return entries.size(); }
+
+private:
+    static constexpr uint32_t EMPTY = ~(uint32_t)0;
+
+    std::vector<Entry> entries;
+    std::vector<uint32_t> heap;     // entry ids, min-heap on mispredicts
+    std::vector<size_t> heap_pos;   // [id] position in heap
+    std::vector<uint32_t> index;    // pc hash -> entry id, linear probing
+    size_t used = 0;
+
+    size_t home(uint64_t pc) const {
+        return (size_t)((pc >> 2) * 0x9e3779b97f4a7c15ull >> 32) & (index.size() - 1);
+    }
+
+    // Slot holding pc, or the empty slot where it would go
+    size_t find(uint64_t pc) const {
+        size_t mask = index.size() - 1;
+        size_t slot = home(pc);
+        while (index[slot] != EMPTY && entries[index[slot]].pc != pc)
+            slot = (slot + 1) & mask;
+        return slot;
+    }
+
+    // Removes pc from the index, shifting later entries of its probe run back
+    void erase(uint64_t pc) {
+        size_t mask = index.size() - 1;
+        size_t hole = find(pc);
+        index[hole] = EMPTY;
+        for (size_t slot = (hole + 1) & mask; index[slot] != EMPTY; slot = (slot + 1) & mask) {
+            size_t want = home(entries[index[slot]].pc);
+            // 只有在不越过自己起始位置的前提下才能搬进空位
+            if (((slot - want) & mask) >= ((slot - hole) & mask)) {
+                index[hole] = index[slot];
+                index[slot] = EMPTY;
+                hole = slot;
+            }
+        }
+    }
+
+    uint64_t key(size_t pos) const { return entries[heap[pos]].mispredicts; }
+
+    void swap_heap(size_t a, size_t b) {
+        std::swap(heap[a], heap[b]);
+        heap_pos[heap[a]] = a;
+        heap_pos[heap[b]] = b;
+    }
+
+    void sift_up(size_t pos) {
+        while (pos > 0 && key((pos - 1) / 2) > key(pos)) {
+            swap_heap(pos, (pos - 1) / 2);
+            pos = (pos - 1) / 2;
+        }
+    }
+
+    void sift_down(size_t pos) {
+        for (;;) {
+            size_t smallest = pos, left = 2 * pos + 1, right = left + 1;
+            if (left < used && key(left) < key(smallest))
+                smallest = left;
+            if (right < used && key(right) < key(smallest))
+                smallest = right;
+            if (smallest == pos)
+                return;
+            swap_heap(pos, smallest);
+            pos = smallest;
+        }
+    }
+};
+
+template <typename P>
+class Attributed : public P {
+public:
+    template <typename... Args>
+    explicit Attributed(size_t capacity, Args &&...args)
+        : P(std::forward<Args>(args)...), sketch(capacity) {}
+    Attributed() = default;
+
+    bool predict(const BranchRecord &br) {
+        last_prediction = P::predict(br);
+        return last_prediction;
+    }
+
+    void update(const BranchRecord &br, bool taken) {
+        sketch.record(br.pc, taken, last_prediction != taken);
+        P::update(br, taken);
+    }
+
+    MispredictSketch sketch;
+
+private:
+    bool last_prediction = false;
+};
+
+#endif // BPTEST_TOPK_H
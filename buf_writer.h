@@ -0,0 +1,149 @@
+#ifndef BUF_WRITER_H
+#define BUF_WRITER_H
+
+/* Per-thread buffered log files for the clients.
+ *
+ * Each thread owns its writer, so logging takes no lock. Output collects in
+ * a page-aligned buffer and reaches the file only as whole BW_BLOCK_SIZE
+ * blocks; the tail goes out when the writer is flushed or closed.
+ *
+ * Usage from a client:
+ *   dr_client_main:  bw_log_init("name.%d.log") after drmgr_init()
+ *   anywhere on the thread: bw_log_printf(drcontext, ...) or
+ *                    bw_write(bw_log(drcontext), data, size)
+ *   exit event:      bw_log_exit(), before drmgr_exit()
+ *
+ * The log's thread events run before (init) and after (exit) the client's
+ * own, so a client can still log from its thread exit event.
+ */
+
+#include <stdarg.h>
+#include <string.h>
+#include "dr_api.h"
+#include "drmgr.h"
+
+/* Unit of a file write, and the buffer size */
+#define BW_BLOCK_SIZE (1 << 20)
+/* Longest line bw_printf formats in one go; longer lines are cut */
+#define BW_MAX_LINE 1024
+
+typedef struct _bw_writer_t {
+    file_t file;
+    size_t used;
+    char *buf; /* BW_BLOCK_SIZE, page aligned */
+} bw_writer_t;
+
+static inline bw_writer_t *
+bw_open(void *drcontext, const char *path)
+{
+    bw_writer_t *w = (bw_writer_t *)dr_thread_alloc(drcontext, sizeof(*w));
+    w->file = dr_open_file(path, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    DR_ASSERT(w->file != INVALID_FILE);
+    w->used = 0;
+    w->buf = (char *)dr_raw_mem_alloc(BW_BLOCK_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    DR_ASSERT(w->buf != NULL);
+    return w;
+}
+
+/* Writes out whatever is buffered, full block or not */
+static inline void
+bw_flush(bw_writer_t *w)
+{
+    if (w->used > 0 && dr_write_file(w->file, w->buf, w->used) != (ssize_t)w->used)
+        DR_ASSERT(false);
+    w->used = 0;
+}
+
+static inline void
+bw_write(bw_writer_t *w, const void *data, size_t size)
+{
+    const char *src = (const char *)data;
+    while (size > 0) {
+        size_t n = BW_BLOCK_SIZE - w->used;
+        if (n > size)
+            n = size;
+        memcpy(w->buf + w->used, src, n);
+        w->used += n;
+        src += n;
+        size -= n;
+        if (w->used == BW_BLOCK_SIZE)
+            bw_flush(w);
+    }
+}
+
+static inline void
+bw_printf(bw_writer_t *w, const char *fmt, ...)
+{
+    char line[BW_MAX_LINE];
+    va_list ap;
+    int len;
+    va_start(ap, fmt);
+    len = dr_vsnprintf(line, BUFFER_SIZE_ELEMENTS(line), fmt, ap);
+    va_end(ap);
+    /* dr_vsnprintf returns -1 when the line does not fit */
+    if (len < 0)
+        len = BUFFER_SIZE_ELEMENTS(line);
+    bw_write(w, line, len);
+}
+
+static inline void
+bw_close(void *drcontext, bw_writer_t *w)
+{
+    bw_flush(w);
+    dr_close_file(w->file);
+    dr_raw_mem_free(w->buf, BW_BLOCK_SIZE);
+    dr_thread_free(drcontext, w, sizeof(*w));
+}
+
+/* One writer per thread, opened at thread init as bw_log_format % tid */
+static char bw_log_format[256];
+static int bw_log_tls_idx = -1;
+
+static void
+bw_log_thread_init(void *drcontext)
+{
+    char path[MAXIMUM_PATH];
+    dr_snprintf(path, BUFFER_SIZE_ELEMENTS(path), bw_log_format, dr_get_thread_id(drcontext));
+    NULL_TERMINATE_BUFFER(path);
+    drmgr_set_tls_field(drcontext, bw_log_tls_idx, bw_open(drcontext, path));
+}
+
+static void
+bw_log_thread_exit(void *drcontext)
+{
+    bw_close(drcontext, (bw_writer_t *)drmgr_get_tls_field(drcontext, bw_log_tls_idx));
+}
+
+static inline bw_writer_t *
+bw_log(void *drcontext)
+{
+    return (bw_writer_t *)drmgr_get_tls_field(drcontext, bw_log_tls_idx);
+}
+
+#define bw_log_printf(drcontext, ...) bw_printf(bw_log(drcontext), __VA_ARGS__)
+
+/* path_format has one %d, the thread id */
+static inline void
+bw_log_init(const char *path_format)
+{
+    drmgr_priority_t init_pri = { sizeof(init_pri), "bw_log", NULL, NULL, -100 };
+    drmgr_priority_t exit_pri = { sizeof(exit_pri), "bw_log", NULL, NULL, 100 };
+    dr_snprintf(bw_log_format, BUFFER_SIZE_ELEMENTS(bw_log_format), "%s", path_format);
+    NULL_TERMINATE_BUFFER(bw_log_format);
+    bw_log_tls_idx = drmgr_register_tls_field();
+    if (bw_log_tls_idx == -1 ||
+        !drmgr_register_thread_init_event_ex(bw_log_thread_init, &init_pri) ||
+        !drmgr_register_thread_exit_event_ex(bw_log_thread_exit, &exit_pri))
+        DR_ASSERT(false);
+}
+
+static inline void
+bw_log_exit(void)
+{
+    if (!drmgr_unregister_thread_init_event(bw_log_thread_init) ||
+        !drmgr_unregister_thread_exit_event(bw_log_thread_exit) ||
+        !drmgr_unregister_tls_field(bw_log_tls_idx))
+        DR_ASSERT(false);
+}
+
+#endif /* BUF_WRITER_H */
@@ -5,18 +5,31 @@ import struct
 PIPE_NAME = '/tmp/my_pipe'
 STRUCT_FORMAT = 'ii50s'
 
-def read_struct_from_pipe():
-    with open(PIPE_NAME, 'rb', buffering=0) as pipe:
-        data = pipe.read(struct.calcsize(STRUCT_FORMAT))
-        return struct.unpack(STRUCT_FORMAT, data)
+# tracechunk (tracechunk.cpp) hands over whole batches of records; without it
+# fall back to reading one struct at a time from a pipe opened once.
+try:
+    import tracechunk
+except ImportError:
+    tracechunk = None
+
+def read_structs_from_pipe():
+    if tracechunk is not None:
+        # one Reader per writer session; the FIFO is reopened only when the writer goes away
+        while True:
+            for chunk in tracechunk.Reader(PIPE_NAME, kind='mystruct'):
+                yield from struct.iter_unpack(STRUCT_FORMAT, memoryview(chunk).cast('B'))
+    size = struct.calcsize(STRUCT_FORMAT)
+    with open(PIPE_NAME, 'rb+', buffering=0) as pipe:
+        while True:
+            data = pipe.read(size)
+            yield struct.unpack(STRUCT_FORMAT, data)
 
 # Ensure the pipe exists
 if not os.path.exists(PIPE_NAME):
     os.mkfifo(PIPE_NAME)
 
 print("Waiting for data...")
-while True:
-    struct_data = read_struct_from_pipe()
+for struct_data in read_structs_from_pipe():
     id, value, name = struct_data
     name = name.split(b'\0', 1)[0].decode('utf-8')  # Remove null characters and decode
 
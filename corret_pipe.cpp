@@ -7,25 +7,31 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/stat.h>
-
-#define PIPE_NAME "/tmp/my_pipe"
+#include "trace_records.h"
+#include "ring_producer.h"
+#include "opcode_mix.h"
 
 static file_t log_file;
 static void *mutex;
+static bool log_instrs; /* -log: also write every instruction to the log file */
+static bool opcode_mix; /* -opcode_mix: per-BB opcode histogram instead of the ring */
 
 static void event_exit(void);
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data);
 static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data);
-static void record_instruction(void *drcontext, int opcode);
+static void log_instruction(int opcode);
 static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd);
 
-int fd;
-
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
     dr_set_client_name("DynamoRIO Instruction Recorder", "http://dynamorio.org/issues");
-    mkfifo(PIPE_NAME, 0666);
-    fd = dr_open_file(PIPE_NAME, DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-log") == 0)
+            log_instrs = true;
+        else if (strcmp(argv[i], "-opcode_mix") == 0)
+            opcode_mix = true;
+    }
+
     if (!drmgr_init()) {
         DR_ASSERT(false);
         return;
@@ -35,6 +41,10 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 
     DR_ASSERT(log_file != INVALID_FILE);
     mutex = dr_mutex_create();
+    if (opcode_mix)
+        opcode_mix_init(log_file);
+    else
+        ring_producer_init();
 
     dr_register_exit_event(event_exit);
     drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, NULL);
@@ -44,56 +54,46 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 
 static void event_exit(void)
 {
+    if (opcode_mix)
+        opcode_mix_exit();
+    else
+        ring_producer_exit();
     dr_mutex_destroy(mutex);
     dr_close_file(log_file);
-    dr_close_file(fd);
     drmgr_exit();
 }
 
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
 {
+    *user_data = opcode_mix ? opcode_mix_analyze(tag, bb) : NULL;
     return DR_EMIT_DEFAULT;
 }
 
 static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data)
 {
+    if (opcode_mix) {
+        if (drmgr_is_first_instr(drcontext, instr))
+            opcode_mix_instrument(drcontext, bb, instr, user_data);
+        return DR_EMIT_DEFAULT;
+    }
     // 禁用自动谓词化，因为我们希望无条件执行以下插桩代码
     drmgr_disable_auto_predication(drcontext, bb);
 
-    // 如果user_data为空，说明不需要对该基本块进行插桩
-    if (user_data == NULL)
-        return DR_EMIT_DEFAULT;
-
-    // 在每条应用程序指令前插入清理调用
-    if (instr_is_app(instr)) {
+    // 只有 -log 才对每条指令做清理调用
+    if (log_instrs && instr_is_app(instr)) {
         int opcode = instr_get_opcode(instr); // 获取指令操作码
-        dr_insert_clean_call(drcontext, bb, instr, (void *)record_instruction,
-                             false /* save fpstate */, 2, 
-                             OPND_CREATE_INTPTR(drcontext),
-                             OPND_CREATE_INT32(opcode));
+        dr_insert_clean_call(drcontext, bb, instr, (void *)log_instruction,
+                             false /* save fpstate */, 1, OPND_CREATE_INT32(opcode));
     }
+    // 记录内联写进环的下一个槽位，见 ring_producer.h
+    ring_producer_instrument(drcontext, bb, instr);
 
     return DR_EMIT_DEFAULT;
 }
 
-#pragma pack(push, 1)
-typedef struct {
-    int id;
-    int opcode;
-    char opcode_name[50];
-} MyStruct;
-#pragma pack(pop)
-
-
-static void record_instruction(void *drcontext, int opcode)
+static void log_instruction(int opcode)
 {
     dr_fprintf(log_file, "Instruction: %s\n", decode_opcode_name(opcode));
-    MyStruct instr_info;
-    instr_info.id = 0;
-    instr_info.opcode = 2;
-    snprintf(instr_info.opcode_name, sizeof(instr_info.opcode_name), "example");
-    dr_write_file(fd, &instr_info,  sizeof(MyStruct));
-    printf("Written to file\n");
 }
 
 static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd)
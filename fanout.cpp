@@ -0,0 +1,97 @@
+// Single-pass analysis driver: reads an ins_ref_t trace (bigdata or bbexpand
+// output, file or FIFO) once and runs the cache, branch and pipeline models
+// over it concurrently.
+// Usage: fanout <trace> [queue depth]
+// Build: g++ -O2 -std=c++17 -pthread -o fanout fanout.cpp
+#include <stdlib.h>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "fanout.h"
+#include "pipeline_model.h"
+#include "bptest/predictors.h"
+#include "rrp/l1cache.h"
+
+// Bimodal predictor: 2-bit saturating counters indexed by pc
+#define BIMODAL_ENTRIES 4096
+
+struct BimodalStage {
+    TwoBitPredictor bimodal = TwoBitPredictor(BIMODAL_ENTRIES, 2, "bimodal");
+    std::vector<BranchRecord> batch;
+    // A branch's outcome is only known from the instruction after it, which
+    // may sit in the next chunk. A branch that ends the trace has no such
+    // instruction; it stays pending and is reported as unresolved.
+    bool pending = false;
+    ins_ref_t last = {};
+
+    void resolve(const ins_ref_t &br, app_pc next_pc) {
+        BranchRecord rec = {};
+        rec.pc = (uintptr_t)br.pc;
+        rec.target = (uintptr_t)br.target_addr;
+        rec.taken = next_pc != br.fall_addr;
+        rec.kind = BRANCH_KIND_COND;
+        batch.push_back(rec);
+    }
+
+    void operator()(const ins_ref_t *ins, size_t count) {
+        batch.clear();
+        for (size_t i = 0; i < count; i++) {
+            if (pending)
+                resolve(last, ins[i].pc);
+            pending = ins[i].is_cbr;
+            if (pending)
+                last = ins[i];
+        }
+        predict_and_update(bimodal, BranchSpan(batch.data(), batch.size()));
+    }
+};
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <ins_ref trace> [queue depth]" << std::endl;
+        return 1;
+    }
+    TraceReader<ins_ref_t> reader(argv[1]);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    // Same geometry as rrp1's first cache
+    L1Cache cache(32768, 64, 8, "SRRIP");
+    BimodalStage branch;
+    PipelineModel pipeline;
+
+    FanOut<ins_ref_t> fanout(argc > 2 ? atoi(argv[2]) : 8);
+    fanout.add_stage("cache", [&](const ins_ref_t *ins, size_t count) {
+        static const std::string read = "r", write = "w";
+        for (size_t i = 0; i < count; i++) {
+            for (int j = 0; j < ins[i].num_operands && j < 4; j++) {
+                const operand_t &op = ins[i].operands[j];
+                if (op.type == OPERAND_TYPE_MEMORY)
+                    cache.accessMemory(op.is_dest ? write : read, (unsigned long)op.value.mem_addr);
+            }
+        }
+    });
+    fanout.add_stage("branch", std::ref(branch));
+    fanout.add_stage("pipeline", [&](const ins_ref_t *ins, size_t count) {
+        pipeline.replay(ins, count);
+    });
+    fanout.run(reader);
+    if (!reader.ok()) {
+        std::cerr << reader.error() << std::endl;
+        return 1;
+    }
+
+    fanout.report(std::cout);
+    std::cout << "Cache (" << cache.getReplacementPolicy() << "):" << std::endl;
+    cache.printStatistics();
+    std::cout << "Branches: " << branch.bimodal.total() << ", bimodal accuracy: "
+              << (branch.bimodal.total() ? 100.0 * branch.bimodal.correct() / branch.bimodal.total() : 0.0) << "%";
+    if (branch.pending)
+        std::cout << " (1 unresolved: the trace ends on a conditional branch)";
+    std::cout << std::endl;
+    std::cout << "Pipeline: " << pipeline.instrs << " instructions, " << pipeline.cycles
+              << " cycles" << std::endl;
+    return 0;
+}
@@ -0,0 +1,180 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+// Decodes a trace once and broadcasts it to several simulator stages, each on
+// its own thread.
+//
+//     FanOut<ins_ref_t> fanout;
+//     fanout.add_stage("cache", [&](const ins_ref_t *ins, size_t n) { ... });
+//     fanout.add_stage("pipeline", [&](const ins_ref_t *ins, size_t n) { ... });
+//     fanout.run(reader);
+//     fanout.report(std::cout);
+//
+// Every batch from the reader is copied once into an immutable chunk that all
+// stages share by reference count; the last stage to finish with it frees
+// it. Each stage has a bounded queue, so a slow stage stalls the reader
+// instead of letting decoded chunks pile up, and the run takes as long as the
+// slowest stage rather than the sum of all of them.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace_reader.hpp"
+
+template <typename T>
+using Chunk = std::shared_ptr<const std::vector<T>>;
+
+// Blocking single-producer/single-consumer queue with a fixed capacity
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity < 1 ? 1 : capacity) {}
+
+    // Waits while the queue is full; returns true if it had to wait.
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        bool waited = items_.size() >= capacity_;
+        not_full_.wait(lock, [this] { return items_.size() < capacity_; });
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return waited;
+    }
+
+    // Waits for an item; false once the queue is closed and empty.
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (items_.empty())
+            return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+    }
+
+private:
+    size_t capacity_;
+    std::deque<T> items_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_full_, not_empty_;
+};
+
+template <typename T>
+class FanOut {
+public:
+    using StageFn = std::function<void(const T *, size_t)>;
+
+    // queue_depth: chunks a stage may fall behind before the reader waits
+    explicit FanOut(size_t queue_depth = 8) : queue_depth_(queue_depth) {}
+
+    FanOut(const FanOut &) = delete;
+    FanOut &operator=(const FanOut &) = delete;
+
+    void add_stage(const std::string &name, StageFn fn) {
+        stages_.emplace_back(new Stage(name, std::move(fn), queue_depth_));
+    }
+
+    // Feeds every batch of reader to all stages; returns the record count.
+    uint64_t run(TraceReader<T> &reader) {
+        Clock::time_point start = Clock::now();
+        for (auto &stage : stages_)
+            stage->thread = std::thread(&FanOut::stage_main, stage.get());
+
+        uint64_t records = 0;
+        for (Span<T> span = reader.next(); !span.empty(); span = reader.next()) {
+            Chunk<T> chunk = std::make_shared<const std::vector<T>>(span.begin(), span.end());
+            for (auto &stage : stages_) {
+                Clock::time_point before = Clock::now();
+                if (stage->queue.push(chunk)) {
+                    stage->blocked += Clock::now() - before;
+                    stage->stalls++;
+                }
+            }
+            records += span.size;
+            chunks_++;
+        }
+        for (auto &stage : stages_)
+            stage->queue.close();
+        for (auto &stage : stages_)
+            stage->thread.join();
+
+        records_ = records;
+        wall_ = Clock::now() - start;
+        return records;
+    }
+
+    // Per-stage busy time and throughput, plus how long each stage held up
+    // the reader.
+    void report(std::ostream &out) const {
+        double wall = seconds(wall_);
+        out << "Records: " << records_ << " in " << chunks_ << " chunks, " << wall << " s ("
+            << (wall > 0 ? records_ / wall / 1e6 : 0.0) << " M/s)" << std::endl;
+        for (const auto &stage : stages_) {
+            double busy = seconds(stage->busy);
+            out << "  " << stage->name << ": " << busy << " s busy, "
+                << (busy > 0 ? stage->records / busy / 1e6 : 0.0) << " M/s, stalled reader "
+                << stage->stalls << " times for " << seconds(stage->blocked) << " s"
+                << std::endl;
+        }
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Stage {
+        Stage(const std::string &name, StageFn fn, size_t depth)
+            : name(name), fn(std::move(fn)), queue(depth) {}
+
+        std::string name;
+        StageFn fn;
+        BoundedQueue<Chunk<T>> queue;
+        std::thread thread;
+        uint64_t records = 0;
+        Clock::duration busy{};    // time spent inside fn
+        Clock::duration blocked{}; // time the reader waited on this queue
+        uint64_t stalls = 0;
+    };
+
+    static void stage_main(Stage *stage) {
+        Chunk<T> chunk;
+        while (stage->queue.pop(chunk)) {
+            Clock::time_point before = Clock::now();
+            stage->fn(chunk->data(), chunk->size());
+            stage->busy += Clock::now() - before;
+            stage->records += chunk->size();
+            chunk.reset();
+        }
+    }
+
+    static double seconds(Clock::duration d) {
+        return std::chrono::duration<double>(d).count();
+    }
+
+    size_t queue_depth_;
+    std::vector<std::unique_ptr<Stage>> stages_;
+    uint64_t records_ = 0;
+    uint64_t chunks_ = 0;
+    Clock::duration wall_{};
+};
+
+#endif // FANOUT_H
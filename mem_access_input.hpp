@@ -0,0 +1,44 @@
+#ifndef MEM_ACCESS_INPUT_HPP
+#define MEM_ACCESS_INPUT_HPP
+
+// Input side of the cache simulators (rrp/, cah): feeds every access of a
+// trace file to access(type, address), type being "r" or "w".
+//
+// Binary traces from the memtrace clients (raw or chunked, see
+// trace_reader.hpp) are fed entry by entry: instr or data, every entry is a
+// read unless it is a write, like the text dump did. Anything else is read
+// as the old text dump, one "type address size" line per access.
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include "trace_reader.hpp"
+
+template <typename F>
+inline void for_each_mem_access(const std::string& filename, F access) {
+    if (tf_is_trace_file(filename.c_str())) {
+        const std::string read = "r", write = "w";
+        TraceReader<mem_ref_t> reader(filename);
+        for (Span<mem_ref_t> batch = reader.next(); !batch.empty(); batch = reader.next()) {
+            for (const mem_ref_t& ref : batch) {
+                access(ref.type == REF_TYPE_WRITE ? write : read, (unsigned long)ref.addr);
+            }
+        }
+        if (!reader.ok()) std::cerr << reader.error() << std::endl;
+        return;
+    }
+
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string type;
+        unsigned long address;
+        int size;
+        if (!(iss >> type >> std::hex >> address >> size)) { break; }
+        access(type, address);
+    }
+}
+
+#endif // MEM_ACCESS_INPUT_HPP
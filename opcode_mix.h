@@ -0,0 +1,284 @@
+#ifndef OPCODE_MIX_H
+#define OPCODE_MIX_H
+
+/* -opcode_mix: dynamic opcode histogram at close to native speed.
+ *
+ * Every block's static opcode counts are taken once, when the block is
+ * built, and filed under a block id. The block itself only gets one
+ * inline increment of the running thread's counter for that id: no clean
+ * call and no lock. At thread exit the thread's counters are multiplied out
+ * into per-module, per-opcode totals, and opcode_mix_exit() writes the
+ * process histogram and a per-module breakdown to the log.
+ *
+ * Usage from a client:
+ *   dr_client_main:  opcode_mix_init(log) after drmgr_init()
+ *   analysis event:  *user_data = opcode_mix_analyze(tag, bb)
+ *   insertion event: opcode_mix_instrument(..., user_data) at the block's
+ *                    first instr
+ *   exit event:      opcode_mix_exit(), before drmgr_exit()
+ */
+
+#include <limits.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "dr_api.h"
+#include "drmgr.h"
+#include "drreg.h"
+
+/* Block ids per process. Each thread reserves a counter per id up front;
+ * only the pages of the blocks it runs are ever touched.
+ */
+#define MIX_MAX_BLOCKS (1 << 20)
+#define MIX_COUNTERS_SIZE (MIX_MAX_BLOCKS * sizeof(ptr_uint_t))
+/* Opcodes listed per module in the report */
+#define MIX_TOP_PER_MODULE 10
+
+typedef struct {
+    uint module;  /* index into mix_modules */
+    uint first;   /* the block's (opcode, count) pairs start here in mix_ops */
+    uint num_ops;
+} mix_block_t;
+
+typedef struct {
+    int opcode;
+    uint count;
+} mix_op_t;
+
+static file_t mix_log;
+static void *mix_lock; /* guards everything below */
+static int mix_tls_idx;
+static reg_id_t mix_tls_seg;
+static uint mix_tls_offs;
+static std::vector<mix_block_t> mix_blocks;
+static std::vector<mix_op_t> mix_ops;
+static std::vector<std::string> mix_modules;
+static std::unordered_map<app_pc, std::vector<uint>> mix_ids; /* ids built at each pc */
+static std::vector<uint64> mix_totals; /* [module * (OP_LAST + 1) + opcode] */
+static uint64 mix_dropped;             /* blocks built past MIX_MAX_BLOCKS */
+
+/* Index of the module containing pc; 0 is code outside any module */
+static uint
+mix_module_index(app_pc pc)
+{
+    module_data_t *mod = dr_lookup_module(pc);
+    const char *name = mod == NULL ? NULL : dr_module_preferred_name(mod);
+    std::string key = name == NULL ? "<unknown>" : name;
+    if (mod != NULL)
+        dr_free_module_data(mod);
+    auto it = std::find(mix_modules.begin(), mix_modules.end(), key);
+    if (it != mix_modules.end())
+        return (uint)(it - mix_modules.begin());
+    mix_modules.push_back(key);
+    return (uint)mix_modules.size() - 1;
+}
+
+/* Id of a block at pc with these opcode counts, allocating one on first
+ * sight; UINT_MAX once MIX_MAX_BLOCKS are in use. A rebuild of the same code,
+ * DR's state-restore replay included, gets the same id and so the same inline
+ * increment; a trace or modified code at the same pc gets its own.
+ */
+static uint
+mix_block_id(app_pc pc, const std::vector<mix_op_t> &ops)
+{
+    std::vector<uint> &ids = mix_ids[pc];
+    for (uint id : ids) {
+        const mix_block_t &block = mix_blocks[id];
+        if (block.num_ops == ops.size() &&
+            std::equal(ops.begin(), ops.end(), mix_ops.begin() + block.first,
+                       [](const mix_op_t &a, const mix_op_t &b) {
+                           return a.opcode == b.opcode && a.count == b.count;
+                       }))
+            return id;
+    }
+    uint id = (uint)mix_blocks.size();
+    if (id >= MIX_MAX_BLOCKS) {
+        mix_dropped++;
+        return UINT_MAX;
+    }
+    mix_blocks.push_back({ mix_module_index(pc), (uint)mix_ops.size(), (uint)ops.size() });
+    mix_ops.insert(mix_ops.end(), ops.begin(), ops.end());
+    ids.push_back(id);
+    return id;
+}
+
+/* Counts the block's opcodes, when the block is analysed on its own, and
+ * returns the handle opcode_mix_instrument() takes; never NULL
+ */
+static inline void *
+opcode_mix_analyze(void *tag, instrlist_t *bb)
+{
+    std::vector<mix_op_t> ops;
+    uint id;
+    for (instr_t *in = instrlist_first_app(bb); in != NULL; in = instr_get_next_app(in)) {
+        int opcode = instr_get_opcode(in);
+        auto it = std::find_if(ops.begin(), ops.end(),
+                               [opcode](const mix_op_t &op) { return op.opcode == opcode; });
+        if (it == ops.end())
+            ops.push_back({ opcode, 1 });
+        else
+            it->count++;
+    }
+
+    dr_mutex_lock(mix_lock);
+    id = mix_block_id(dr_fragment_app_pc(tag), ops);
+    dr_mutex_unlock(mix_lock);
+    return (void *)((ptr_uint_t)id + 1);
+}
+
+/* Inserts the counter bump for an opcode_mix_analyze() block before where,
+ * its first instruction
+ */
+static inline void
+opcode_mix_instrument(void *drcontext, instrlist_t *bb, instr_t *where, void *block)
+{
+    uint id = (uint)((ptr_uint_t)block - 1);
+    reg_id_t reg_base;
+    if (id == UINT_MAX)
+        return;
+
+    /* the bump must run whatever the first instr's predicate */
+    instrlist_set_auto_predicate(bb, DR_PRED_NONE);
+    if (drreg_reserve_aflags(drcontext, bb, where) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, bb, where, NULL, &reg_base) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    dr_insert_read_raw_tls(drcontext, bb, where, mix_tls_seg, mix_tls_offs, reg_base);
+#ifdef X86
+    instrlist_meta_preinsert(
+        bb, where,
+        INSTR_CREATE_inc(drcontext, OPND_CREATE_MEMPTR(reg_base, id * sizeof(ptr_uint_t))));
+#else
+    reg_id_t reg_val;
+    if (drreg_reserve_register(drcontext, bb, where, NULL, &reg_val) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    /* the offset does not fit a load displacement on every ISA */
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)id * sizeof(ptr_uint_t),
+                                     opnd_create_reg(reg_val), bb, where, NULL, NULL);
+    instrlist_meta_preinsert(
+        bb, where,
+        XINST_CREATE_add(drcontext, opnd_create_reg(reg_base), opnd_create_reg(reg_val)));
+    instrlist_meta_preinsert(bb, where,
+                             XINST_CREATE_load(drcontext, opnd_create_reg(reg_val),
+                                               OPND_CREATE_MEMPTR(reg_base, 0)));
+    instrlist_meta_preinsert(
+        bb, where,
+        XINST_CREATE_add(drcontext, opnd_create_reg(reg_val), OPND_CREATE_INT16(1)));
+    instrlist_meta_preinsert(bb, where,
+                             XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_base, 0),
+                                                opnd_create_reg(reg_val)));
+    if (drreg_unreserve_register(drcontext, bb, where, reg_val) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+#endif
+    if (drreg_unreserve_register(drcontext, bb, where, reg_base) != DRREG_SUCCESS ||
+        drreg_unreserve_aflags(drcontext, bb, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    instrlist_set_auto_predicate(bb, instr_get_predicate(where));
+}
+
+static void
+mix_thread_init(void *drcontext)
+{
+    ptr_uint_t *counters = (ptr_uint_t *)dr_raw_mem_alloc(
+        MIX_COUNTERS_SIZE, DR_MEMPROT_READ | DR_MEMPROT_WRITE, NULL);
+    DR_ASSERT(counters != NULL);
+    drmgr_set_tls_field(drcontext, mix_tls_idx, counters);
+    *(ptr_uint_t **)((byte *)dr_get_dr_segment_base(mix_tls_seg) + mix_tls_offs) = counters;
+}
+
+static void
+mix_thread_exit(void *drcontext)
+{
+    ptr_uint_t *counters = (ptr_uint_t *)drmgr_get_tls_field(drcontext, mix_tls_idx);
+    uint64 instrs = 0;
+    dr_mutex_lock(mix_lock);
+    mix_totals.resize(mix_modules.size() * (OP_LAST + 1), 0);
+    for (uint id = 0; id < mix_blocks.size(); id++) {
+        if (counters[id] == 0)
+            continue;
+        const mix_block_t &block = mix_blocks[id];
+        uint64 *totals = &mix_totals[block.module * (OP_LAST + 1)];
+        for (uint i = block.first; i < block.first + block.num_ops; i++) {
+            totals[mix_ops[i].opcode] += (uint64)counters[id] * mix_ops[i].count;
+            instrs += (uint64)counters[id] * mix_ops[i].count;
+        }
+    }
+    dr_fprintf(mix_log, "Thread %d: %llu instructions\n", dr_get_thread_id(drcontext),
+               instrs);
+    dr_mutex_unlock(mix_lock);
+    dr_raw_mem_free(counters, MIX_COUNTERS_SIZE);
+}
+
+/* Writes count/opcode lines for totals[0..OP_LAST], largest first */
+static void
+mix_write_histogram(const uint64 *totals, size_t limit)
+{
+    std::vector<std::pair<uint64, int>> sorted;
+    for (int op = 0; op <= OP_LAST; op++) {
+        if (totals[op] > 0)
+            sorted.push_back(std::make_pair(totals[op], op));
+    }
+    std::sort(sorted.rbegin(), sorted.rend());
+    for (size_t i = 0; i < sorted.size() && i < limit; i++) {
+        dr_fprintf(mix_log, "  %15llu %s\n", sorted[i].first,
+                   decode_opcode_name(sorted[i].second));
+    }
+}
+
+static inline void
+opcode_mix_init(file_t log)
+{
+    drreg_options_t ops = { sizeof(ops), 2, false };
+    mix_log = log;
+    mix_lock = dr_mutex_create();
+    mix_tls_idx = drmgr_register_tls_field();
+    if (mix_tls_idx == -1 || drreg_init(&ops) != DRREG_SUCCESS ||
+        !dr_raw_tls_calloc(&mix_tls_seg, &mix_tls_offs, 1, 0) ||
+        !drmgr_register_thread_init_event(mix_thread_init) ||
+        !drmgr_register_thread_exit_event(mix_thread_exit))
+        DR_ASSERT(false);
+}
+
+static inline void
+opcode_mix_exit(void)
+{
+    std::vector<uint64> process(OP_LAST + 1, 0);
+    uint64 total = 0;
+    mix_totals.resize(mix_modules.size() * (OP_LAST + 1), 0);
+    for (size_t m = 0; m < mix_modules.size(); m++) {
+        for (int op = 0; op <= OP_LAST; op++)
+            process[op] += mix_totals[m * (OP_LAST + 1) + op];
+    }
+    for (uint64 count : process)
+        total += count;
+    dr_fprintf(mix_log, "Opcode mix: %llu instructions in %u blocks\n", total,
+               (uint)mix_blocks.size());
+    if (mix_dropped > 0)
+        dr_fprintf(mix_log, "  (%llu blocks past the block limit not counted)\n", mix_dropped);
+    mix_write_histogram(process.data(), OP_LAST + 1);
+    for (size_t m = 0; m < mix_modules.size(); m++) {
+        const uint64 *totals = &mix_totals[m * (OP_LAST + 1)];
+        uint64 instrs = 0;
+        for (int op = 0; op <= OP_LAST; op++)
+            instrs += totals[op];
+        if (instrs == 0)
+            continue;
+        dr_fprintf(mix_log, "Module %s: %llu instructions\n", mix_modules[m].c_str(), instrs);
+        mix_write_histogram(totals, MIX_TOP_PER_MODULE);
+    }
+
+    if (!drmgr_unregister_thread_init_event(mix_thread_init) ||
+        !drmgr_unregister_thread_exit_event(mix_thread_exit) ||
+        !drmgr_unregister_tls_field(mix_tls_idx) ||
+        !dr_raw_tls_cfree(mix_tls_offs, 1) || drreg_exit() != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    dr_mutex_destroy(mix_lock);
+}
+
+#endif /* OPCODE_MIX_H */
@@ -8,25 +8,35 @@ struct_size = struct.calcsize(struct_format)
 
 fifo_path = '/tmp/my_fifo'
 
-# 打开命名管道
-with open(fifo_path, 'rb') as fifo:
-    while True:
-        data = fifo.read(struct_size)
-        if data:
-            # 解包数据
-            unpacked_data = struct.unpack(struct_format, data)
-            a, b, raw_str = unpacked_data
-            str_decoded = raw_str.split(b'\x00', 1)[0].decode('utf-8')  # 去掉字符串中的空字符
-            print(f'Read: {a} {b} {str_decoded}')
-        else:
-            # 检查管道是否已经没有更多的数据，如果没有更多的数据，就等待一段时间再检查
-            time.sleep(1)
-            remaining_data = fifo.read(struct_size)
-            if not remaining_data:
-                break
+def print_record(unpacked_data):
+    a, b, raw_str = unpacked_data
+    str_decoded = raw_str.split(b'\x00', 1)[0].decode('utf-8')  # 去掉字符串中的空字符
+    print(f'Read: {a} {b} {str_decoded}')
+
+# 有 tracechunk 扩展（tracechunk.cpp）时整批读取，每批一次解包
+try:
+    import tracechunk
+except ImportError:
+    tracechunk = None
+
+if tracechunk is not None:
+    for chunk in tracechunk.Reader(fifo_path, kind='fifo_data'):
+        for unpacked_data in struct.iter_unpack(struct_format, memoryview(chunk).cast('B')):
+            print_record(unpacked_data)
+else:
+    # 打开命名管道
+    with open(fifo_path, 'rb') as fifo:
+        while True:
+            data = fifo.read(struct_size)
+            if data:
+                # 解包数据
+                print_record(struct.unpack(struct_format, data))
             else:
-                # 将剩余数据打印
-                unpacked_data = struct.unpack(struct_format, remaining_data)
-                a, b, raw_str = unpacked_data
-                str_decoded = raw_str.split(b'\x00', 1)[0].decode('utf-8')
-                print(f'Read: {a} {b} {str_decoded}')
+                # 检查管道是否已经没有更多的数据，如果没有更多的数据，就等待一段时间再检查
+                time.sleep(1)
+                remaining_data = fifo.read(struct_size)
+                if not remaining_data:
+                    break
+                else:
+                    # 将剩余数据打印
+                    print_record(struct.unpack(struct_format, remaining_data))
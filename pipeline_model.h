@@ -0,0 +1,150 @@
+#ifndef PIPELINE_MODEL_H
+#define PIPELINE_MODEL_H
+
+// Four-channel issue model replayed by biubiu and the fanout driver. All
+// state lives in the object, so each replay gets its own pipeline.
+
+#include <stdint.h>
+#include <deque>
+#include <unordered_map>
+#include "trace_records.h"
+
+enum channel_status_t { FRONTEND_BOUND, BACKEND_BOUND, RETIRE, BAD_PREDICTION };
+
+// Instructions handed to the queue per simulated cycle when replaying a trace
+#define FETCH_WIDTH 4
+
+class PipelineModel {
+public:
+    // Register sequence to track usage delay
+    std::unordered_map<int, int> register_delay;
+
+    // Deque sequence for instructions and operand availability
+    struct InsDequeEntry {
+        ins_ref_t ins;
+        bool operand_availability[4];
+    };
+    std::deque<InsDequeEntry> instruction_queue;
+
+    // Launch channel marker array
+    int launch_channels[4] = {0, 0, 0, 0};
+
+    // Launch channel data structure
+    channel_status_t channel_status[4] = {};
+
+    uint64_t cycles = 0;
+    uint64_t instrs = 0;
+    uint64_t status_counts[4] = {0, 0, 0, 0};
+
+    // Function to add a register to the delay sequence
+    void add_register(int reg_num, int delay) {
+        register_delay[reg_num] = delay;
+    }
+
+    // Function to update operand availability
+    void update_operand_availability(InsDequeEntry &entry) {
+        for (int i = 0; i < entry.ins.num_operands; i++) {
+            operand_t &op = entry.ins.operands[i];
+            if (op.type == OPERAND_TYPE_IMMEDIATE || op.type == OPERAND_TYPE_MEMORY) {
+                entry.operand_availability[i] = true;
+            } else if (op.type == OPERAND_TYPE_REGISTER) {
+                entry.operand_availability[i] = (register_delay[op.value.reg] == 0);
+            }
+        }
+    }
+
+    // Opcode-delay mapping function
+    static int get_opcode_delay(int opcode) {
+        switch (opcode) {
+            case 67:
+            case 68:
+                return 4;
+            case 32:
+            case 34:
+                return 2;
+            default:
+                return 0;
+        }
+    }
+
+    // Function to execute and assign instructions to channels
+    void execute_instructions(const ins_ref_t *instructions, size_t count) {
+        for (size_t k = 0; k < count; k++) {
+            InsDequeEntry entry = {instructions[k], {false, false, false, false}};
+            update_operand_availability(entry);
+            instruction_queue.push_back(entry);
+        }
+
+        for (int i = 0; i < 4; i++) {
+            if (launch_channels[i] != 0) {
+                channel_status[i] = BACKEND_BOUND;
+                continue;
+            }
+
+            bool found = false;
+            for (auto it = instruction_queue.begin(); it != instruction_queue.end(); ++it) {
+                bool all_operands_available = true;
+                for (int j = 0; j < it->ins.num_operands; j++) {
+                    if (!it->operand_availability[j]) {
+                        all_operands_available = false;
+                        break;
+                    }
+                }
+
+                if (all_operands_available) {
+                    int delay = get_opcode_delay(it->ins.opcode);
+                    for (int j = 0; j < it->ins.num_operands; j++) {
+                        if (it->ins.operands[j].type == OPERAND_TYPE_REGISTER && it->ins.operands[j].is_dest) {
+                            add_register(it->ins.operands[j].value.reg, delay);
+                        }
+                    }
+                    launch_channels[i] = delay;
+                    channel_status[i] = RETIRE;
+                    instruction_queue.erase(it);
+                    found = true;
+                    break;
+                }
+            }
+
+            if (!found) {
+                channel_status[i] = FRONTEND_BOUND;
+            }
+        }
+    }
+
+    // Function to update delays
+    void update_delays() {
+        for (auto &reg : register_delay) {
+            if (reg.second > 0) {
+                reg.second--;
+            }
+        }
+
+        for (int i = 0; i < 4; i++) {
+            if (launch_channels[i] > 0) {
+                launch_channels[i]--;
+            }
+        }
+
+        for (auto &entry : instruction_queue) {
+            update_operand_availability(entry);
+        }
+    }
+
+    // Replays a batch FETCH_WIDTH instructions per cycle, counting the
+    // channel status mix. Batches may end mid-fetch group.
+    void replay(const ins_ref_t *instructions, size_t count) {
+        for (size_t i = 0; i < count; i += FETCH_WIDTH) {
+            size_t n = count - i < FETCH_WIDTH ? count - i : FETCH_WIDTH;
+            execute_instructions(&instructions[i], n);
+            for (int c = 0; c < 4; c++) {
+                status_counts[channel_status[c]]++;
+            }
+            update_delays();
+            cycles++;
+        }
+        instrs += count;
+    }
+};
+
+#endif // PIPELINE_MODEL_H
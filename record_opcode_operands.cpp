@@ -1,19 +1,41 @@
 #include "dr_api.h"
 #include "drmgr.h"
 #include "drutil.h"
+#include "opcode_mix.h"
+#include "buf_writer.h"
 #include <string.h>
+#include <string>
+#include <unordered_map>
+
+/* Each distinct instruction text is disassembled once, when its block is
+ * built, and written to opcode_operands.log under a new id. At run time a
+ * thread only appends that id to its buffered opcode_operands.<tid>.ids
+ * (raw uint32s, see buf_writer.h): no formatting and no lock.
+ */
 
 static file_t log_file;
-static void *mutex;
+static void *mutex; /* guards instr_ids and log_file while blocks are built */
+static std::unordered_map<std::string, uint> instr_ids;
+static bool opcode_mix; /* -opcode_mix: per-BB opcode histogram instead of the per-instr log */
 
 static void event_exit(void);
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data);
 static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data);
-static void record_instruction(void *drcontext, instr_t *instr);
+static void record_instruction(uint id);
+static uint intern_instruction(void *drcontext, instr_t *instr);
+static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd);
 
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
     dr_set_client_name("DynamoRIO Instruction Recorder", "http://dynamorio.org/issues");
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-opcode_mix") == 0)
+            opcode_mix = true;
+        else {
+            dr_fprintf(STDERR, "Error: unknown option %s: only -opcode_mix is supported\n", argv[i]);
+            dr_abort();
+        }
+    }
 
     if (!drmgr_init()) {
         DR_ASSERT(false);
@@ -23,6 +45,10 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
     log_file = dr_open_file("opcode_operands.log", DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
     DR_ASSERT(log_file != INVALID_FILE);
     mutex = dr_mutex_create();
+    if (opcode_mix)
+        opcode_mix_init(log_file);
+
+    bw_log_init("opcode_operands.%d.ids");
 
     dr_register_exit_event(event_exit);
     drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, NULL);
@@ -32,6 +58,9 @@ DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 
 static void event_exit(void)
 {
+    if (opcode_mix)
+        opcode_mix_exit();
+    bw_log_exit();
     dr_mutex_destroy(mutex);
     dr_close_file(log_file);
     drmgr_exit();
@@ -39,51 +68,65 @@ static void event_exit(void)
 
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
 {
+    *user_data = opcode_mix ? opcode_mix_analyze(tag, bb) : NULL;
     return DR_EMIT_DEFAULT;
 }
 
 static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data)
 {
+    if (opcode_mix) {
+        if (drmgr_is_first_instr(drcontext, instr))
+            opcode_mix_instrument(drcontext, bb, instr, user_data);
+        return DR_EMIT_DEFAULT;
+    }
     if (instr_is_app(instr)) {
-        dr_insert_clean_call(drcontext, bb, instr, (void *)record_instruction, false, 1, OPND_CREATE_INTPTR(instr));
+        uint id = intern_instruction(drcontext, instr);
+        dr_insert_clean_call(drcontext, bb, instr, (void *)record_instruction, false, 1,
+                             OPND_CREATE_INT32(id));
     }
     return DR_EMIT_DEFAULT;
 }
 
-static void record_instruction(void *drcontext, instr_t *instr)
+static void record_instruction(uint id)
 {
-    dr_mutex_lock(mutex);
+    bw_write(bw_log(dr_get_current_drcontext()), &id, sizeof(id));
+}
 
-    byte buf[256];
+/* Returns the id of instr's text, adding a dictionary entry the first time
+ * it is seen. Called while the block is built, when instr is still valid.
+ */
+static uint intern_instruction(void *drcontext, instr_t *instr)
+{
+    char buf[256];
+    std::string text;
+    uint id;
+    // opnd_disassemble_to_string返回的是静态缓冲区，所以整个过程都要持锁
+    dr_mutex_lock(mutex);
     int len = instr_disassemble_to_buffer(drcontext, instr, buf, sizeof(buf));
     DR_ASSERT(len > 0);
 
-    // 获取操作码
-    int opcode = instr_get_opcode(instr);
-    dr_fprintf(log_file, "Opcode: %d\n", opcode);
-
-    // 记录反汇编的指令
-    dr_fprintf(log_file, "Instruction: %s\n", buf);
-
-    // 获取并记录源操作数
-    int num_srcs = instr_num_srcs(instr);
-    dr_fprintf(log_file, "  Sources:\n");
-    for (int i = 0; i < num_srcs; i++) {
-        opnd_t src = instr_get_src(instr, i);
-        dr_fprintf(log_file, "    %s\n", opnd_disassemble_to_string(drcontext, src));
+    // 操作码、反汇编、源操作数和目的操作数，与原来逐条记录的格式相同
+    text += "Opcode: " + std::to_string(instr_get_opcode(instr)) + "\n";
+    text += std::string("Instruction: ") + buf + "\n";
+    text += "  Sources:\n";
+    for (int i = 0; i < instr_num_srcs(instr); i++)
+        text += std::string("    ") + opnd_disassemble_to_string(drcontext, instr_get_src(instr, i)) + "\n";
+    text += "  Destinations:\n";
+    for (int i = 0; i < instr_num_dsts(instr); i++)
+        text += std::string("    ") + opnd_disassemble_to_string(drcontext, instr_get_dst(instr, i)) + "\n";
+
+    auto it = instr_ids.find(text);
+    if (it != instr_ids.end())
+        id = it->second;
+    else {
+        id = (uint)instr_ids.size();
+        instr_ids.emplace(text, id);
+        dr_fprintf(log_file, "Id: %u\n", id);
+        dr_write_file(log_file, text.c_str(), text.size());
+        dr_fprintf(log_file, "\n");
     }
-
-    // 获取并记录目的操作数
-    int num_dsts = instr_num_dsts(instr);
-    dr_fprintf(log_file, "  Destinations:\n");
-    for (int i = 0; i < num_dsts; i++) {
-        opnd_t dst = instr_get_dst(instr, i);
-        dr_fprintf(log_file, "    %s\n", opnd_disassemble_to_string(drcontext, dst));
-    }
-
-    dr_fprintf(log_file, "\n");
-
     dr_mutex_unlock(mutex);
+    return id;
 }
 
 static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd)
@@ -1,72 +1,104 @@
 #include "dr_api.h"
 #include "drmgr.h"
 #include "drutil.h"
+#include "roi.h"
+#include "opcode_mix.h"
+#include "buf_writer.h"
 #include <string.h>
 
 static file_t log_file;
 static void *mutex;
+static bool opcode_mix; /* -opcode_mix: per-BB opcode histogram instead of the per-instr log */
 
 static void event_exit(void);
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data);
-static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data);
-static void record_instruction(void *drcontext, int opcode);
+static void event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, instr_t *where, void *user_data);
+static void record_instruction(int opcode);
 static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd);
 
 DR_EXPORT void dr_client_main(client_id_t id, int argc, const char *argv[])
 {
     dr_set_client_name("DynamoRIO Instruction Recorder", "http://dynamorio.org/issues");
 
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-opcode_mix") == 0)
+            opcode_mix = true;
+        else if (!roi_parse_option(argc, argv, &i)) {
+            dr_fprintf(STDERR, "Error: unknown option %s: only -opcode_mix and the -roi_* options are supported\n", argv[i]);
+            dr_abort();
+        }
+    }
+
     if (!drmgr_init()) {
         DR_ASSERT(false);
         return;
     }
+    roi_init();
 
     log_file = dr_open_file("opcode_operands.log", DR_FILE_WRITE_OVERWRITE | DR_FILE_ALLOW_LARGE);
     DR_ASSERT(log_file != INVALID_FILE);
     mutex = dr_mutex_create();
+    if (opcode_mix)
+        opcode_mix_init(log_file);
+    // 每个线程的指令记录写到各自带缓冲的opcode_operands.<tid>.log
+    bw_log_init("opcode_operands.%d.log");
 
     dr_register_exit_event(event_exit);
-    drmgr_register_bb_instrumentation_event(event_bb_analysis, event_app_instruction, NULL);
+    roi_register_bb_events(event_bb_analysis, event_app_instruction);
 
     dr_log(NULL, DR_LOG_ALL, 1, "Client 'record_opcode_operands' initializing\n");
 }
 
 static void event_exit(void)
 {
+    if (opcode_mix)
+        opcode_mix_exit();
+    bw_log_exit();
     dr_mutex_destroy(mutex);
     dr_close_file(log_file);
+    roi_unregister_bb_events();
+    roi_exit();
     drmgr_exit();
 }
 
+// 感兴趣区域的判断每个基本块只做一次，插桩事件只看user_data
 static dr_emit_flags_t event_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace, bool translating, void **user_data)
 {
+    if (!roi_block_traced(tag))
+        *user_data = NULL;
+    else
+        *user_data = opcode_mix ? opcode_mix_analyze(tag, bb) : ROI_TRACED;
     return DR_EMIT_DEFAULT;
 }
 
-static dr_emit_flags_t event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, bool for_trace, bool translating, void *user_data)
+static void event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr, instr_t *where, void *user_data)
 {
     // 禁用自动谓词化，因为我们希望无条件执行以下插桩代码
     drmgr_disable_auto_predication(drcontext, bb);
 
-    // 如果user_data为空，说明不需要对该基本块进行插桩
+    // 感兴趣区域之外的基本块不插桩
     if (user_data == NULL)
-        return DR_EMIT_DEFAULT;
+        return;
+
+    if (opcode_mix) {
+        if (roi_is_first_instr(drcontext, instr))
+            opcode_mix_instrument(drcontext, bb, where, user_data);
+        return;
+    }
 
     // 在每条应用程序指令前插入清理调用
     if (instr_is_app(instr)) {
         int opcode = instr_get_opcode(instr); // 获取指令操作码
-        dr_insert_clean_call(drcontext, bb, instr, (void *)record_instruction,
-                             false /* save fpstate */, 2, 
-                             OPND_CREATE_INTPTR(drcontext),
+        dr_insert_clean_call(drcontext, bb, where, (void *)record_instruction,
+                             false /* save fpstate */, 1,
                              OPND_CREATE_INT32(opcode));
     }
-
-    return DR_EMIT_DEFAULT;
 }
 
-static void record_instruction(void *drcontext, int opcode)
+static void record_instruction(int opcode)
 {
-    dr_fprintf(log_file, "Instruction: %s\n", decode_opcode_name(opcode));
+    // 共享代码缓存里不能用建块时的drcontext，取当前线程的
+    bw_log_printf(dr_get_current_drcontext(), "Instruction: %s\n", decode_opcode_name(opcode));
 }
 
 static const char *opnd_disassemble_to_string(void *drcontext, opnd_t opnd)
@@ -0,0 +1,196 @@
+#ifndef RING_PRODUCER_H
+#define RING_PRODUCER_H
+
+/* Inline producer for the pipe recorders' per-thread MyStruct rings (see
+ * trace_ring.h).
+ *
+ * Each app instruction's record is built once, when its block is built, and
+ * the block stores it with meta instructions straight into the running
+ * thread's next ring slot, whose address lives in a raw TLS slot. There is no
+ * clean call per instruction: the thread only calls out once the current run
+ * of slots is used up, where a run ends at the end of the slot array, at the
+ * consumer's tail or after TR_PUBLISH_BATCH records. The callout commits and
+ * publishes the run and maps out the next one, waiting for the consumer if
+ * the ring is full.
+ *
+ * Usage from a client:
+ *   dr_client_main:  ring_producer_init() after drmgr_init()
+ *   insertion event: ring_producer_instrument() for every instr
+ *   exit event:      ring_producer_exit(), before drmgr_exit()
+ */
+
+#include <stddef.h>
+#include <string.h>
+#include "dr_api.h"
+#include "drmgr.h"
+#include "drreg.h"
+#include "trace_records.h"
+#include "trace_ring.h"
+
+/* Records per thread ring */
+#define RING_CAPACITY (1 << 16)
+
+typedef struct {
+    tr_ring_t ring;
+    byte *seg_base;
+    byte *run_start; /* first slot of the current run */
+} ring_thread_t;
+
+enum {
+    RING_TLS_OFFS_PTR, /* next slot to fill */
+    RING_TLS_OFFS_END, /* end of the current run */
+    RING_TLS_COUNT,
+};
+static int ring_tls_idx;
+static reg_id_t ring_tls_seg;
+static uint ring_tls_offs;
+#define RING_TLS_SLOT(tls_base, enum_val) \
+    (byte **)((byte *)(tls_base) + ring_tls_offs + (enum_val) * sizeof(void *))
+#define RING_PTR(tls_base) *RING_TLS_SLOT(tls_base, RING_TLS_OFFS_PTR)
+#define RING_END(tls_base) *RING_TLS_SLOT(tls_base, RING_TLS_OFFS_END)
+
+/* Commits the records written in the current run */
+static void
+ring_commit_run(ring_thread_t *t)
+{
+    tr_ring_commit_n(&t->ring,
+                     (size_t)(RING_PTR(t->seg_base) - t->run_start) / sizeof(MyStruct));
+}
+
+/* Points the inline stores at the next run of free slots */
+static void
+ring_next_run(ring_thread_t *t)
+{
+    size_t count;
+    t->run_start = (byte *)tr_ring_reserve(&t->ring, &count);
+    RING_PTR(t->seg_base) = t->run_start;
+    RING_END(t->seg_base) = t->run_start + count * sizeof(MyStruct);
+}
+
+/* The callout at the end of a run */
+static void
+ring_refill(void)
+{
+    ring_thread_t *t =
+        (ring_thread_t *)drmgr_get_tls_field(dr_get_current_drcontext(), ring_tls_idx);
+    ring_commit_run(t);
+    ring_next_run(t);
+}
+
+/* Stores instr's record in the next slot and moves the slot pointer on,
+ * calling out when the run is used up
+ */
+static inline void
+ring_producer_instrument(void *drcontext, instrlist_t *bb, instr_t *instr)
+{
+    MyStruct rec;
+    ptr_int_t word;
+    reg_id_t reg_ptr, reg_tmp;
+    instr_t *skip;
+    size_t offs;
+    if (!instr_is_app(instr))
+        return;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.opcode = instr_get_opcode(instr);
+    strncpy(rec.opcode_name, decode_opcode_name(rec.opcode), sizeof(rec.opcode_name) - 1);
+
+    instrlist_set_auto_predicate(bb, DR_PRED_NONE);
+    if (drreg_reserve_register(drcontext, bb, instr, NULL, &reg_ptr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, bb, instr, NULL, &reg_tmp) != DRREG_SUCCESS ||
+        drreg_reserve_aflags(drcontext, bb, instr) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    dr_insert_read_raw_tls(drcontext, bb, instr, ring_tls_seg,
+                           ring_tls_offs + RING_TLS_OFFS_PTR * sizeof(void *), reg_ptr);
+    /* the record a pointer-sized word at a time; the last word overlaps the
+     * one before it whenever the record is not a whole number of words
+     */
+    for (offs = 0; offs < sizeof(rec); offs += sizeof(word)) {
+        if (offs + sizeof(word) > sizeof(rec))
+            offs = sizeof(rec) - sizeof(word);
+        memcpy(&word, (byte *)&rec + offs, sizeof(word));
+        instrlist_insert_mov_immed_ptrsz(drcontext, word, opnd_create_reg(reg_tmp), bb,
+                                         instr, NULL, NULL);
+        instrlist_meta_preinsert(bb, instr,
+                                 XINST_CREATE_store(drcontext,
+                                                    OPND_CREATE_MEMPTR(reg_ptr, (int)offs),
+                                                    opnd_create_reg(reg_tmp)));
+    }
+    instrlist_meta_preinsert(bb, instr,
+                             XINST_CREATE_add(drcontext, opnd_create_reg(reg_ptr),
+                                              OPND_CREATE_INT16(sizeof(MyStruct))));
+    dr_insert_write_raw_tls(drcontext, bb, instr, ring_tls_seg,
+                            ring_tls_offs + RING_TLS_OFFS_PTR * sizeof(void *), reg_ptr);
+
+    skip = INSTR_CREATE_label(drcontext);
+    dr_insert_read_raw_tls(drcontext, bb, instr, ring_tls_seg,
+                           ring_tls_offs + RING_TLS_OFFS_END * sizeof(void *), reg_tmp);
+    instrlist_meta_preinsert(
+        bb, instr, XINST_CREATE_cmp(drcontext, opnd_create_reg(reg_ptr), opnd_create_reg(reg_tmp)));
+    instrlist_meta_preinsert(bb, instr,
+                             XINST_CREATE_jump_cond(drcontext, IF_X86_ELSE(DR_PRED_B, DR_PRED_CC),
+                                                    opnd_create_instr(skip)));
+    dr_insert_clean_call(drcontext, bb, instr, (void *)ring_refill, false, 0);
+    instrlist_meta_preinsert(bb, instr, skip);
+    if (drreg_unreserve_aflags(drcontext, bb, instr) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, instr, reg_tmp) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, bb, instr, reg_ptr) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    instrlist_set_auto_predicate(bb, instr_get_predicate(instr));
+}
+
+/* One shared memory ring per thread, named by TR_NAME_FORMAT for the consumer */
+static void
+ring_thread_init(void *drcontext)
+{
+    char name[64];
+    ring_thread_t *t = (ring_thread_t *)dr_thread_alloc(drcontext, sizeof(ring_thread_t));
+    DR_ASSERT(t != NULL);
+    dr_snprintf(name, sizeof(name), TR_NAME_FORMAT, dr_get_process_id(),
+                dr_get_thread_id(drcontext));
+    name[sizeof(name) - 1] = '\0';
+    if (!tr_ring_create(&t->ring, name, sizeof(MyStruct), RING_CAPACITY,
+                        dr_get_thread_id(drcontext))) {
+        dr_fprintf(STDERR, "Cannot create ring %s\n", name);
+        DR_ASSERT(false);
+    }
+    t->seg_base = (byte *)dr_get_dr_segment_base(ring_tls_seg);
+    DR_ASSERT(t->seg_base != NULL);
+    drmgr_set_tls_field(drcontext, ring_tls_idx, t);
+    ring_next_run(t);
+}
+
+static void
+ring_thread_exit(void *drcontext)
+{
+    ring_thread_t *t = (ring_thread_t *)drmgr_get_tls_field(drcontext, ring_tls_idx);
+    ring_commit_run(t);
+    tr_ring_close(&t->ring);
+    dr_thread_free(drcontext, t, sizeof(ring_thread_t));
+}
+
+static inline void
+ring_producer_init(void)
+{
+    drreg_options_t ops = { sizeof(ops), 2, false };
+    ring_tls_idx = drmgr_register_tls_field();
+    if (ring_tls_idx == -1 || drreg_init(&ops) != DRREG_SUCCESS ||
+        !dr_raw_tls_calloc(&ring_tls_seg, &ring_tls_offs, RING_TLS_COUNT, 0) ||
+        !drmgr_register_thread_init_event(ring_thread_init) ||
+        !drmgr_register_thread_exit_event(ring_thread_exit))
+        DR_ASSERT(false);
+}
+
+static inline void
+ring_producer_exit(void)
+{
+    if (!drmgr_unregister_thread_init_event(ring_thread_init) ||
+        !drmgr_unregister_thread_exit_event(ring_thread_exit) ||
+        !drmgr_unregister_tls_field(ring_tls_idx) ||
+        !dr_raw_tls_cfree(ring_tls_offs, RING_TLS_COUNT) || drreg_exit() != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
+#endif /* RING_PRODUCER_H */
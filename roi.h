@@ -0,0 +1,407 @@
+#ifndef ROI_H
+#define ROI_H
+
+/* Region-of-interest control shared by the tracing clients.
+ *
+ *   -roi_func <name>      trace a thread while it is inside the exported
+ *                         function <name> (wrapped in every module with it)
+ *   -roi_module <name>    trace only code of the named module
+ *   -roi_range <lo> <hi>  trace only code in [lo, hi)
+ *   -roi_skip <N>         start tracing after about N instructions
+ *
+ * Options combine: tracing is on once the skip count has run out, while the
+ * thread is inside a marker function and for blocks inside both the range
+ * and the module. Blocks outside the region are built without the client's
+ * per-instruction instrumentation. The range and module filters are decided
+ * when a block is built.
+ *
+ * With -roi_func every block in the range and module is built twice by
+ * drbbdup, with and without the client's instrumentation, and picks a copy
+ * at block entry from the thread's own case slot in raw TLS. The marker
+ * function's wrappers only store to that slot, so a thread enters or leaves
+ * the region from its next block on without touching the code cache or the
+ * other threads.
+ *
+ * The skip trigger flips a global state instead and unlinks the whole code
+ * cache once, so every block is rebuilt for the new state the next time it
+ * runs. Since that state can change while a block is being built, a client
+ * decides once per block, in its analysis event, and hands the decision to
+ * its insertion event. While the skip is pending, blocks keep DR's
+ * translation info, so a fault is never translated by rebuilding a block
+ * under a different state.
+ *
+ * While -roi_skip is pending every block carries one inline countdown of its
+ * length. The counter is shared by all threads and updated without a lock,
+ * so the fast-forward point is approximate.
+ *
+ * Usage from a client:
+ *   dr_client_main:  roi_parse_option(argc, argv, &i) in the option loop,
+ *                    roi_init() after drmgr_init(), then
+ *                    roi_register_bb_events() in place of
+ *                    drmgr_register_bb_instrumentation_event()
+ *   analysis event:  *user_data = roi_block_traced(tag) ? ROI_TRACED : NULL
+ *                    (or client data that is non-NULL only when traced)
+ *   insertion event: a roi_insertion_cb_t, run after the skip countdown;
+ *                    skip the block if user_data is NULL, use
+ *                    roi_is_first_instr()/roi_is_last_instr() for the drmgr
+ *                    ones and insert before where, which is not instr for
+ *                    the last instruction of a duplicated block
+ *   exit event:      roi_unregister_bb_events(), then roi_exit()
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dr_api.h"
+#include "drbbdup.h"
+#include "drmgr.h"
+#include "drreg.h"
+#include "drwrap.h"
+
+/* Insertion event for roi_register_bb_events(): instr is the app instruction
+ * to look at, where the point to insert before
+ */
+typedef void (*roi_insertion_cb_t)(void *drcontext, void *tag, instrlist_t *bb,
+                                   instr_t *instr, instr_t *where, void *user_data);
+
+static char roi_func[256];
+static char roi_module[256];
+static app_pc roi_module_start, roi_module_end;
+static bool roi_has_range;
+static app_pc roi_range_start, roi_range_end;
+static volatile ptr_int_t roi_skip_left;
+static bool roi_skip_pending;
+static int roi_skip_fired;
+static bool roi_drreg; /* roi_init() took a drreg reference */
+static bool roi_skip_analysis; /* -roi_skip: roi_bb_analysis is registered */
+static drmgr_analysis_cb_t roi_analysis;
+static roi_insertion_cb_t roi_insertion;
+
+/* -roi_func: per-thread raw TLS slots */
+enum {
+    ROI_TLS_OFFS_CASE,  /* ROI_CASE_*, read by the drbbdup dispatch */
+    ROI_TLS_OFFS_DEPTH, /* calls of roi_func in progress on this thread */
+    ROI_TLS_COUNT,
+};
+enum {
+    ROI_CASE_OUT, /* default case: no client instrumentation */
+    ROI_CASE_IN,
+};
+static reg_id_t roi_tls_seg;
+static uint roi_tls_offs;
+#define ROI_TLS_SLOT(tls_base, enum_val) \
+    (ptr_int_t *)((byte *)(tls_base) + roi_tls_offs + (enum_val) * sizeof(void *))
+
+/* Analysis-event user_data for a block inside the region */
+#define ROI_TRACED ((void *)1)
+
+/* Consumes argv[*i] (and its arguments) if it is an -roi_* option */
+static inline bool
+roi_parse_option(int argc, const char *argv[], int *i)
+{
+    const char *opt = argv[*i];
+    if (strcmp(opt, "-roi_func") == 0 && *i + 1 < argc) {
+        dr_snprintf(roi_func, BUFFER_SIZE_ELEMENTS(roi_func), "%s", argv[++*i]);
+        NULL_TERMINATE_BUFFER(roi_func);
+    } else if (strcmp(opt, "-roi_module") == 0 && *i + 1 < argc) {
+        /* nothing is traced until the module shows up */
+        dr_snprintf(roi_module, BUFFER_SIZE_ELEMENTS(roi_module), "%s", argv[++*i]);
+        NULL_TERMINATE_BUFFER(roi_module);
+    } else if (strcmp(opt, "-roi_range") == 0 && *i + 2 < argc) {
+        roi_range_start = (app_pc)(ptr_uint_t)strtoull(argv[++*i], NULL, 0);
+        roi_range_end = (app_pc)(ptr_uint_t)strtoull(argv[++*i], NULL, 0);
+        roi_has_range = true;
+    } else if (strcmp(opt, "-roi_skip") == 0 && *i + 1 < argc) {
+        roi_skip_left = (ptr_int_t)strtoull(argv[++*i], NULL, 0);
+        roi_skip_pending = roi_skip_left > 0;
+    } else
+        return false;
+    return true;
+}
+
+/* Whether the block at pc lies inside both the module and the range */
+static inline bool
+roi_in_bounds(app_pc pc)
+{
+    return (roi_module[0] == '\0' || (pc >= roi_module_start && pc < roi_module_end)) &&
+        (!roi_has_range || (pc >= roi_range_start && pc < roi_range_end));
+}
+
+/* Call once per block, from the analysis event. With -roi_func this is only
+ * asked for the block's traced copy.
+ */
+static inline bool
+roi_block_traced(void *tag)
+{
+    return !roi_skip_pending && roi_in_bounds(dr_fragment_app_pc(tag));
+}
+
+static void
+roi_func_pre(void *wrapcxt, OUT void **user_data)
+{
+    byte *seg_base = (byte *)dr_get_dr_segment_base(roi_tls_seg);
+    if ((*ROI_TLS_SLOT(seg_base, ROI_TLS_OFFS_DEPTH))++ == 0)
+        *ROI_TLS_SLOT(seg_base, ROI_TLS_OFFS_CASE) = ROI_CASE_IN;
+}
+
+static void
+roi_func_post(void *wrapcxt, void *user_data)
+{
+    byte *seg_base = (byte *)dr_get_dr_segment_base(roi_tls_seg);
+    if (--(*ROI_TLS_SLOT(seg_base, ROI_TLS_OFFS_DEPTH)) == 0)
+        *ROI_TLS_SLOT(seg_base, ROI_TLS_OFFS_CASE) = ROI_CASE_OUT;
+}
+
+static void
+roi_skip_done(void)
+{
+    /* several threads can cross zero before the flush takes effect */
+    if (dr_atomic_add32_return_sum(&roi_skip_fired, 1) == 1) {
+        roi_skip_pending = false;
+        if (!dr_unlink_flush_region(NULL, ~(size_t)0))
+            DR_ASSERT(false);
+    }
+}
+
+static void
+roi_module_load(void *drcontext, const module_data_t *info, bool loaded)
+{
+    const char *name = dr_module_preferred_name(info);
+    if (roi_module[0] != '\0' && name != NULL && strcmp(name, roi_module) == 0) {
+        roi_module_start = info->start;
+        roi_module_end = info->end;
+    }
+    if (roi_func[0] != '\0') {
+        app_pc func = (app_pc)dr_get_proc_address(info->handle, roi_func);
+        if (func != NULL && !drwrap_wrap(func, roi_func_pre, roi_func_post))
+            DR_ASSERT(false);
+    }
+}
+
+/* The skip trigger changes what a block is built with at any time, so a
+ * state-restore rebuild could differ from the original block
+ */
+static dr_emit_flags_t
+roi_bb_analysis(void *drcontext, void *tag, instrlist_t *bb, bool for_trace,
+                bool translating, void **user_data)
+{
+    return DR_EMIT_STORE_TRANSLATIONS;
+}
+
+static inline int
+roi_block_length(instrlist_t *bb)
+{
+    int num_instrs = 0;
+    for (instr_t *instr = instrlist_first_app(bb); instr != NULL;
+         instr = instr_get_next_app(instr))
+        num_instrs++;
+    return num_instrs;
+}
+
+/* Inserts the -roi_skip countdown for a block of num_instrs app instructions
+ * before where; a no-op once the count has run out. roi_register_bb_events()
+ * inserts it itself; a client running its own drbbdup calls it at the first
+ * instruction of every copy.
+ */
+static inline void
+roi_insert_skip_countdown(void *drcontext, instrlist_t *ilist, instr_t *where, int num_instrs)
+{
+    instr_t *skip;
+    reg_id_t reg_addr, reg_left;
+    if (!roi_skip_pending)
+        return;
+    if (drreg_reserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_addr) != DRREG_SUCCESS ||
+        drreg_reserve_register(drcontext, ilist, where, NULL, &reg_left) != DRREG_SUCCESS) {
+        DR_ASSERT(false);
+        return;
+    }
+    skip = INSTR_CREATE_label(drcontext);
+    instrlist_insert_mov_immed_ptrsz(drcontext, (ptr_int_t)&roi_skip_left,
+                                     opnd_create_reg(reg_addr), ilist, where, NULL, NULL);
+    instrlist_meta_preinsert(ilist, where,
+                             XINST_CREATE_load(drcontext, opnd_create_reg(reg_left),
+                                               OPND_CREATE_MEMPTR(reg_addr, 0)));
+    instrlist_meta_preinsert(ilist, where,
+                             XINST_CREATE_sub_s(drcontext, opnd_create_reg(reg_left),
+                                                OPND_CREATE_INT16(num_instrs)));
+    instrlist_meta_preinsert(ilist, where,
+                             XINST_CREATE_store(drcontext, OPND_CREATE_MEMPTR(reg_addr, 0),
+                                                opnd_create_reg(reg_left)));
+    instrlist_meta_preinsert(
+        ilist, where,
+        XINST_CREATE_jump_cond(drcontext, IF_X86_ELSE(DR_PRED_NS, DR_PRED_PL),
+                               opnd_create_instr(skip)));
+    dr_insert_clean_call(drcontext, ilist, where, (void *)roi_skip_done, false, 0);
+    instrlist_meta_preinsert(ilist, where, skip);
+    if (drreg_unreserve_register(drcontext, ilist, where, reg_left) != DRREG_SUCCESS ||
+        drreg_unreserve_register(drcontext, ilist, where, reg_addr) != DRREG_SUCCESS ||
+        drreg_unreserve_aflags(drcontext, ilist, where) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+}
+
+/* drmgr_is_first_instr() and drmgr_is_last_instr() for the insertion event:
+ * with -roi_func they answer for the copy being instrumented
+ */
+static inline bool
+roi_is_first_instr(void *drcontext, instr_t *instr)
+{
+    bool is_first;
+    if (roi_func[0] == '\0')
+        return drmgr_is_first_instr(drcontext, instr);
+    if (drbbdup_is_first_instr(drcontext, instr, &is_first) != DRBBDUP_SUCCESS)
+        DR_ASSERT(false);
+    return is_first;
+}
+
+static inline bool
+roi_is_last_instr(void *drcontext, instr_t *instr)
+{
+    bool is_last;
+    if (roi_func[0] == '\0')
+        return drmgr_is_last_instr(drcontext, instr);
+    if (drbbdup_is_last_instr(drcontext, instr, &is_last) != DRBBDUP_SUCCESS)
+        DR_ASSERT(false);
+    return is_last;
+}
+
+/* Without -roi_func the client's events run under drmgr as usual */
+static dr_emit_flags_t
+roi_event_app_instruction(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                          bool for_trace, bool translating, void *user_data)
+{
+    if (roi_skip_pending && drmgr_is_first_instr(drcontext, instr))
+        roi_insert_skip_countdown(drcontext, bb, instr, roi_block_length(bb));
+    roi_insertion(drcontext, tag, bb, instr, instr, user_data);
+    return DR_EMIT_DEFAULT;
+}
+
+/* A block in the bounds gets a copy for each side of the marker function */
+static uintptr_t
+roi_set_up_bb_dups(void *drbbdup_ctx, void *drcontext, void *tag, instrlist_t *bb,
+                   bool *enable_dups, bool *enable_dynamic_handling, void *user_data)
+{
+    *enable_dups = roi_in_bounds(dr_fragment_app_pc(tag));
+    if (*enable_dups &&
+        drbbdup_register_case_encoding(drbbdup_ctx, ROI_CASE_IN) != DRBBDUP_SUCCESS)
+        DR_ASSERT(false);
+    *enable_dynamic_handling = false;
+    return ROI_CASE_OUT;
+}
+
+/* The block's app instruction count, for the skip countdown of both copies */
+static void
+roi_analyze_orig(void *drcontext, void *tag, instrlist_t *bb, void *user_data,
+                 void **orig_analysis_data)
+{
+    *orig_analysis_data = (void *)(ptr_uint_t)roi_block_length(bb);
+}
+
+static void
+roi_destroy_orig_analysis(void *drcontext, void *user_data, void *orig_analysis_data)
+{
+    /* nothing allocated: the count is stored in the pointer itself */
+}
+
+/* Only the traced copy runs the client's analysis; the other one gets NULL */
+static void
+roi_analyze_case(void *drcontext, void *tag, instrlist_t *bb, uintptr_t encoding,
+                 void *user_data, void *orig_analysis_data, void **case_analysis_data)
+{
+    *case_analysis_data = NULL;
+    if (encoding == ROI_CASE_IN)
+        roi_analysis(drcontext, tag, bb, false, false, case_analysis_data);
+}
+
+static void
+roi_destroy_case_analysis(void *drcontext, uintptr_t encoding, void *user_data,
+                          void *orig_analysis_data, void *case_analysis_data)
+{
+    /* the client frees its data at the copy's last instruction, as under drmgr */
+}
+
+static void
+roi_instrument_instr(void *drcontext, void *tag, instrlist_t *bb, instr_t *instr,
+                     instr_t *where, uintptr_t encoding, void *user_data,
+                     void *orig_analysis_data, void *case_analysis_data)
+{
+    if (roi_skip_pending && roi_is_first_instr(drcontext, instr)) {
+        roi_insert_skip_countdown(drcontext, bb, where,
+                                  (int)(ptr_uint_t)orig_analysis_data);
+    }
+    roi_insertion(drcontext, tag, bb, instr, where, case_analysis_data);
+}
+
+/* After roi_init(): registers the client's block events, under drbbdup when
+ * -roi_func is given
+ */
+static inline bool
+roi_register_bb_events(drmgr_analysis_cb_t analysis, roi_insertion_cb_t insertion)
+{
+    roi_analysis = analysis;
+    roi_insertion = insertion;
+    if (roi_func[0] == '\0') {
+        return drmgr_register_bb_instrumentation_event(analysis, roi_event_app_instruction,
+                                                       NULL);
+    }
+    drbbdup_options_t opts = {
+        sizeof(opts),
+    };
+    opts.set_up_bb_dups = roi_set_up_bb_dups;
+    opts.analyze_orig = roi_analyze_orig;
+    opts.destroy_orig_analysis = roi_destroy_orig_analysis;
+    opts.analyze_case = roi_analyze_case;
+    opts.destroy_case_analysis = roi_destroy_case_analysis;
+    opts.instrument_instr = roi_instrument_instr;
+    opts.runtime_case_opnd = dr_raw_tls_opnd(
+        GLOBAL_DCONTEXT, roi_tls_seg, roi_tls_offs + ROI_TLS_OFFS_CASE * sizeof(void *));
+    opts.max_case_encoding = ROI_CASE_IN;
+    opts.non_default_case_limit = 1;
+    return drbbdup_init(&opts) == DRBBDUP_SUCCESS;
+}
+
+static inline bool
+roi_unregister_bb_events(void)
+{
+    if (roi_func[0] == '\0')
+        return drmgr_unregister_bb_instrumentation_event(roi_analysis);
+    return drbbdup_exit() == DRBBDUP_SUCCESS;
+}
+
+/* After drmgr_init() and the option loop */
+static inline void
+roi_init(void)
+{
+    drreg_options_t ops = { sizeof(ops), 2, false };
+    roi_drreg = roi_skip_pending || roi_func[0] != '\0';
+    if (roi_drreg && drreg_init(&ops) != DRREG_SUCCESS)
+        DR_ASSERT(false);
+    if (roi_func[0] != '\0' &&
+        (!drwrap_init() || !dr_raw_tls_calloc(&roi_tls_seg, &roi_tls_offs, ROI_TLS_COUNT, 0)))
+        DR_ASSERT(false);
+    if ((roi_func[0] != '\0' || roi_module[0] != '\0') &&
+        !drmgr_register_module_load_event(roi_module_load))
+        DR_ASSERT(false);
+    roi_skip_analysis = roi_skip_pending;
+    if (roi_skip_analysis &&
+        !drmgr_register_bb_instrumentation_event(roi_bb_analysis, NULL, NULL))
+        DR_ASSERT(false);
+}
+
+static inline void
+roi_exit(void)
+{
+    if (roi_skip_analysis && !drmgr_unregister_bb_instrumentation_event(roi_bb_analysis))
+        DR_ASSERT(false);
+    if ((roi_func[0] != '\0' || roi_module[0] != '\0') &&
+        !drmgr_unregister_module_load_event(roi_module_load))
+        DR_ASSERT(false);
+    if (roi_func[0] != '\0') {
+        if (!dr_raw_tls_cfree(roi_tls_offs, ROI_TLS_COUNT))
+            DR_ASSERT(false);
+        drwrap_exit();
+    }
+    if (roi_drreg)
+        drreg_exit();
+}
+
+#endif /* ROI_H */
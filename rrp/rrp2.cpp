@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <random>
 #include <deque>
+#include "../mem_access_input.hpp"
 
 #define MAX_RRPV 3
 
@@ -171,19 +172,13 @@ private:
 };
 
 void processMemoryAccesses(const std::string& filename, std::vector<L1Cache>& caches) {
-    std::ifstream file(filename);
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string type;
-        unsigned long address;
-        int size;
-        if (!(iss >> type >> std::hex >> address >> size)) { break; }
-
+    auto access = [&](const std::string& type, unsigned long address) {
         for (auto& cache : caches) {
             cache.accessMemory(type, address);
         }
-    }
+    };
+
+    for_each_mem_access(filename, access);
 }
 
 int main() {
@@ -198,7 +193,7 @@ int main() {
     caches.emplace_back(32768, 64, 8, "BRRIP"); // 32KB, 64B blocks, 8-way, BRRIP
     caches.emplace_back(32768, 64, 8, "DRRIP"); // 32KB, 64B blocks, 8-way, DRRIP
 
-    processMemoryAccesses("cache_input.txt", caches);
+    processMemoryAccesses(tf_is_trace_file("cache_input.trc") ? "cache_input.trc" : "cache_input.txt", caches);
 
     // Print statistics for each cache
     for (size_t i = 0; i < caches.size(); ++i) {
@@ -6,6 +6,7 @@
 #include <sstream>
 #include <algorithm>
 #include <random>
+#include "../mem_access_input.hpp"
 
 struct CacheBlock {
     unsigned long tag;
@@ -93,19 +94,13 @@ private:
 };
 
 void processMemoryAccesses(const std::string& filename, std::vector<L1Cache>& caches) {
-    std::ifstream file(filename);
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string type;
-        unsigned long address;
-        int size;
-        if (!(iss >> type >> std::hex >> address >> size)) { break; }
-
+    auto access = [&](const std::string& type, unsigned long address) {
         for (auto& cache : caches) {
             cache.accessMemory(type, address);
         }
-    }
+    };
+
+    for_each_mem_access(filename, access);
 }
 
 int main() {
@@ -122,7 +117,7 @@ int main() {
     caches.emplace_back(32768, 64, 8, "BRRIP");  // 32KB, 64B blocks, 8-way, BRRIP
     caches.emplace_back(32768, 64, 8, "DRRIP");  // 32KB, 64B blocks, 8-way, DRRIP
 
-    processMemoryAccesses("cache_input.txt", caches);
+    processMemoryAccesses(tf_is_trace_file("cache_input.trc") ? "cache_input.trc" : "cache_input.txt", caches);
 
     // Print statistics for each cache
     for (size_t i = 0; i < caches.size(); ++i) {
@@ -6,6 +6,7 @@ import <unordered_map>
 #include <sstream>
 #include <algorithm>
 #include <random>
+#include "../mem_access_input.hpp"
 
 struct CacheBlock {
     unsigned long tag;
@@ -217,15 +218,7 @@ private:
 };
 
 void processMemoryAccesses(const std::string& filename, std::vector<L1Cache>& caches) {
-    std::ifstream file(filename);
-    std::string line;
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string type;
-        unsigned long address;
-        int size;
-        if (!(iss >> type >> std::hex >> address >> size)) { break; }
-
+    auto access = [&](const std::string& type, unsigned long address) {
         for (auto& cache : caches) {
             if (cache.getReplacementPolicy() == "DRRIP") {
                 DRRIP drrip(cache.getNumSets());
@@ -234,7 +227,9 @@ void processMemoryAccesses(const std::string& filename, std::vector<L1Cache>& ca
                 cache.accessMemory(type, address);
             }
         }
-    }
+    };
+
+    for_each_mem_access(filename, access);
 }
 
 int main() {
@@ -248,7 +243,7 @@ int main() {
     caches.emplace_back(32768, 64, 8, "BRRIP");  // 32KB, 64B blocks, 8-way, BRRIP
     caches.emplace_back(32768, 64, 8, "DRRIP");  // 32KB, 64B blocks, 8-way, DRRIP
 
-    processMemoryAccesses("cache_input.txt", caches);
+    processMemoryAccesses(tf_is_trace_file("cache_input.trc") ? "cache_input.trc" : "cache_input.txt", caches);
 
     // 打印每个缓存的统计信息
     for (size_t i = 0; i < caches.size(); ++i) {
@@ -0,0 +1,728 @@
+#ifndef TRACE_FORMAT_H
+#define TRACE_FORMAT_H
+
+/* Chunked binary trace files, shared by the tracing clients and the offline
+ * simulators.
+ *
+ * A file is a tf_file_header_t followed by chunks. Each chunk is a
+ * tf_chunk_header_t and enc_size bytes of payload that decode to at most
+ * TF_CHUNK_SIZE bytes of in-memory records. Inside a chunk PCs and addresses
+ * are zigzag deltas against the previous one and everything else is a
+ * LEB128 varint. The delta state restarts at every chunk, so chunks decode
+ * independently. With TF_FLAG_COMPRESS the payload is additionally run
+ * through a small LZ77 block compressor when that makes it smaller.
+ *
+ * Since version 2 every chunk carries the tf_timestamp() of the buffer flush
+ * it came from, so per-thread files can be merged into one ordered stream
+ * (see trace_merge.cpp). Version 1 chunk headers lack the field and read
+ * back with a zero timestamp.
+ *
+ * Header only and allocation free: callers hand in scratch memory and a
+ * write or read callback, so the same code runs inside a DR client and in
+ * the offline tools.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if !defined(__x86_64__) && !defined(__i386__) && !defined(__aarch64__)
+#    include <time.h>
+#endif
+#ifndef __cplusplus
+#    include <stdbool.h>
+#endif
+#include "trace_records.h"
+
+#define TF_MAGIC 0x46435254       /* "TRCF" */
+#define TF_CHUNK_MAGIC 0x4b484354 /* "TCHK" */
+#define TF_VERSION 2
+
+/* Decoded bytes per chunk; records never straddle chunks */
+#define TF_CHUNK_SIZE (64 * 1024)
+#define TF_LZ_HASH_BITS 12
+/* Upper bound of an encoded chunk payload */
+#define TF_ENC_BOUND(n) ((n) + (n) / 4 + 64)
+/* Encode buffers plus the LZ hash table; kept off the stack since clients
+ * flush from DR's small per-thread stack.
+ */
+#define TF_WRITER_SCRATCH_SIZE \
+    (2 * TF_ENC_BOUND(TF_CHUNK_SIZE) + (1 << TF_LZ_HASH_BITS) * sizeof(uint32_t))
+#define TF_READER_SCRATCH_SIZE (2 * TF_ENC_BOUND(TF_CHUNK_SIZE))
+
+enum {
+    TF_ARCH_UNKNOWN,
+    TF_ARCH_X86_64,
+    TF_ARCH_X86_32,
+    TF_ARCH_AARCH64,
+    TF_ARCH_ARM32,
+    TF_ARCH_RISCV64,
+};
+
+#if defined(__x86_64__) || defined(_M_X64)
+#    define TF_ARCH_CURRENT TF_ARCH_X86_64
+#elif defined(__i386__) || defined(_M_IX86)
+#    define TF_ARCH_CURRENT TF_ARCH_X86_32
+#elif defined(__aarch64__)
+#    define TF_ARCH_CURRENT TF_ARCH_AARCH64
+#elif defined(__arm__)
+#    define TF_ARCH_CURRENT TF_ARCH_ARM32
+#elif defined(__riscv) && __riscv_xlen == 64
+#    define TF_ARCH_CURRENT TF_ARCH_RISCV64
+#else
+#    define TF_ARCH_CURRENT TF_ARCH_UNKNOWN
+#endif
+
+/* Record schema: what the decoded chunk bytes hold */
+enum {
+    TF_SCHEMA_RAW,     /* opaque records of header.record_size bytes, stored as is */
+    TF_SCHEMA_MEM_REF, /* mem_ref_t */
+    TF_SCHEMA_INS_REF, /* ins_ref_t */
+    TF_SCHEMA_INS_DYN, /* -static_table words, see INS_DYN_MAKE */
+    TF_SCHEMA_BB_DYN,  /* -bb_trace words, see BB_DYN_MAKE */
+    TF_SCHEMA_BRANCH_REF, /* branch_ref_t */
+};
+
+/* tf_file_header_t.flags */
+#define TF_FLAG_COMPRESS 0x1
+/* tf_chunk_header_t.flags */
+#define TF_CHUNK_LZ 0x1
+
+typedef struct _tf_file_header_t {
+    uint32_t magic;
+    uint16_t version;
+    uint8_t arch;
+    uint8_t schema;
+    uint32_t flags;
+    uint32_t record_size; /* sizeof one record; words for the *_DYN schemas */
+    uint64_t thread_id;
+    uint64_t instr_count; /* filled in at close if the file is seekable, else 0 */
+} tf_file_header_t;
+
+typedef struct _tf_chunk_header_t {
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t raw_size;    /* decoded bytes */
+    uint32_t enc_size;    /* payload bytes that follow */
+    uint64_t num_records;
+    uint64_t instr_count;
+    uint64_t timestamp;   /* tf_timestamp() at the flush; version 2 and up */
+} tf_chunk_header_t;
+
+/* Bytes of chunk header a file of the given version carries */
+#define TF_CHUNK_HEADER_SIZE(version) \
+    ((version) < 2 ? offsetof(tf_chunk_header_t, timestamp) : sizeof(tf_chunk_header_t))
+
+/* Cheap monotonic stamp for ordering flushes across threads: the invariant
+ * TSC or the generic timer where there is one, otherwise CLOCK_MONOTONIC in
+ * nanoseconds. Only comparable between stamps taken on the same machine.
+ */
+static inline uint64_t
+tf_timestamp(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    uint64_t v;
+    __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+    return v;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/***************************************************************************
+ * Varint and delta helpers
+ */
+
+static inline uint8_t *
+tf_put_varint(uint8_t *p, uint64_t v)
+{
+    while (v >= 0x80) {
+        *p++ = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = (uint8_t)v;
+    return p;
+}
+
+/* Returns NULL if the varint runs past end */
+static inline const uint8_t *
+tf_get_varint(const uint8_t *p, const uint8_t *end, uint64_t *v)
+{
+    uint64_t res = 0;
+    int shift = 0;
+    while (p < end && shift < 64) {
+        uint8_t b = *p++;
+        res |= (uint64_t)(b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            *v = res;
+            return p;
+        }
+        shift += 7;
+    }
+    return NULL;
+}
+
+static inline uint8_t *
+tf_put_delta(uint8_t *p, uint64_t v, uint64_t *prev)
+{
+    int64_t d = (int64_t)(v - *prev);
+    *prev = v;
+    return tf_put_varint(p, ((uint64_t)d << 1) ^ (uint64_t)(d >> 63));
+}
+
+static inline const uint8_t *
+tf_get_delta(const uint8_t *p, const uint8_t *end, uint64_t *v, uint64_t *prev)
+{
+    uint64_t z;
+    p = tf_get_varint(p, end, &z);
+    if (p == NULL)
+        return NULL;
+    *prev += (z >> 1) ^ (~(z & 1) + 1);
+    *v = *prev;
+    return p;
+}
+
+/***************************************************************************
+ * LZ77 block compressor
+ *
+ * A block is a series of sequences: varint literal count, the literals, then
+ * (unless the block ends) varint match length - TF_LZ_MIN_MATCH and varint
+ * offset back into the output.
+ */
+
+#define TF_LZ_MIN_MATCH 4
+
+static inline uint32_t
+tf_lz_read32(const uint8_t *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Returns the compressed size, or 0 if it would not fit in cap. table holds
+ * 1 << TF_LZ_HASH_BITS entries.
+ */
+static inline size_t
+tf_lz_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap, uint32_t *table)
+{
+    size_t i = 0, anchor = 0;
+    uint8_t *op = dst, *oend = dst + cap;
+
+    memset(table, 0xff, (1 << TF_LZ_HASH_BITS) * sizeof(uint32_t));
+    while (i + TF_LZ_MIN_MATCH <= n) {
+        uint32_t seq = tf_lz_read32(src + i);
+        uint32_t h = (seq * 2654435761u) >> (32 - TF_LZ_HASH_BITS);
+        uint32_t cand = table[h];
+        table[h] = (uint32_t)i;
+        if (cand == 0xffffffff || tf_lz_read32(src + cand) != seq) {
+            i++;
+            continue;
+        }
+        size_t len = TF_LZ_MIN_MATCH;
+        while (i + len < n && src[cand + len] == src[i + len])
+            len++;
+        if (op + 30 + (i - anchor) > oend)
+            return 0;
+        op = tf_put_varint(op, i - anchor);
+        memcpy(op, src + anchor, i - anchor);
+        op += i - anchor;
+        op = tf_put_varint(op, len - TF_LZ_MIN_MATCH);
+        op = tf_put_varint(op, i - cand);
+        i += len;
+        anchor = i;
+    }
+    if (op + 10 + (n - anchor) > oend)
+        return 0;
+    op = tf_put_varint(op, n - anchor);
+    memcpy(op, src + anchor, n - anchor);
+    op += n - anchor;
+    return op - dst;
+}
+
+/* Returns the decompressed size, or (size_t)-1 on a corrupt block */
+static inline size_t
+tf_lz_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+    const uint8_t *ip = src, *iend = src + n;
+    uint8_t *op = dst, *oend = dst + cap;
+    while (ip < iend) {
+        uint64_t lits, len, off;
+        ip = tf_get_varint(ip, iend, &lits);
+        if (ip == NULL || lits > (uint64_t)(iend - ip) || lits > (uint64_t)(oend - op))
+            return (size_t)-1;
+        memcpy(op, ip, lits);
+        ip += lits;
+        op += lits;
+        if (ip == iend)
+            break;
+        ip = tf_get_varint(ip, iend, &len);
+        if (ip == NULL)
+            return (size_t)-1;
+        ip = tf_get_varint(ip, iend, &off);
+        len += TF_LZ_MIN_MATCH;
+        if (ip == NULL || off == 0 || off > (uint64_t)(op - dst) ||
+            len > (uint64_t)(oend - op))
+            return (size_t)-1;
+        /* byte by byte: the match may overlap its own output */
+        for (const uint8_t *m = op - off; len > 0; len--)
+            *op++ = *m++;
+    }
+    return op - dst;
+}
+
+/***************************************************************************
+ * Record encoding
+ */
+
+/* Size in bytes of the record at rec */
+static inline size_t
+tf_record_size(const tf_file_header_t *hdr, const uint8_t *rec)
+{
+    uintptr_t word;
+    switch (hdr->schema) {
+    case TF_SCHEMA_MEM_REF: return sizeof(mem_ref_t);
+    case TF_SCHEMA_INS_REF: return sizeof(ins_ref_t);
+    case TF_SCHEMA_BRANCH_REF: return sizeof(branch_ref_t);
+    case TF_SCHEMA_INS_DYN:
+        memcpy(&word, rec, sizeof(word));
+        return INS_DYN_SIZE(INS_DYN_NUM_MEM(word));
+    case TF_SCHEMA_BB_DYN:
+        memcpy(&word, rec, sizeof(word));
+        return BB_DYN_SIZE(BB_DYN_NUM_MEM(word));
+    default: return hdr->record_size;
+    }
+}
+
+/* Encodes raw_size bytes of whole records; returns the encoded size */
+static inline size_t
+tf_encode(const tf_file_header_t *hdr, const uint8_t *raw, size_t raw_size, uint8_t *out)
+{
+    const uint8_t *end = raw + raw_size;
+    uint8_t *op = out;
+    uint64_t prev_pc = 0, prev_addr = 0;
+
+    if (hdr->schema == TF_SCHEMA_RAW) {
+        memcpy(out, raw, raw_size);
+        return raw_size;
+    }
+    while (raw < end) {
+        switch (hdr->schema) {
+        case TF_SCHEMA_MEM_REF: {
+            const mem_ref_t *ref = (const mem_ref_t *)raw;
+            op = tf_put_varint(op, ref->type);
+            op = tf_put_varint(op, ref->size);
+            /* instr entries carry the pc, data entries the address */
+            op = tf_put_delta(op, (uintptr_t)ref->addr,
+                              ref->type > REF_TYPE_WRITE ? &prev_pc : &prev_addr);
+            raw += sizeof(mem_ref_t);
+            break;
+        }
+        case TF_SCHEMA_INS_REF: {
+            const ins_ref_t *ref = (const ins_ref_t *)raw;
+            int i;
+            /* usually 0: this pc is the previous fall-through */
+            op = tf_put_delta(op, (uintptr_t)ref->pc, &prev_pc);
+            op = tf_put_varint(op, (uint32_t)ref->opcode);
+            *op++ = (uint8_t)((ref->is_cbr ? 1 : 0) | ((ref->bubble_type & 3) << 1));
+            if (ref->is_cbr) {
+                uint64_t base = (uintptr_t)ref->pc;
+                op = tf_put_delta(op, (uintptr_t)ref->target_addr, &base);
+            }
+            op = tf_put_varint(op, (uintptr_t)(ref->fall_addr - ref->pc));
+            prev_pc = (uintptr_t)ref->fall_addr;
+            op = tf_put_varint(op, (uint32_t)ref->num_operands);
+            for (i = 0; i < 4 && i < ref->num_operands; i++) {
+                const operand_t *opnd = &ref->operands[i];
+                *op++ = (uint8_t)(opnd->type | (opnd->is_source ? 4 : 0) |
+                                  (opnd->is_dest ? 8 : 0));
+                if (opnd->type == OPERAND_TYPE_MEMORY)
+                    op = tf_put_delta(op, (uintptr_t)opnd->value.mem_addr, &prev_addr);
+                else {
+                    int64_t v = opnd->type == OPERAND_TYPE_REGISTER ? opnd->value.reg
+                                                                    : opnd->value.imm_val;
+                    op = tf_put_varint(op, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+                }
+            }
+            raw += sizeof(ins_ref_t);
+            break;
+        }
+        case TF_SCHEMA_BRANCH_REF: {
+            const branch_ref_t *ref = (const branch_ref_t *)raw;
+            uint64_t base = ref->pc;
+            op = tf_put_delta(op, ref->pc, &prev_pc);
+            op = tf_put_delta(op, ref->target, &base);
+            *op++ = (uint8_t)((ref->taken ? 1 : 0) | (ref->kind << 1));
+            raw += sizeof(branch_ref_t);
+            break;
+        }
+        case TF_SCHEMA_INS_DYN:
+        case TF_SCHEMA_BB_DYN: {
+            size_t size = tf_record_size(hdr, raw), i;
+            const uintptr_t *word = (const uintptr_t *)raw;
+            op = tf_put_varint(op, word[0]);
+            for (i = 1; i < size / sizeof(uintptr_t); i++)
+                op = tf_put_delta(op, word[i], &prev_addr);
+            raw += size;
+            break;
+        }
+        default: return 0;
+        }
+    }
+    return op - out;
+}
+
+/* Decodes a payload into raw records; returns the decoded size or
+ * (size_t)-1 if the payload is corrupt or overflows cap.
+ */
+static inline size_t
+tf_decode(const tf_file_header_t *hdr, const uint8_t *in, size_t in_size, uint8_t *raw,
+          size_t cap, uint64_t *num_records)
+{
+    const uint8_t *ip = in, *iend = in + in_size;
+    uint8_t *op = raw, *oend = raw + cap;
+    uint64_t prev_pc = 0, prev_addr = 0, v = 0, count = 0;
+
+    if (hdr->schema == TF_SCHEMA_RAW) {
+        if (in_size > cap || hdr->record_size == 0)
+            return (size_t)-1;
+        memcpy(raw, in, in_size);
+        *num_records = in_size / hdr->record_size;
+        return in_size;
+    }
+    while (ip != NULL && ip < iend) {
+        switch (hdr->schema) {
+        case TF_SCHEMA_MEM_REF: {
+            mem_ref_t ref;
+            uint64_t type = 0, size = 0;
+            if (op + sizeof(ref) > oend)
+                return (size_t)-1;
+            memset(&ref, 0, sizeof(ref));
+            ip = tf_get_varint(ip, iend, &type);
+            if (ip != NULL)
+                ip = tf_get_varint(ip, iend, &size);
+            if (ip != NULL) {
+                ip = tf_get_delta(ip, iend, &v,
+                                  type > REF_TYPE_WRITE ? &prev_pc : &prev_addr);
+            }
+            ref.type = (unsigned short)type;
+            ref.size = (unsigned short)size;
+            ref.addr = (app_pc)(uintptr_t)v;
+            memcpy(op, &ref, sizeof(ref));
+            op += sizeof(ref);
+            break;
+        }
+        case TF_SCHEMA_INS_REF: {
+            ins_ref_t ref;
+            uint64_t opcode, len, num;
+            uint8_t flags;
+            int i;
+            if (op + sizeof(ref) > oend)
+                return (size_t)-1;
+            memset(&ref, 0, sizeof(ref));
+            ip = tf_get_delta(ip, iend, &v, &prev_pc);
+            if (ip != NULL)
+                ip = tf_get_varint(ip, iend, &opcode);
+            if (ip == NULL || ip >= iend)
+                return (size_t)-1;
+            ref.pc = (app_pc)(uintptr_t)v;
+            ref.opcode = (int)opcode;
+            flags = *ip++;
+            ref.is_cbr = (flags & 1) != 0;
+            ref.bubble_type = (bubble_type_t)((flags >> 1) & 3);
+            if (ref.is_cbr) {
+                uint64_t base = (uintptr_t)ref.pc;
+                ip = tf_get_delta(ip, iend, &v, &base);
+                ref.target_addr = (app_pc)(uintptr_t)v;
+            }
+            if (ip != NULL)
+                ip = tf_get_varint(ip, iend, &len);
+            if (ip != NULL)
+                ip = tf_get_varint(ip, iend, &num);
+            if (ip == NULL)
+                return (size_t)-1;
+            ref.fall_addr = ref.pc + len;
+            prev_pc = (uintptr_t)ref.fall_addr;
+            ref.num_operands = (int)num;
+            for (i = 0; i < 4 && i < ref.num_operands && ip != NULL; i++) {
+                operand_t *opnd = &ref.operands[i];
+                if (ip >= iend)
+                    return (size_t)-1;
+                flags = *ip++;
+                opnd->type = (operand_type_t)(flags & 3);
+                opnd->is_source = (flags & 4) != 0;
+                opnd->is_dest = (flags & 8) != 0;
+                if (opnd->type == OPERAND_TYPE_MEMORY) {
+                    ip = tf_get_delta(ip, iend, &v, &prev_addr);
+                    opnd->value.mem_addr = (void *)(uintptr_t)v;
+                } else {
+                    ip = tf_get_varint(ip, iend, &v);
+                    v = (v >> 1) ^ (~(v & 1) + 1);
+                    if (opnd->type == OPERAND_TYPE_REGISTER)
+                        opnd->value.reg = (int)v;
+                    else
+                        opnd->value.imm_val = (int)v;
+                }
+            }
+            memcpy(op, &ref, sizeof(ref));
+            op += sizeof(ref);
+            break;
+        }
+        case TF_SCHEMA_BRANCH_REF: {
+            branch_ref_t ref;
+            uint64_t base;
+            if (op + sizeof(ref) > oend)
+                return (size_t)-1;
+            memset(&ref, 0, sizeof(ref));
+            ip = tf_get_delta(ip, iend, &ref.pc, &prev_pc);
+            base = ref.pc;
+            if (ip != NULL)
+                ip = tf_get_delta(ip, iend, &ref.target, &base);
+            if (ip == NULL || ip >= iend)
+                return (size_t)-1;
+            ref.taken = *ip & 1;
+            ref.kind = *ip++ >> 1;
+            memcpy(op, &ref, sizeof(ref));
+            op += sizeof(ref);
+            break;
+        }
+        case TF_SCHEMA_INS_DYN:
+        case TF_SCHEMA_BB_DYN: {
+            uintptr_t word;
+            size_t size, i;
+            ip = tf_get_varint(ip, iend, &v);
+            if (ip == NULL)
+                return (size_t)-1;
+            word = (uintptr_t)v;
+            size = tf_record_size(hdr, (const uint8_t *)&word);
+            if (op + size > oend)
+                return (size_t)-1;
+            memcpy(op, &word, sizeof(word));
+            for (i = 1; i < size / sizeof(uintptr_t) && ip != NULL; i++) {
+                ip = tf_get_delta(ip, iend, &v, &prev_addr);
+                word = (uintptr_t)v;
+                memcpy(op + i * sizeof(word), &word, sizeof(word));
+            }
+            op += size;
+            break;
+        }
+        default: return (size_t)-1;
+        }
+        count++;
+    }
+    if (ip == NULL)
+        return (size_t)-1;
+    *num_records = count;
+    return op - raw;
+}
+
+/***************************************************************************
+ * Writer
+ */
+
+typedef void (*tf_write_fn_t)(void *ctx, const void *data, size_t size);
+
+typedef struct _tf_writer_t {
+    tf_write_fn_t write;
+    void *ctx;
+    tf_file_header_t header;
+    uint8_t *scratch; /* TF_WRITER_SCRATCH_SIZE bytes, 4-byte aligned */
+} tf_writer_t;
+
+/* Writes the file header right away. record_size is only used by TF_SCHEMA_RAW. */
+static inline void
+tf_writer_init(tf_writer_t *w, tf_write_fn_t write, void *ctx, int schema,
+               uint32_t record_size, uint64_t thread_id, uint32_t flags, void *scratch)
+{
+    memset(w, 0, sizeof(*w));
+    w->write = write;
+    w->ctx = ctx;
+    w->scratch = (uint8_t *)scratch;
+    w->header.magic = TF_MAGIC;
+    w->header.version = TF_VERSION;
+    w->header.arch = TF_ARCH_CURRENT;
+    w->header.schema = (uint8_t)schema;
+    w->header.flags = flags;
+    w->header.record_size =
+        schema == TF_SCHEMA_MEM_REF      ? sizeof(mem_ref_t)
+        : schema == TF_SCHEMA_INS_REF    ? sizeof(ins_ref_t)
+        : schema == TF_SCHEMA_BRANCH_REF ? sizeof(branch_ref_t)
+        : schema == TF_SCHEMA_RAW        ? record_size
+                                         : sizeof(uintptr_t);
+    w->header.thread_id = thread_id;
+    w->write(w->ctx, &w->header, sizeof(w->header));
+}
+
+static inline void
+tf_write_chunk(tf_writer_t *w, const uint8_t *raw, size_t raw_size, uint64_t num_records,
+               uint64_t instr_count, uint64_t timestamp)
+{
+    tf_chunk_header_t chunk;
+    uint8_t *enc = w->scratch, *lz = w->scratch + TF_ENC_BOUND(TF_CHUNK_SIZE);
+    uint32_t *table = (uint32_t *)(w->scratch + 2 * TF_ENC_BOUND(TF_CHUNK_SIZE));
+    size_t enc_size = tf_encode(&w->header, raw, raw_size, enc), lz_size = 0;
+
+    chunk.magic = TF_CHUNK_MAGIC;
+    chunk.flags = 0;
+    chunk.raw_size = (uint32_t)raw_size;
+    chunk.num_records = num_records;
+    chunk.instr_count = instr_count;
+    chunk.timestamp = timestamp;
+    if ((w->header.flags & TF_FLAG_COMPRESS) != 0)
+        lz_size = tf_lz_compress(enc, enc_size, lz, enc_size, table);
+    if (lz_size > 0 && lz_size < enc_size) {
+        chunk.flags |= TF_CHUNK_LZ;
+        enc = lz;
+        enc_size = lz_size;
+    }
+    chunk.enc_size = (uint32_t)enc_size;
+    w->write(w->ctx, &chunk, sizeof(chunk));
+    w->write(w->ctx, enc, enc_size);
+    w->header.instr_count += instr_count;
+}
+
+/* Splits size bytes of whole records into chunks. instr_count is charged to
+ * the last chunk written; every chunk gets the flush's timestamp.
+ */
+static inline void
+tf_write_records(tf_writer_t *w, const void *data, size_t size, uint64_t instr_count,
+                 uint64_t timestamp)
+{
+    const uint8_t *raw = (const uint8_t *)data, *end = raw + size;
+    while (raw < end) {
+        const uint8_t *start = raw;
+        uint64_t count = 0;
+        while (raw < end) {
+            size_t rec = tf_record_size(&w->header, raw);
+            if (rec == 0 || (raw - start) + rec > TF_CHUNK_SIZE)
+                break;
+            raw += rec;
+            count++;
+        }
+        if (raw == start)
+            break; /* malformed record: drop the rest */
+        tf_write_chunk(w, start, raw - start, count, raw == end ? instr_count : 0,
+                       timestamp);
+    }
+}
+
+/***************************************************************************
+ * Reader
+ */
+
+/* Returns the bytes read, short only at end of input */
+typedef size_t (*tf_read_fn_t)(void *ctx, void *buf, size_t size);
+
+typedef struct _tf_reader_t {
+    tf_read_fn_t read;
+    void *ctx;
+    tf_file_header_t header;
+    uint8_t *scratch; /* TF_READER_SCRATCH_SIZE bytes */
+} tf_reader_t;
+
+/* Reads and checks the file header */
+static inline bool
+tf_reader_init(tf_reader_t *r, tf_read_fn_t read, void *ctx, void *scratch)
+{
+    memset(r, 0, sizeof(*r));
+    r->read = read;
+    r->ctx = ctx;
+    r->scratch = (uint8_t *)scratch;
+    return r->read(r->ctx, &r->header, sizeof(r->header)) == sizeof(r->header) &&
+        r->header.magic == TF_MAGIC && r->header.version <= TF_VERSION;
+}
+
+/* Decodes the next chunk into out, which must hold TF_CHUNK_SIZE bytes and
+ * be pointer aligned. Returns the decoded size, 0 at the end of the trace and
+ * -1 on a corrupt chunk.
+ */
+static inline long
+tf_read_chunk(tf_reader_t *r, void *out, tf_chunk_header_t *chunk)
+{
+    uint8_t *payload = r->scratch, *lz = r->scratch + TF_ENC_BOUND(TF_CHUNK_SIZE);
+    uint64_t num_records = 0;
+    size_t header_size = TF_CHUNK_HEADER_SIZE(r->header.version);
+    size_t size;
+    chunk->timestamp = 0;
+    size = r->read(r->ctx, chunk, header_size);
+    if (size == 0)
+        return 0;
+    if (size != header_size || chunk->magic != TF_CHUNK_MAGIC ||
+        chunk->raw_size > TF_CHUNK_SIZE || chunk->enc_size > TF_ENC_BOUND(TF_CHUNK_SIZE))
+        return -1;
+    if (r->read(r->ctx, payload, chunk->enc_size) != chunk->enc_size)
+        return -1;
+    size = chunk->enc_size;
+    if ((chunk->flags & TF_CHUNK_LZ) != 0) {
+        size = tf_lz_decompress(payload, size, lz, TF_ENC_BOUND(TF_CHUNK_SIZE));
+        if (size == (size_t)-1)
+            return -1;
+        payload = lz;
+    }
+    size = tf_decode(&r->header, payload, size, (uint8_t *)out, TF_CHUNK_SIZE, &num_records);
+    if (size != chunk->raw_size || num_records != chunk->num_records)
+        return -1;
+    return (long)size;
+}
+
+#ifdef __cplusplus
+#    include <stdio.h>
+#    include <vector>
+
+static inline size_t
+tf_stdio_read(void *ctx, void *buf, size_t size)
+{
+    return fread(buf, 1, size, (FILE *)ctx);
+}
+
+static inline void
+tf_stdio_write(void *ctx, const void *data, size_t size)
+{
+    fwrite(data, 1, size, (FILE *)ctx);
+}
+
+/* Calls f(header, data, size) for every decoded chunk of the trace file at
+ * path. Returns false if path is not a trace file or a chunk is corrupt.
+ */
+template <typename F>
+bool
+tf_read_file(const char *path, F f)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    std::vector<uint8_t> scratch(TF_READER_SCRATCH_SIZE);
+    std::vector<uintptr_t> out(TF_CHUNK_SIZE / sizeof(uintptr_t));
+    tf_reader_t reader;
+    bool ok = tf_reader_init(&reader, tf_stdio_read, file, scratch.data());
+    while (ok) {
+        tf_chunk_header_t chunk;
+        long size = tf_read_chunk(&reader, out.data(), &chunk);
+        if (size <= 0) {
+            ok = size == 0;
+            break;
+        }
+        f(reader.header, (const void *)out.data(), (size_t)size);
+    }
+    fclose(file);
+    return ok;
+}
+
+/* True if the file at path starts with a trace file header */
+static inline bool
+tf_is_trace_file(const char *path)
+{
+    uint32_t magic = 0;
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    bool res = fread(&magic, sizeof(magic), 1, file) == 1 && magic == TF_MAGIC;
+    fclose(file);
+    return res;
+}
+#endif
+
+#endif /* TRACE_FORMAT_H */
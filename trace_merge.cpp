@@ -0,0 +1,137 @@
+// Merges per-thread chunked traces (caca, cah, bigdata output) into one
+// stream ordered by flush timestamp, e.g. to replay every thread of a
+// service through one shared cache:
+//   trace_merge cache_input.trc cache_input.*.trc
+//
+// Records carry no time of their own, so the unit of ordering is the chunk:
+// each thread's flushes stay in order and are interleaved with the other
+// threads' by their tf_timestamp(). Only the current chunk of every input is
+// held in memory, so the merge runs in constant space per input however
+// long the traces are.
+//
+// Usage: trace_merge [-compress] <output> <input>...
+// Build: g++ -O2 -o trace_merge trace_merge.cpp
+#include <stdio.h>
+#include <string.h>
+#include <functional>
+#include <iostream>
+#include <queue>
+#include <utility>
+#include <vector>
+#include "trace_format.h"
+
+struct MergeInput {
+    const char *path;
+    FILE *file = nullptr;
+    tf_reader_t reader;
+    std::vector<uint8_t> scratch = std::vector<uint8_t>(TF_READER_SCRATCH_SIZE);
+    std::vector<uintptr_t> out = std::vector<uintptr_t>(TF_CHUNK_SIZE / sizeof(uintptr_t));
+    tf_chunk_header_t chunk;
+    long size = 0;
+
+    // Decodes the next chunk; false at the end of the input or on error.
+    bool advance() {
+        size = tf_read_chunk(&reader, out.data(), &chunk);
+        if (size < 0)
+            std::cerr << path << ": corrupt trace chunk" << std::endl;
+        return size > 0;
+    }
+};
+
+// Records in one decoded chunk; -static_table and -bb_trace records vary in size
+static uint64_t count_records(const tf_file_header_t &hdr, const uint8_t *data, long size) {
+    uint64_t count = 0;
+    for (long pos = 0; pos < size; count++) {
+        size_t record = tf_record_size(&hdr, data + pos);
+        if (record == 0)
+            return 0;
+        pos += record;
+    }
+    return count;
+}
+
+int main(int argc, char *argv[]) {
+    uint32_t flags = 0;
+    int arg = 1;
+    if (arg < argc && strcmp(argv[arg], "-compress") == 0) {
+        flags |= TF_FLAG_COMPRESS;
+        arg++;
+    }
+    if (argc - arg < 2) {
+        std::cerr << "Usage: " << argv[0] << " [-compress] <output> <input>..." << std::endl;
+        return 1;
+    }
+    const char *output = argv[arg++];
+
+    std::vector<MergeInput> inputs(argc - arg);
+    for (size_t i = 0; i < inputs.size(); i++) {
+        MergeInput &in = inputs[i];
+        in.path = argv[arg + i];
+        in.file = fopen(in.path, "rb");
+        if (in.file == nullptr ||
+            !tf_reader_init(&in.reader, tf_stdio_read, in.file, in.scratch.data())) {
+            std::cerr << in.path << ": not a trace file" << std::endl;
+            return 1;
+        }
+        const tf_file_header_t &first = inputs[0].reader.header;
+        if (in.reader.header.schema != first.schema ||
+            in.reader.header.record_size != first.record_size) {
+            std::cerr << in.path << ": record type differs from " << inputs[0].path
+                      << std::endl;
+            return 1;
+        }
+        if (in.reader.header.version < 2) {
+            std::cerr << in.path << ": version " << in.reader.header.version
+                      << " trace has no timestamps, its chunks go first" << std::endl;
+        }
+    }
+
+    FILE *out = fopen(output, "wb");
+    if (out == nullptr) {
+        perror(output);
+        return 1;
+    }
+    std::vector<uint8_t> scratch(TF_WRITER_SCRATCH_SIZE);
+    tf_writer_t writer;
+    const tf_file_header_t &first = inputs[0].reader.header;
+    tf_writer_init(&writer, tf_stdio_write, out, first.schema, first.record_size, 0, flags,
+                   scratch.data());
+
+    // (timestamp, input) of every input's current chunk; ties keep input order
+    typedef std::pair<uint64_t, size_t> Entry;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> heap;
+    bool ok = true;
+    for (size_t i = 0; i < inputs.size(); i++) {
+        if (inputs[i].advance())
+            heap.push(Entry(inputs[i].chunk.timestamp, i));
+        else
+            ok &= inputs[i].size == 0;
+    }
+    uint64_t chunks = 0, records = 0;
+    while (!heap.empty()) {
+        MergeInput &in = inputs[heap.top().second];
+        heap.pop();
+        tf_write_records(&writer, in.out.data(), in.size, in.chunk.instr_count,
+                         in.chunk.timestamp);
+        chunks++;
+        records += count_records(first, (const uint8_t *)in.out.data(), in.size);
+        if (in.advance())
+            heap.push(Entry(in.chunk.timestamp, &in - inputs.data()));
+        else
+            ok &= in.size == 0;
+    }
+
+    // patch the total instruction count into the header
+    if (fseek(out, 0, SEEK_SET) == 0)
+        fwrite(&writer.header, sizeof(writer.header), 1, out);
+    fclose(out);
+    for (MergeInput &in : inputs)
+        fclose(in.file);
+    std::cout << "Merged " << inputs.size() << " traces, " << chunks << " chunks, " << records
+              << " records";
+    // branch and raw records carry no instruction count of their own
+    if (first.schema != TF_SCHEMA_BRANCH_REF && first.schema != TF_SCHEMA_RAW)
+        std::cout << ", " << writer.header.instr_count << " instructions";
+    std::cout << std::endl;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,365 @@
+#ifndef TRACE_READER_HPP
+#define TRACE_READER_HPP
+
+// Streaming reader for fixed-size trace records (MyStruct, ins_ref_t,
+// mem_ref_t, ...) from a FIFO, a plain file or an mmap'd file, raw or in the
+// chunked trace_format.h encoding.
+//
+//     TraceReader<mem_ref_t> reader("cache_input.trc");
+//     for (Span<mem_ref_t> batch = reader.next(); !batch.empty(); batch = reader.next())
+//         for (const mem_ref_t &ref : batch)
+//             ...
+//
+// next() hands out a span over the reader's own buffer; it stays valid until
+// the following next() call. Raw mmap sources are served straight out of
+// the mapping. Every other source is filled by a read-ahead thread a few
+// buffers ahead of the consumer, so the analyzer never waits on a read
+// syscall or a chunk decode in the common case. A trace that ends in a
+// partial record is reported through error() once the whole ones are out.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "trace_format.h"
+
+template <typename T>
+struct Span {
+    const T *data = nullptr;
+    size_t size = 0;
+
+    const T *begin() const { return data; }
+    const T *end() const { return data + size; }
+    bool empty() const { return size == 0; }
+    const T &operator[](size_t i) const { return data[i]; }
+};
+
+enum class TraceSource { Auto, Fifo, File, Mmap };
+
+template <typename T>
+class TraceReader {
+public:
+    // batch_records: records per span; depth: buffers kept in flight.
+    explicit TraceReader(const std::string &path, TraceSource source = TraceSource::Auto,
+                         size_t batch_records = 1 << 16, int depth = 4)
+        : batch_bytes_(batch_records * sizeof(T)) {
+        fd_ = open(path.c_str(), O_RDONLY);
+        if (fd_ < 0) {
+            error_ = path + ": " + strerror(errno);
+            return;
+        }
+        struct stat st;
+        if (fstat(fd_, &st) != 0) {
+            error_ = path + ": " + strerror(errno);
+            return;
+        }
+        if (source == TraceSource::Auto)
+            source = S_ISREG(st.st_mode) ? TraceSource::Mmap : TraceSource::Fifo;
+        if (source == TraceSource::Mmap && !S_ISREG(st.st_mode))
+            source = TraceSource::Fifo;
+
+        // The first bytes tell a chunked file from a raw record stream. A FIFO
+        // cannot be rewound, so they are kept and replayed.
+        uint32_t magic = 0;
+        peek_size_ = read_fully(&magic, sizeof(magic));
+        memcpy(peek_, &magic, peek_size_);
+        chunked_ = peek_size_ == sizeof(magic) && magic == TF_MAGIC;
+
+        if (source == TraceSource::Mmap && !chunked_ && st.st_size > 0) {
+            map_size_ = st.st_size;
+            void *map = mmap(nullptr, map_size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+            if (map != MAP_FAILED) {
+                map_ = static_cast<const uint8_t *>(map);
+                madvise(map, map_size_, MADV_SEQUENTIAL);
+                return;
+            }
+            map_size_ = 0;
+        }
+        if (chunked_) {
+            memcpy(&header_, peek_, peek_size_);
+            if (read_fully(reinterpret_cast<uint8_t *>(&header_) + peek_size_,
+                           sizeof(header_) - peek_size_) != sizeof(header_) - peek_size_ ||
+                header_.version > TF_VERSION) {
+                error_ = path + ": bad trace header";
+                return;
+            }
+            if (header_.record_size != sizeof(T)) {
+                error_ = path + ": record size does not match the reader";
+                return;
+            }
+            peek_size_ = 0;
+            // a decoded chunk must fit in one buffer
+            batch_bytes_ = TF_CHUNK_SIZE;
+        }
+        // A read on a FIFO can block for as long as the writer idles; the
+        // read-ahead thread polls a wakeup pipe with it so the destructor
+        // can always stop it.
+        if (!S_ISREG(st.st_mode) && pipe(wake_) != 0)
+            wake_[0] = wake_[1] = -1;
+        buffers_.resize(depth < 2 ? 2 : depth);
+        for (Buffer &buf : buffers_) {
+            buf.data.resize((batch_bytes_ + sizeof(T)) / sizeof(uint64_t) + 1);
+            free_.push_back(&buf);
+        }
+        thread_ = std::thread(&TraceReader::read_ahead, this);
+    }
+
+    ~TraceReader() {
+        if (thread_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                stop_ = true;
+            }
+            cond_.notify_all();
+            if (wake_[1] >= 0) {
+                char byte = 0;
+                while (write(wake_[1], &byte, 1) < 0 && errno == EINTR)
+                    ;
+            }
+            thread_.join();
+        }
+        for (int fd : wake_) {
+            if (fd >= 0)
+                close(fd);
+        }
+        if (map_ != nullptr)
+            munmap(const_cast<uint8_t *>(map_), map_size_);
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    TraceReader(const TraceReader &) = delete;
+    TraceReader &operator=(const TraceReader &) = delete;
+
+    bool ok() const { return error_.empty(); }
+    const std::string &error() const { return error_; }
+    bool chunked() const { return chunked_; }
+    // Only meaningful for chunked files
+    const tf_file_header_t &header() const { return header_; }
+
+    // Next batch of records; an empty span means end of stream or error.
+    Span<T> next() {
+        Span<T> span;
+        if (!ok())
+            return span;
+        if (map_ != nullptr) {
+            size_t total = map_size_ / sizeof(T) * sizeof(T);
+            size_t len = total - map_pos_ < batch_bytes_ ? total - map_pos_ : batch_bytes_;
+            if (len == 0 && total != map_size_) {
+                error_ = partial_record(map_size_ - total);
+                return span;
+            }
+            span.data = reinterpret_cast<const T *>(map_ + map_pos_);
+            span.size = len / sizeof(T);
+            map_pos_ += len;
+            // let the kernel start on the batch after this one
+            size_t ahead = map_pos_ & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+            if (ahead < map_size_) {
+                madvise(const_cast<uint8_t *>(map_) + ahead,
+                        map_size_ - ahead < batch_bytes_ ? map_size_ - ahead : batch_bytes_,
+                        MADV_WILLNEED);
+            }
+            return span;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (current_ != nullptr) {
+            free_.push_back(current_);
+            current_ = nullptr;
+            cond_.notify_all();
+        }
+        cond_.wait(lock, [this] { return !full_.empty(); });
+        Buffer *buf = full_.front();
+        if (buf->bytes == 0) {
+            // end marker stays queued so later calls also see the end
+            if (!buf->error.empty() && error_.empty())
+                error_ = buf->error;
+            return span;
+        }
+        full_.pop_front();
+        current_ = buf;
+        span.data = reinterpret_cast<const T *>(buf->data.data());
+        span.size = buf->bytes / sizeof(T);
+        return span;
+    }
+
+    // Calls f(const T &) for every record; returns the record count.
+    template <typename F>
+    uint64_t for_each(F f) {
+        uint64_t count = 0;
+        for (Span<T> span = next(); !span.empty(); span = next()) {
+            for (const T &rec : span)
+                f(rec);
+            count += span.size;
+        }
+        return count;
+    }
+
+private:
+    struct Buffer {
+        std::vector<uint64_t> data; // uint64_t for record alignment
+        size_t bytes = 0;
+        std::string error;
+    };
+
+    static std::string partial_record(size_t bytes) {
+        return "trace ends in a partial record (" + std::to_string(bytes) + " of " +
+            std::to_string(sizeof(T)) + " bytes)";
+    }
+
+    // Waits until fd_ is readable; false once the destructor asks the
+    // read-ahead thread to stop.
+    bool wait_readable() {
+        if (wake_[0] < 0)
+            return true;
+        struct pollfd fds[2] = { { fd_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+        while (poll(fds, 2, -1) < 0) {
+            if (errno != EINTR)
+                return false;
+        }
+        return (fds[1].revents & POLLIN) == 0;
+    }
+
+    size_t read_fully(void *dst, size_t size) {
+        size_t done = 0;
+        while (done < size) {
+            if (!wait_readable())
+                break;
+            ssize_t n = read(fd_, static_cast<uint8_t *>(dst) + done, size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+        }
+        return done;
+    }
+
+    // Returns once at least min bytes arrived, so a slow FIFO writer still
+    // gets its records through before the batch fills up.
+    size_t read_some(uint8_t *dst, size_t size, size_t min) {
+        size_t done = 0;
+        while (done < size) {
+            if (!wait_readable())
+                break;
+            ssize_t n = read(fd_, dst + done, size - done);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            done += n;
+            if (done >= min)
+                break;
+        }
+        return done;
+    }
+
+    static size_t tf_read(void *ctx, void *buf, size_t size) {
+        return static_cast<TraceReader *>(ctx)->read_fully(buf, size);
+    }
+
+    // Waits for a free buffer; nullptr once the reader is being destroyed.
+    Buffer *take_free() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        cond_.wait(lock, [this] { return stop_ || !free_.empty(); });
+        if (stop_)
+            return nullptr;
+        Buffer *buf = free_.front();
+        free_.pop_front();
+        return buf;
+    }
+
+    void push_full(Buffer *buf) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            full_.push_back(buf);
+        }
+        cond_.notify_all();
+    }
+
+    void read_ahead() {
+        std::vector<uint8_t> scratch;
+        tf_reader_t reader;
+        uint8_t carry[sizeof(T)];
+        size_t carry_size = 0;
+        memset(&reader, 0, sizeof(reader));
+        if (chunked_) {
+            scratch.resize(TF_READER_SCRATCH_SIZE);
+            reader.read = tf_read;
+            reader.ctx = this;
+            reader.header = header_;
+            reader.scratch = scratch.data();
+        }
+        while (true) {
+            Buffer *buf = take_free();
+            if (buf == nullptr)
+                return;
+            uint8_t *dst = reinterpret_cast<uint8_t *>(buf->data.data());
+            buf->bytes = 0;
+            buf->error.clear();
+            if (chunked_) {
+                tf_chunk_header_t chunk;
+                long size;
+                // skip empty chunks so a 0-byte buffer always means the end
+                do
+                    size = tf_read_chunk(&reader, dst, &chunk);
+                while (size > 0 && size < (long)sizeof(T));
+                if (size < 0)
+                    buf->error = "corrupt trace chunk";
+                else
+                    buf->bytes = size / sizeof(T) * sizeof(T);
+            } else {
+                // records cut by a short read carry over to the next buffer
+                memcpy(dst, carry, carry_size);
+                size_t have = carry_size;
+                if (peek_size_ > 0) {
+                    memcpy(dst + have, peek_, peek_size_);
+                    have += peek_size_;
+                    peek_size_ = 0;
+                }
+                have += read_some(dst + have, batch_bytes_ - have, sizeof(T) - have % sizeof(T));
+                buf->bytes = have / sizeof(T) * sizeof(T);
+                carry_size = have - buf->bytes;
+                memcpy(carry, dst + buf->bytes, carry_size);
+                if (buf->bytes == 0 && carry_size > 0)
+                    buf->error = partial_record(carry_size);
+            }
+            push_full(buf);
+            if (buf->bytes == 0)
+                return;
+        }
+    }
+
+    int fd_ = -1;
+    int wake_[2] = { -1, -1 };
+    std::string error_;
+    size_t batch_bytes_;
+    bool chunked_ = false;
+    tf_file_header_t header_ = {};
+    uint8_t peek_[sizeof(uint32_t)];
+    size_t peek_size_ = 0;
+
+    const uint8_t *map_ = nullptr;
+    size_t map_size_ = 0;
+    size_t map_pos_ = 0;
+
+    std::vector<Buffer> buffers_;
+    std::deque<Buffer *> free_, full_;
+    Buffer *current_ = nullptr;
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+#endif // TRACE_READER_HPP
@@ -0,0 +1,152 @@
+#ifndef TRACE_RECORDS_H
+#define TRACE_RECORDS_H
+
+/* Record layouts shared by the tracing clients and the offline readers.
+ * Inside a client include this after dr_api.h; offline tools get plain
+ * stand-ins for the DR types.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#ifndef __cplusplus
+#    include <stdbool.h>
+#endif
+
+#ifndef _DR_API_H_
+typedef unsigned char *app_pc;
+#endif
+
+/* Memory trace entry written by the memtrace clients (caca, cah) */
+enum {
+    REF_TYPE_READ = 0,
+    REF_TYPE_WRITE = 1,
+};
+
+typedef struct _mem_ref_t {
+    unsigned short type; /* r(0), w(1), or opcode (assuming 0/1 are invalid opcode) */
+    unsigned short size; /* mem ref size or instr length */
+    app_pc addr;         /* mem ref addr or instr pc */
+} mem_ref_t;
+
+/* One executed branch, written by the branch predictor clients */
+enum {
+    BRANCH_KIND_COND,     /* conditional direct branch */
+    BRANCH_KIND_JUMP,     /* unconditional direct jump */
+    BRANCH_KIND_CALL,
+    BRANCH_KIND_RETURN,
+    BRANCH_KIND_INDIRECT, /* indirect jump or call */
+};
+
+typedef struct _branch_ref_t {
+    uint64_t pc;
+    uint64_t target;      /* taken target */
+    uint8_t taken;
+    uint8_t kind;         /* BRANCH_KIND_* */
+    uint8_t pad[6];
+} branch_ref_t;
+
+/* Opcode message of the pipe recorders (pip-recordins, corret_pipe), packed
+ * to the 58 bytes the Python readers unpack with 'ii50s'.
+ */
+#pragma pack(push, 1)
+typedef struct {
+    int id;
+    int opcode;
+    char opcode_name[50];
+} MyStruct;
+#pragma pack(pop)
+
+// Enums for bubble types and operand types
+typedef enum {
+    BUBBLE_NONE,         // 不是气泡
+    BUBBLE_BAD_PREDICTION, // 错误预测
+    BUBBLE_FRONTEND,     // 前端气泡
+    BUBBLE_BACKEND       // 后端气泡
+} bubble_type_t;
+
+typedef enum {
+    OPERAND_TYPE_REGISTER,
+    OPERAND_TYPE_MEMORY,
+    OPERAND_TYPE_IMMEDIATE
+} operand_type_t;
+
+// Operand structure
+typedef struct _operand_t {
+    operand_type_t type;     // 操作数类型：寄存器、内存、立即数
+    bool is_source;          // 是否是源操作数
+    bool is_dest;            // 是否是目标操作数
+    union {
+        int reg;             // 如果是寄存器，存储寄存器编号或名称
+        void *mem_addr;      // 如果是内存，存储内存地址
+        int imm_val;         // 如果是立即数，存储立即数值
+    } value;
+} operand_t;
+
+// Instruction reference structure
+typedef struct _ins_ref_t {
+    app_pc pc;                // 指令地址
+    int opcode;               // 操作码
+    bool is_cbr;              // 是否是条件跳转指令
+    app_pc target_addr;       // 跳转的目标地址
+    app_pc fall_addr;         // 默认执行下一条指令的地址
+    int num_operands;         // 操作数个数
+    operand_t operands[4];    // 操作数特性（假设最多4个操作数，可以根据需要调整）
+    bubble_type_t bubble_type; // 气泡类型，全部是BUBBLE_NONE
+} ins_ref_t;
+
+/* -static_table mode: everything in ins_ref_t that is fixed at translation time
+ * lives in a side table entry written once per PC, indexed by instruction id.
+ * Memory operands in ref hold no address; the dynamic record supplies them.
+ */
+typedef struct _ins_static_t {
+    ins_ref_t ref;
+    int num_mem;              // 每次执行记录的内存地址个数
+} ins_static_t;
+
+/* A dynamic record is one pointer-sized header word followed by num_mem
+ * pointer-sized effective addresses, in source-then-destination order.
+ */
+#define INS_DYN_MEM_BITS 4
+#define INS_DYN_MAX_MEM ((1 << INS_DYN_MEM_BITS) - 1)
+#define INS_DYN_MAKE(id, num_mem) (((uintptr_t)(id) << INS_DYN_MEM_BITS) | (num_mem))
+#define INS_DYN_ID(word) ((unsigned int)((word) >> INS_DYN_MEM_BITS))
+#define INS_DYN_NUM_MEM(word) ((int)((word)&INS_DYN_MAX_MEM))
+#define INS_DYN_SIZE(num_mem) ((1 + (num_mem)) * sizeof(uintptr_t))
+#define INS_DYN_MAX_SIZE INS_DYN_SIZE(INS_DYN_MAX_MEM)
+
+/* Rebuild the full ins_ref_t for one dynamic record. The k-th memory operand
+ * slot takes the k-th recorded address; the slots are a prefix of the
+ * source-then-destination order, so the two line up.
+ */
+static inline void
+ins_ref_from_dyn(const ins_static_t *st, const uintptr_t *mem, ins_ref_t *ref)
+{
+    int i, k = 0;
+    *ref = st->ref;
+    for (i = 0; i < 4 && i < ref->num_operands; i++) {
+        if (ref->operands[i].type == OPERAND_TYPE_MEMORY && k < st->num_mem)
+            ref->operands[i].value.mem_addr = (void *)mem[k++];
+    }
+}
+
+/* -bb_trace mode: one record per execution of a dictionary unit, a straight
+ * run of instructions that ends at a CTI. The record is a header word (unit
+ * id and address count) followed by the addresses of every instruction in
+ * the unit, in order. The dictionary file holds, per unit id, a
+ * bb_dict_entry_t followed by num_instrs side table ids.
+ */
+#define BB_DYN_MEM_BITS 16
+#define BB_DYN_MAX_MEM 1023
+#define BB_DYN_MAKE(id, num_mem) (((uintptr_t)(id) << BB_DYN_MEM_BITS) | (num_mem))
+#define BB_DYN_ID(word) ((unsigned int)((word) >> BB_DYN_MEM_BITS))
+#define BB_DYN_NUM_MEM(word) ((int)((word) & ((1 << BB_DYN_MEM_BITS) - 1)))
+#define BB_DYN_SIZE(num_mem) INS_DYN_SIZE(num_mem)
+#define BB_DYN_MAX_SIZE BB_DYN_SIZE(BB_DYN_MAX_MEM)
+
+typedef struct _bb_dict_entry_t {
+    uintptr_t tag;            // 第一条指令地址
+    unsigned int num_instrs;  // 指令个数
+    unsigned int num_mem;     // 每次执行记录的内存地址个数
+} bb_dict_entry_t;
+
+#endif /* TRACE_RECORDS_H */
@@ -0,0 +1,272 @@
+#ifndef TRACE_RING_H
+#define TRACE_RING_H
+
+/* Single-producer/single-consumer record ring in POSIX shared memory.
+ *
+ * One ring per traced thread. The producer writes records straight into the
+ * mapped slots and publishes them in batches with a release store of head;
+ * the consumer maps the same object, reads head with an acquire load,
+ * processes the published records in place and hands the slots back by
+ * storing tail. Neither side takes a lock or copies a record.
+ *
+ * Slots are fixed size and the capacity is a power of two, so the run of
+ * records from tail up to the end of the slot array is always contiguous.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifndef __cplusplus
+#    include <stdbool.h>
+#endif
+
+#define TR_MAGIC 0x474e4952 /* "RING" */
+#define TR_VERSION 1
+#define TR_CACHE_LINE 64
+/* Records the producer accumulates before a publish */
+#define TR_PUBLISH_BATCH 256
+/* Shared memory object name for a traced thread */
+#define TR_NAME_FORMAT "/drring.%d.%d"
+
+/* Inside a DR client (dr_api.h included first) a waiting producer must not
+ * call into libc's scheduler wrappers; it yields through DR.
+ */
+#ifndef TR_RING_YIELD
+#    ifdef _DR_API_H_
+#        define TR_RING_YIELD() dr_thread_yield()
+#    else
+#        define TR_RING_YIELD() sched_yield()
+#    endif
+#endif
+
+/* Lives at the start of the mapping; head and tail sit on their own lines so
+ * the two sides do not false-share.
+ */
+typedef struct _tr_ring_hdr_t {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t capacity;  /* records, power of two */
+    uint64_t thread_id;
+    uint32_t closed;    /* set by the producer after its last publish */
+    uint8_t pad0[TR_CACHE_LINE - 28];
+    uint64_t head;      /* records published, written by the producer */
+    uint8_t pad1[TR_CACHE_LINE - 8];
+    uint64_t tail;      /* records consumed, written by the consumer */
+    uint8_t pad2[TR_CACHE_LINE - 8];
+} tr_ring_hdr_t;
+
+/* Process-local view of a mapped ring */
+typedef struct _tr_ring_t {
+    tr_ring_hdr_t *hdr;
+    uint8_t *slots;
+    size_t map_size;
+    uint64_t local;     /* producer: next record to write; consumer: next to read */
+    uint64_t published; /* producer: last head stored */
+    uint64_t limit;     /* producer: cached tail + capacity; consumer: cached head */
+    char name[64];
+} tr_ring_t;
+
+static inline size_t
+tr_ring_map_size(uint32_t record_size, uint32_t capacity)
+{
+    return sizeof(tr_ring_hdr_t) + (size_t)record_size * capacity;
+}
+
+static inline bool
+tr_ring_map(tr_ring_t *r, const char *name, bool create, uint32_t record_size,
+            uint32_t capacity, uint64_t thread_id)
+{
+    int fd;
+    size_t size;
+    void *map;
+
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    fd = shm_open(name, create ? O_CREAT | O_TRUNC | O_RDWR : O_RDWR, 0666);
+    if (fd < 0)
+        return false;
+    if (create) {
+        size = tr_ring_map_size(record_size, capacity);
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return false;
+        }
+    } else {
+        struct stat st;
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(tr_ring_hdr_t)) {
+            close(fd);
+            return false;
+        }
+        size = st.st_size;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    r->hdr = (tr_ring_hdr_t *)map;
+    r->slots = (uint8_t *)map + sizeof(tr_ring_hdr_t);
+    r->map_size = size;
+    if (create) {
+        r->hdr->record_size = record_size;
+        r->hdr->capacity = capacity;
+        r->hdr->thread_id = thread_id;
+        r->hdr->version = TR_VERSION;
+        r->limit = capacity;
+        /* magic last: a consumer polling for the object sees a full header */
+        __atomic_store_n(&r->hdr->magic, TR_MAGIC, __ATOMIC_RELEASE);
+        return true;
+    }
+    if (__atomic_load_n(&r->hdr->magic, __ATOMIC_ACQUIRE) != TR_MAGIC ||
+        size < tr_ring_map_size(r->hdr->record_size, r->hdr->capacity)) {
+        munmap(map, size);
+        r->hdr = NULL;
+        return false;
+    }
+    r->local = __atomic_load_n(&r->hdr->tail, __ATOMIC_ACQUIRE);
+    r->limit = r->local;
+    return true;
+}
+
+/* Producer side: creates (or recreates) the object. capacity must be a power of two. */
+static inline bool
+tr_ring_create(tr_ring_t *r, const char *name, uint32_t record_size, uint32_t capacity,
+               uint64_t thread_id)
+{
+    if (capacity == 0 || (capacity & (capacity - 1)) != 0)
+        return false;
+    return tr_ring_map(r, name, true, record_size, capacity, thread_id);
+}
+
+/* Consumer side: maps an existing ring */
+static inline bool
+tr_ring_open(tr_ring_t *r, const char *name)
+{
+    return tr_ring_map(r, name, false, 0, 0, 0);
+}
+
+static inline void
+tr_ring_unmap(tr_ring_t *r)
+{
+    if (r->hdr != NULL)
+        munmap(r->hdr, r->map_size);
+    r->hdr = NULL;
+}
+
+/* Makes every record written so far visible to the consumer */
+static inline void
+tr_ring_publish(tr_ring_t *r)
+{
+    if (r->local != r->published) {
+        __atomic_store_n(&r->hdr->head, r->local, __ATOMIC_RELEASE);
+        r->published = r->local;
+    }
+}
+
+/* Returns the next free slot to fill in place, waiting for the consumer if
+ * the ring is full. Follow with tr_ring_commit().
+ */
+static inline void *
+tr_ring_slot(tr_ring_t *r)
+{
+    tr_ring_hdr_t *hdr = r->hdr;
+    if (r->local == r->limit) {
+        /* only re-read the consumer's line once the cached view runs out */
+        r->limit = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) + hdr->capacity;
+        while (r->local == r->limit) {
+            tr_ring_publish(r);
+            TR_RING_YIELD();
+            r->limit = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE) + hdr->capacity;
+        }
+    }
+    return r->slots + (size_t)(r->local & (hdr->capacity - 1)) * hdr->record_size;
+}
+
+static inline void
+tr_ring_commit(tr_ring_t *r)
+{
+    r->local++;
+    if (r->local - r->published >= TR_PUBLISH_BATCH)
+        tr_ring_publish(r);
+}
+
+/* Returns the next free slot, like tr_ring_slot(), and in *count how many
+ * records can be written from it in a row: up to the end of the slot array,
+ * the consumer's tail and the end of the current publish batch, whichever is
+ * nearest. Follow with tr_ring_commit_n() for the records actually written.
+ */
+static inline void *
+tr_ring_reserve(tr_ring_t *r, size_t *count)
+{
+    void *slot = tr_ring_slot(r);
+    uint64_t n = r->hdr->capacity - (r->local & (r->hdr->capacity - 1));
+    if (n > r->limit - r->local)
+        n = r->limit - r->local;
+    if (n > TR_PUBLISH_BATCH - (r->local - r->published))
+        n = TR_PUBLISH_BATCH - (r->local - r->published);
+    *count = (size_t)n;
+    return slot;
+}
+
+static inline void
+tr_ring_commit_n(tr_ring_t *r, size_t count)
+{
+    r->local += count;
+    if (r->local - r->published >= TR_PUBLISH_BATCH)
+        tr_ring_publish(r);
+}
+
+/* Producer is done: publishes the rest and marks the ring closed */
+static inline void
+tr_ring_close(tr_ring_t *r)
+{
+    tr_ring_publish(r);
+    __atomic_store_n(&r->hdr->closed, 1, __ATOMIC_RELEASE);
+    tr_ring_unmap(r);
+}
+
+/* Consumer side: returns how many published records can be read in place
+ * starting at *records, never running past the end of the slot array. 0
+ * means nothing is published yet.
+ */
+static inline size_t
+tr_ring_peek(tr_ring_t *r, const void **records)
+{
+    tr_ring_hdr_t *hdr = r->hdr;
+    uint64_t index, avail;
+    if (r->local == r->limit) {
+        r->limit = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+        if (r->local == r->limit)
+            return 0;
+    }
+    index = r->local & (hdr->capacity - 1);
+    avail = r->limit - r->local;
+    if (avail > hdr->capacity - index)
+        avail = hdr->capacity - index;
+    *records = r->slots + (size_t)index * hdr->record_size;
+    return (size_t)avail;
+}
+
+/* Consumer side: hands count records back to the producer */
+static inline void
+tr_ring_release(tr_ring_t *r, size_t count)
+{
+    r->local += count;
+    __atomic_store_n(&r->hdr->tail, r->local, __ATOMIC_RELEASE);
+}
+
+/* True once the producer closed the ring and everything has been consumed */
+static inline bool
+tr_ring_drained(tr_ring_t *r)
+{
+    return __atomic_load_n(&r->hdr->closed, __ATOMIC_ACQUIRE) != 0 &&
+        r->local == __atomic_load_n(&r->hdr->head, __ATOMIC_ACQUIRE);
+}
+
+#endif /* TRACE_RING_H */
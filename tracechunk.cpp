@@ -0,0 +1,542 @@
+// tracechunk: Python access to trace records in bulk.
+//
+// A Reader yields Chunk objects. Each chunk exposes its records through the
+// buffer protocol with a structured format, so NumPy works on them with no
+// per-record Python objects:
+//
+//     import numpy as np, tracechunk
+//     for chunk in tracechunk.Reader("bigdata.1234.trace"):
+//         refs = np.frombuffer(chunk, dtype=np.dtype(chunk.dtype))
+//         print(np.bincount(refs["opcode"]))
+//
+// Sources: chunked trace_format.h files (kind comes from the header), raw
+// record files (mmap'd, chunks point straight into the mapping) and FIFOs
+// such as /tmp/my_pipe (MyStruct) and /tmp/my_fifo (pipe.c's struct Data).
+// Raw sources need kind= unless the path is one of those two FIFOs. A raw
+// source that ends partway through a record raises ValueError once the
+// whole records before it have been read.
+//
+// Build:
+//   g++ -O2 -shared -fPIC $(python3-config --includes) tracechunk.cpp -o tracechunk$(python3-config --extension-suffix)
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+#include "trace_format.h"
+
+// pipe.c's record on /tmp/my_fifo ('ii100s')
+typedef struct {
+    int a;
+    int b;
+    char str[100];
+} fifo_data_t;
+
+struct Field {
+    const char *name;
+    const char *dtype; // NumPy type string; NULL for the operand_t array
+    size_t offset;
+};
+
+struct Kind {
+    const char *name;
+    size_t size;
+    const char *format; // PEP 3118 format of one record
+    std::vector<Field> fields;
+};
+
+#define FIELD(type, member, dtype) { #member, dtype, offsetof(type, member) }
+
+static const Kind kinds[] = {
+    { "mem_ref", sizeof(mem_ref_t), "T{H:type:H:size:4xQ:addr:}",
+      { FIELD(mem_ref_t, type, "<u2"), FIELD(mem_ref_t, size, "<u2"),
+        FIELD(mem_ref_t, addr, "<u8") } },
+    { "ins_ref", sizeof(ins_ref_t),
+      "T{Q:pc:i:opcode:?:is_cbr:3xQ:target_addr:Q:fall_addr:i:num_operands:4x"
+      "(4)T{i:type:?:is_source:?:is_dest:2xq:value:}:operands:i:bubble_type:4x}",
+      { FIELD(ins_ref_t, pc, "<u8"), FIELD(ins_ref_t, opcode, "<i4"),
+        FIELD(ins_ref_t, is_cbr, "?"), FIELD(ins_ref_t, target_addr, "<u8"),
+        FIELD(ins_ref_t, fall_addr, "<u8"), FIELD(ins_ref_t, num_operands, "<i4"),
+        { "operands", NULL /* operand_t[4], see Chunk_get_dtype */,
+          offsetof(ins_ref_t, operands) },
+        FIELD(ins_ref_t, bubble_type, "<i4") } },
+    { "branch_ref", sizeof(branch_ref_t), "T{Q:pc:Q:target:B:taken:B:kind:6x}",
+      { FIELD(branch_ref_t, pc, "<u8"), FIELD(branch_ref_t, target, "<u8"),
+        FIELD(branch_ref_t, taken, "u1"), FIELD(branch_ref_t, kind, "u1") } },
+    { "mystruct", sizeof(MyStruct), "T{=i:id:i:opcode:50s:opcode_name:}",
+      { FIELD(MyStruct, id, "<i4"), FIELD(MyStruct, opcode, "<i4"),
+        FIELD(MyStruct, opcode_name, "S50") } },
+    { "fifo_data", sizeof(fifo_data_t), "T{i:a:i:b:100s:str:}",
+      { FIELD(fifo_data_t, a, "<i4"), FIELD(fifo_data_t, b, "<i4"),
+        FIELD(fifo_data_t, str, "S100") } },
+};
+
+static_assert(sizeof(mem_ref_t) == 16 && sizeof(ins_ref_t) == 112 &&
+                  sizeof(branch_ref_t) == 24 && sizeof(MyStruct) == 58,
+              "format strings assume the LP64 record layouts");
+
+static const Kind *
+find_kind(const char *name)
+{
+    for (const Kind &k : kinds) {
+        if (strcmp(k.name, name) == 0)
+            return &k;
+    }
+    return NULL;
+}
+
+/***************************************************************************
+ * Reader
+ */
+
+typedef struct {
+    PyObject_HEAD
+    int fd;
+    const Kind *kind;
+    size_t batch_bytes;
+    bool chunked;
+    bool eof;
+    tf_reader_t tf;
+    std::vector<uint8_t> *scratch;
+    const uint8_t *map; // raw regular files
+    size_t map_size;
+    size_t map_pos;
+    size_t map_tail;             // bytes past the last whole record
+    std::vector<uint8_t> *carry; // partial record left by a short FIFO read
+} ReaderObject;
+
+typedef struct {
+    PyObject_HEAD
+    const Kind *kind;
+    uint8_t *owned;      // decoded or read data, or NULL for a mapped view
+    const uint8_t *data;
+    Py_ssize_t count;
+    Py_ssize_t shape;
+    Py_ssize_t stride;
+    PyObject *reader;    // keeps the mapping alive
+    int exports;
+} ChunkObject;
+
+static PyTypeObject ChunkType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+static size_t
+read_some(int fd, uint8_t *dst, size_t size, size_t min)
+{
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = read(fd, dst + done, size - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        done += n;
+        if (done >= min)
+            break;
+    }
+    return done;
+}
+
+static size_t
+tf_fd_read(void *ctx, void *buf, size_t size)
+{
+    return read_some(*(int *)ctx, (uint8_t *)buf, size, size);
+}
+
+static int
+Reader_init(ReaderObject *self, PyObject *args, PyObject *kwds)
+{
+    static const char *kwlist[] = { "path", "kind", "batch", NULL };
+    const char *path, *kind_name = NULL;
+    Py_ssize_t batch = 1 << 16;
+    self->fd = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|zn", (char **)kwlist, &path,
+                                     &kind_name, &batch))
+        return -1;
+    if (batch <= 0) {
+        PyErr_SetString(PyExc_ValueError, "batch must be positive");
+        return -1;
+    }
+    self->scratch = new std::vector<uint8_t>();
+    self->carry = new std::vector<uint8_t>();
+
+    // opening a FIFO blocks until the writer shows up
+    int fd;
+    Py_BEGIN_ALLOW_THREADS
+    fd = open(path, O_RDONLY);
+    Py_END_ALLOW_THREADS
+    if (fd < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+    self->fd = fd;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+        return -1;
+    }
+
+    uint32_t magic = 0;
+    size_t got;
+    Py_BEGIN_ALLOW_THREADS
+    got = read_some(fd, (uint8_t *)&magic, sizeof(magic), sizeof(magic));
+    Py_END_ALLOW_THREADS
+    self->chunked = got == sizeof(magic) && magic == TF_MAGIC;
+
+    if (self->chunked) {
+        tf_file_header_t *hdr = &self->tf.header;
+        memcpy(hdr, &magic, sizeof(magic));
+        if (read_some(fd, (uint8_t *)hdr + sizeof(magic), sizeof(*hdr) - sizeof(magic),
+                      sizeof(*hdr) - sizeof(magic)) != sizeof(*hdr) - sizeof(magic) ||
+            hdr->version > TF_VERSION) {
+            PyErr_Format(PyExc_ValueError, "%s: bad trace header", path);
+            return -1;
+        }
+        if (kind_name == NULL) {
+            kind_name = hdr->schema == TF_SCHEMA_MEM_REF      ? "mem_ref"
+                : hdr->schema == TF_SCHEMA_INS_REF            ? "ins_ref"
+                : hdr->schema == TF_SCHEMA_BRANCH_REF         ? "branch_ref"
+                                                              : NULL;
+        }
+        self->scratch->resize(TF_READER_SCRATCH_SIZE);
+        self->tf.read = tf_fd_read;
+        self->tf.ctx = &self->fd;
+        self->tf.scratch = self->scratch->data();
+    } else {
+        self->carry->assign((uint8_t *)&magic, (uint8_t *)&magic + got);
+        if (kind_name == NULL) {
+            kind_name = strcmp(path, "/tmp/my_pipe") == 0 ? "mystruct"
+                : strcmp(path, "/tmp/my_fifo") == 0      ? "fifo_data"
+                                                         : NULL;
+        }
+    }
+    if (kind_name == NULL) {
+        PyErr_Format(PyExc_ValueError, "%s: record kind unknown, pass kind=", path);
+        return -1;
+    }
+    self->kind = find_kind(kind_name);
+    if (self->kind == NULL) {
+        PyErr_Format(PyExc_ValueError, "unknown kind '%s'", kind_name);
+        return -1;
+    }
+    if (self->chunked && self->tf.header.record_size != self->kind->size) {
+        PyErr_Format(PyExc_ValueError, "%s: records are %u bytes, not %s", path,
+                     self->tf.header.record_size, kind_name);
+        return -1;
+    }
+    self->batch_bytes = (size_t)batch * self->kind->size;
+
+    if (!self->chunked && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+            self->map = (const uint8_t *)map;
+            self->map_size = st.st_size / self->kind->size * self->kind->size;
+            self->map_tail = st.st_size - self->map_size;
+        }
+    }
+    return 0;
+}
+
+static void
+Reader_dealloc(ReaderObject *self)
+{
+    if (self->map != NULL)
+        munmap((void *)self->map, self->map_size);
+    if (self->fd >= 0)
+        close(self->fd);
+    delete self->scratch;
+    delete self->carry;
+    Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+static ChunkObject *
+new_chunk(ReaderObject *reader)
+{
+    ChunkObject *chunk = PyObject_New(ChunkObject, &ChunkType);
+    if (chunk == NULL)
+        return NULL;
+    chunk->kind = reader->kind;
+    chunk->owned = NULL;
+    chunk->data = NULL;
+    chunk->count = 0;
+    chunk->stride = reader->kind->size;
+    chunk->reader = NULL;
+    chunk->exports = 0;
+    return chunk;
+}
+
+// End of a raw stream: a partial record left over means the file was cut short
+static PyObject *
+truncated(ReaderObject *self, size_t tail)
+{
+    if (tail != 0) {
+        PyErr_Format(PyExc_ValueError, "trace ends in a partial %s record (%zu of %zu bytes)",
+                     self->kind->name, tail, self->kind->size);
+    }
+    return NULL;
+}
+
+static PyObject *
+Reader_next(ReaderObject *self)
+{
+    if (self->eof)
+        return NULL;
+    ChunkObject *chunk = new_chunk(self);
+    if (chunk == NULL)
+        return NULL;
+    size_t size = self->kind->size;
+
+    if (self->map != NULL) {
+        // zero copy: the chunk is a view into the mapping
+        size_t len = self->map_size - self->map_pos;
+        if (len > self->batch_bytes)
+            len = self->batch_bytes;
+        if (len == 0) {
+            Py_DECREF(chunk);
+            self->eof = true;
+            return truncated(self, self->map_tail);
+        }
+        chunk->data = self->map + self->map_pos;
+        chunk->count = len / size;
+        Py_INCREF(self);
+        chunk->reader = (PyObject *)self;
+        self->map_pos += len;
+        return (PyObject *)chunk;
+    }
+
+    long bytes = 0;
+    bool failed = false;
+    if (self->chunked) {
+        chunk->owned = (uint8_t *)PyMem_RawMalloc(TF_CHUNK_SIZE);
+        if (chunk->owned == NULL) {
+            Py_DECREF(chunk);
+            return PyErr_NoMemory();
+        }
+        Py_BEGIN_ALLOW_THREADS
+        tf_chunk_header_t hdr;
+        do
+            bytes = tf_read_chunk(&self->tf, chunk->owned, &hdr);
+        while (bytes > 0 && (size_t)bytes < size);
+        Py_END_ALLOW_THREADS
+        failed = bytes < 0;
+    } else {
+        chunk->owned = (uint8_t *)PyMem_RawMalloc(self->batch_bytes + size);
+        if (chunk->owned == NULL) {
+            Py_DECREF(chunk);
+            return PyErr_NoMemory();
+        }
+        size_t have = self->carry->size();
+        memcpy(chunk->owned, self->carry->data(), have);
+        Py_BEGIN_ALLOW_THREADS
+        // hand out whatever whole records arrived rather than waiting for a full batch
+        have += read_some(self->fd, chunk->owned + have, self->batch_bytes - have,
+                          size - have % size);
+        Py_END_ALLOW_THREADS
+        bytes = have / size * size;
+        self->carry->assign(chunk->owned + bytes, chunk->owned + have);
+    }
+    if (failed) {
+        Py_DECREF(chunk);
+        self->eof = true;
+        PyErr_SetString(PyExc_ValueError, "corrupt trace chunk");
+        return NULL;
+    }
+    if (bytes == 0) {
+        Py_DECREF(chunk);
+        self->eof = true;
+        return truncated(self, self->chunked ? 0 : self->carry->size());
+    }
+    chunk->data = chunk->owned;
+    chunk->count = bytes / size;
+    return (PyObject *)chunk;
+}
+
+static PyObject *
+Reader_get_kind(ReaderObject *self, void *closure)
+{
+    return PyUnicode_FromString(self->kind->name);
+}
+
+static PyObject *
+Reader_get_header(ReaderObject *self, void *closure)
+{
+    if (!self->chunked)
+        Py_RETURN_NONE;
+    const tf_file_header_t *h = &self->tf.header;
+    return Py_BuildValue("{s:I,s:I,s:I,s:I,s:K,s:K}", "version", (unsigned)h->version,
+                         "arch", (unsigned)h->arch, "schema", (unsigned)h->schema,
+                         "flags", h->flags, "thread_id",
+                         (unsigned long long)h->thread_id, "instr_count",
+                         (unsigned long long)h->instr_count);
+}
+
+static PyGetSetDef Reader_getset[] = {
+    { "kind", (getter)Reader_get_kind, NULL, "record kind", NULL },
+    { "header", (getter)Reader_get_header, NULL, "trace file header, None for raw input",
+      NULL },
+    { NULL }
+};
+
+static PyTypeObject ReaderType = { PyVarObject_HEAD_INIT(NULL, 0) };
+
+/***************************************************************************
+ * Chunk
+ */
+
+static void
+Chunk_dealloc(ChunkObject *self)
+{
+    PyMem_RawFree(self->owned);
+    Py_XDECREF(self->reader);
+    PyObject_Free(self);
+}
+
+static int
+Chunk_getbuffer(ChunkObject *self, Py_buffer *view, int flags)
+{
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "trace chunks are read-only");
+        return -1;
+    }
+    self->shape = self->count;
+    view->obj = (PyObject *)self;
+    Py_INCREF(self);
+    view->buf = (void *)self->data;
+    view->len = self->count * self->stride;
+    view->readonly = 1;
+    view->itemsize = self->stride;
+    view->format = (flags & PyBUF_FORMAT) ? (char *)self->kind->format : NULL;
+    view->ndim = 1;
+    view->shape = (flags & PyBUF_ND) ? &self->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? &self->stride : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    self->exports++;
+    return 0;
+}
+
+static void
+Chunk_releasebuffer(ChunkObject *self, Py_buffer *view)
+{
+    self->exports--;
+}
+
+static Py_ssize_t
+Chunk_len(ChunkObject *self)
+{
+    return self->count;
+}
+
+// {'names': [...], 'formats': [...], 'offsets': [...], 'itemsize': n}, for np.dtype()
+static PyObject *
+Chunk_get_dtype(ChunkObject *self, void *closure)
+{
+    const Kind *k = self->kind;
+    PyObject *names = PyList_New(0), *formats = PyList_New(0), *offsets = PyList_New(0);
+    PyObject *res = NULL;
+    if (names == NULL || formats == NULL || offsets == NULL)
+        goto done;
+    for (const Field &f : k->fields) {
+        PyObject *n = PyUnicode_FromString(f.name), *o = PyLong_FromSize_t(f.offset), *t;
+        if (f.dtype != NULL)
+            t = PyUnicode_FromString(f.dtype);
+        else {
+            t = Py_BuildValue("({s:[ssss],s:[ssss],s:[nnnn],s:n},(i))", "names", "type",
+                              "is_source", "is_dest", "value", "formats", "<i4", "?", "?",
+                              "<i8", "offsets", (Py_ssize_t)offsetof(operand_t, type),
+                              (Py_ssize_t)offsetof(operand_t, is_source),
+                              (Py_ssize_t)offsetof(operand_t, is_dest),
+                              (Py_ssize_t)offsetof(operand_t, value), "itemsize",
+                              (Py_ssize_t)sizeof(operand_t), 4);
+        }
+        bool ok = n != NULL && t != NULL && o != NULL && PyList_Append(names, n) == 0 &&
+            PyList_Append(formats, t) == 0 && PyList_Append(offsets, o) == 0;
+        Py_XDECREF(n);
+        Py_XDECREF(t);
+        Py_XDECREF(o);
+        if (!ok)
+            goto done;
+    }
+    res = Py_BuildValue("{s:O,s:O,s:O,s:n}", "names", names, "formats", formats,
+                        "offsets", offsets, "itemsize", (Py_ssize_t)k->size);
+done:
+    Py_XDECREF(names);
+    Py_XDECREF(formats);
+    Py_XDECREF(offsets);
+    return res;
+}
+
+static PyObject *
+Chunk_get_kind(ChunkObject *self, void *closure)
+{
+    return PyUnicode_FromString(self->kind->name);
+}
+
+static PyGetSetDef Chunk_getset[] = {
+    { "dtype", (getter)Chunk_get_dtype, NULL, "NumPy dtype spec of one record", NULL },
+    { "kind", (getter)Chunk_get_kind, NULL, "record kind", NULL },
+    { NULL }
+};
+
+static PyBufferProcs Chunk_as_buffer = { (getbufferproc)Chunk_getbuffer,
+                                         (releasebufferproc)Chunk_releasebuffer };
+static PySequenceMethods Chunk_as_sequence = { (lenfunc)Chunk_len };
+
+/***************************************************************************
+ * Module
+ */
+
+static struct PyModuleDef tracechunk_module = {
+    PyModuleDef_HEAD_INIT, "tracechunk",
+    "Bulk, zero-copy access to trace records through the buffer protocol.", -1, NULL
+};
+
+PyMODINIT_FUNC
+PyInit_tracechunk(void)
+{
+    ReaderType.tp_name = "tracechunk.Reader";
+    ReaderType.tp_basicsize = sizeof(ReaderObject);
+    ReaderType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ReaderType.tp_doc = "Reader(path, kind=None, batch=65536): iterate over Chunks";
+    ReaderType.tp_new = PyType_GenericNew;
+    ReaderType.tp_init = (initproc)Reader_init;
+    ReaderType.tp_dealloc = (destructor)Reader_dealloc;
+    ReaderType.tp_iter = PyObject_SelfIter;
+    ReaderType.tp_iternext = (iternextfunc)Reader_next;
+    ReaderType.tp_getset = Reader_getset;
+
+    ChunkType.tp_name = "tracechunk.Chunk";
+    ChunkType.tp_basicsize = sizeof(ChunkObject);
+    ChunkType.tp_flags = Py_TPFLAGS_DEFAULT;
+    ChunkType.tp_doc = "A batch of records, exported through the buffer protocol";
+    ChunkType.tp_dealloc = (destructor)Chunk_dealloc;
+    ChunkType.tp_as_buffer = &Chunk_as_buffer;
+    ChunkType.tp_as_sequence = &Chunk_as_sequence;
+    ChunkType.tp_getset = Chunk_getset;
+
+    if (PyType_Ready(&ReaderType) < 0 || PyType_Ready(&ChunkType) < 0)
+        return NULL;
+    PyObject *m = PyModule_Create(&tracechunk_module);
+    if (m == NULL)
+        return NULL;
+    PyObject *names = PyTuple_New(sizeof(kinds) / sizeof(kinds[0]));
+    if (names == NULL) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++)
+        PyTuple_SET_ITEM(names, i, PyUnicode_FromString(kinds[i].name));
+    Py_INCREF(&ReaderType);
+    if (PyModule_AddObject(m, "Reader", (PyObject *)&ReaderType) < 0 ||
+        PyModule_AddObject(m, "KINDS", names) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ChunkType);
+    PyModule_AddObject(m, "Chunk", (PyObject *)&ChunkType);
+    return m;
+}